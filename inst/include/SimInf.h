@@ -72,7 +72,13 @@ typedef enum {
     SIMINF_ERR_EVENTS_N             = -15,
     SIMINF_ERR_EVENT_SHIFT          = -16,
     SIMINF_ERR_SHIFT_OUT_OF_BOUNDS  = -17,
-    SIMINF_ERR_INVALID_PROPORTION   = -18
+    SIMINF_ERR_INVALID_PROPORTION   = -18,
+    SIMINF_ERR_INVALID_CONTROL      = -19,
+    SIMINF_ERR_WRITE_FILE           = -20,
+    SIMINF_ERR_READ_EVENTS          = -21,
+    SIMINF_ERR_INVALID_CHECKPOINT   = -22,
+    SIMINF_ERR_COMPACT_OVERFLOW     = -23,
+    SIMINF_ERR_INVALID_NEIGHBORS    = -24
 } SimInf_error_code;
 
 /* Forward declaration of the transition rate function. */
@@ -83,6 +89,74 @@ typedef double (*TRFun)(
     const double *gdata,
     double t);
 
+/* Forward declaration of the function that computes the transition
+ * rates of several transitions in a node. rate[k] is set to the rate
+ * of transition tr[k] for k = 0, ..., n - 1. If tr is NULL, n is the
+ * number of transitions and rate[j] is set to the rate of transition
+ * j. */
+typedef void (*TRRatesFun)(
+    double *rate,
+    const int *tr,
+    int n,
+    const int *u,
+    const double *v,
+    const double *ldata,
+    const double *gdata,
+    double t);
+
+/* Forward declaration of the function that computes the rates of
+ * all transitions in n consecutive nodes, where rate[i * Nt + j] is
+ * set to the rate of transition j in node i. The state of node i is
+ * at &u[i * Nc], &v[i * Nd] and &ldata[i * Nld]. The loop over the
+ * nodes can be written so that the compiler vectorizes it. */
+typedef void (*TRNodesFun)(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t);
+
+/**
+ * Compute the rate of transition tr in n consecutive nodes with the
+ * transition rate function tr_fun, and store it in rate[i * Nt + tr]
+ * for node i. A model implements its TRNodesFun with one call per
+ * transition, where tr_fun is a compile-time constant, so that the
+ * compiler can inline the transition rate function in the loop over
+ * the nodes and vectorize it.
+ */
+static inline void
+SimInf_rates_nodes(
+    TRFun tr_fun,
+    int tr,
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    int i;
+
+    #ifdef _OPENMP
+    #  pragma omp simd
+    #endif
+    for (i = 0; i < n; i++) {
+        rate[i * Nt + tr] = tr_fun(
+            &u[i * Nc], &v[i * Nd], &ldata[i * Nld], gdata, t);
+    }
+}
+
 /* Forward declaration of the post time step callback function. */
 typedef int (*PTSFun)(
     double *v_new,
@@ -93,6 +167,33 @@ typedef int (*PTSFun)(
     int node,
     double t);
 
+/* The neighbors of each node in the 'neighbors' matrix of the model,
+ * in compressed sparse column format. The neighbors of node j are
+ * ir[k] at the distance pr[k] for k = jc[j], ..., jc[j + 1] - 1. ir
+ * is NULL if the model has no neighbors. N is the number of
+ * individuals in each node, counted by the solver from the current
+ * compartment state before the post time step function is called. */
+typedef struct SimInf_neighbors
+{
+    const int *ir;
+    const int *jc;
+    const double *pr;
+    const double *N;
+} SimInf_neighbors;
+
+/* Forward declaration of the post time step callback function of a
+ * model where the continuous state depends on the neighbors of the
+ * node. */
+typedef int (*PTSNeighborsFun)(
+    double *v_new,
+    const int *u,
+    const double *v,
+    const double *ldata,
+    const double *gdata,
+    const SimInf_neighbors *neighbors,
+    int node,
+    double t);
+
 /* Forward declaration of the function to initiate and run the
  * simulation */
 SEXP SimInf_run(
@@ -101,6 +202,30 @@ SEXP SimInf_run(
     TRFun *tr_fun,
     PTSFun pts_fun);
 
+/* Forward declaration of the function to initiate and run the
+ * simulation, where the solvers compute the transition rates in a
+ * node with rates_fun, and the rates in many nodes at once with
+ * nodes_fun, instead of calling each function in tr_fun. Both
+ * rates_fun and nodes_fun can be NULL. */
+SEXP SimInf_run_rates(
+    SEXP model,
+    SEXP solver,
+    TRFun *tr_fun,
+    TRRatesFun rates_fun,
+    TRNodesFun nodes_fun,
+    PTSFun pts_fun);
+
+/* Forward declaration of the function to initiate and run the
+ * simulation of a model where the post time step function receives
+ * the neighbors of the nodes. */
+SEXP SimInf_run_neighbors(
+    SEXP model,
+    SEXP solver,
+    TRFun *tr_fun,
+    TRRatesFun rates_fun,
+    TRNodesFun nodes_fun,
+    PTSNeighborsFun pts_fun);
+
 /**
  * Decay of environmental infectious pressure with a forward Euler
  * step.
@@ -139,7 +264,10 @@ double SimInf_forward_euler_linear_decay(
 
 /**
  * Local spread of the environmental infectious pressure phi among
- * proximal nodes.
+ * proximal nodes. When called from the post time step function with
+ * the compartment state of the first node, the number of
+ * individuals in the neighbors is taken from a vector that the
+ * solver counts once per time step.
  *
  * @param neighbors Spatial coupling between nodes where 'neighbors'
  * is a vector of pairs (index, distance) to neighbor nodes. The pair
@@ -158,4 +286,30 @@ double SimInf_local_spread(
     const int *u, const double N_i,
     const double phi_i, const int Nc, const double D);
 
+/**
+ * Local spread of the environmental infectious pressure phi among
+ * proximal nodes, where the neighbors of each node and the distance
+ * to the neighbors are in the sparse 'neighbors' matrix of the
+ * model, which the solver passes to the post time step function.
+ *
+ * @param ls The contribution from neighbors to phi in node i, or 0
+ * if the model has no neighbors.
+ * @param neighbors The neighbors of each node.
+ * @param node The node i.
+ * @param phi Vector with phi in each node
+ * @param u The compartment state vector in each node.
+ * @param N_i The number of individuals in node i.
+ * @param phi_i The environmental infectious pressure phi in node i.
+ * @param Nc The number of compartments in each node.
+ * @param D The spatial coupling of the environmental infectious
+ * pressure phi among proximal nodes.
+ * @return 0 if Ok, else SIMINF_ERR_INVALID_NEIGHBORS if neighbors is
+ * NULL.
+ */
+int SimInf_local_spread_neighbors(
+    double *ls, const SimInf_neighbors *neighbors,
+    const int node, const double *phi,
+    const int *u, const double N_i,
+    const double phi_i, const int Nc, const double D);
+
 #endif
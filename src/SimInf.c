@@ -25,9 +25,11 @@
 #include <R_ext/Visibility.h>
 #include "misc/SimInf_arg.h"
 #include "misc/SimInf_openmp.h"
+#include "misc/SimInf_trajectory.h"
 #include "solvers/SimInf_solver.h"
 #include "solvers/ssm/SimInf_solver_ssm.h"
 #include "solvers/aem/SimInf_solver_aem.h"
+#include "solvers/tleap/SimInf_solver_tleap.h"
 
 static void
 SimInf_raise_error(
@@ -79,34 +81,365 @@ SimInf_raise_error(
     case SIMINF_ERR_INVALID_PROPORTION:
         Rf_error("Invalid proportion detected (< 0.0 or > 1.0).");
         break;
+    case SIMINF_ERR_INVALID_CONTROL:
+        Rf_error("Invalid 'control' value.");
+        break;
+    case SIMINF_ERR_WRITE_FILE:
+        Rf_error("Unable to write the trajectory to file.");
+        break;
+    case SIMINF_ERR_READ_EVENTS:
+        Rf_error("Unable to read the scheduled events from file.");
+        break;
+    case SIMINF_ERR_INVALID_CHECKPOINT:
+        Rf_error("Unable to resume the simulation from the checkpoint.");
+        break;
+    case SIMINF_ERR_COMPACT_OVERFLOW:
+        Rf_error("The number of individuals in a compartment is too "
+                 "large for the compact trajectory (> 65535).");
+        break;
+    case SIMINF_ERR_INVALID_NEIGHBORS:
+        Rf_error("Invalid 'neighbors' slot in the model.");
+        break;
     default:                                        /* #nocov */
         Rf_error("Unknown error code: %i.", error); /* #nocov */
         break;
     }
 }
 
+/**
+ * Setup the reducers of the solution from the control parameters
+ * 'groups', 'first' and 'prevalence' of the solver.
+ *
+ * @param args Structure with data for the solver. The number of
+ *        nodes and compartments must be specified.
+ * @param solver The solver argument with the control parameters.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_reducers_setup(
+    SimInf_solver_args *args,
+    SEXP solver)
+{
+    SEXP groups = SimInf_arg_control(solver, "groups");
+    SEXP first = SimInf_arg_control(solver, "first");
+    SEXP prevalence = SimInf_arg_control(solver, "prevalence");
+
+    if (!Rf_isNull(groups)) {
+        if (!Rf_isInteger(groups) || Rf_length(groups) != args->Nn)
+            return SIMINF_ERR_INVALID_CONTROL;
+
+        /* Convert the one-based groups to zero-based groups. */
+        int *group = (int *)R_alloc(args->Nn, sizeof(int));
+        for (int i = 0; i < args->Nn; i++) {
+            if (INTEGER(groups)[i] == NA_INTEGER || INTEGER(groups)[i] < 1)
+                return SIMINF_ERR_INVALID_CONTROL;
+            group[i] = INTEGER(groups)[i] - 1;
+            if (group[i] >= args->Ngroup)
+                args->Ngroup = group[i] + 1;
+        }
+        args->group = group;
+    }
+
+    if (!Rf_isNull(first)) {
+        if (!Rf_isInteger(first) || Rf_length(first) < 1)
+            return SIMINF_ERR_INVALID_CONTROL;
+
+        /* Convert the one-based compartments to zero-based
+         * compartments. */
+        int *first_select = (int *)R_alloc(Rf_length(first), sizeof(int));
+        for (int i = 0; i < Rf_length(first); i++) {
+            if (INTEGER(first)[i] == NA_INTEGER ||
+                INTEGER(first)[i] < 1 ||
+                INTEGER(first)[i] > args->Nc)
+                return SIMINF_ERR_INVALID_CONTROL;
+            first_select[i] = INTEGER(first)[i] - 1;
+        }
+        args->Nfirst = Rf_length(first);
+        args->first_select = first_select;
+    }
+
+    if (!Rf_isNull(prevalence)) {
+        SEXP cases, population;
+
+        if (!Rf_isNewList(prevalence) || Rf_length(prevalence) != 2)
+            return SIMINF_ERR_INVALID_CONTROL;
+        cases = VECTOR_ELT(prevalence, 0);
+        population = VECTOR_ELT(prevalence, 1);
+        if (!Rf_isInteger(cases) || Rf_length(cases) < 1 ||
+            !Rf_isInteger(population) || Rf_length(population) < 1)
+            return SIMINF_ERR_INVALID_CONTROL;
+
+        /* Convert the one-based compartments to zero-based
+         * compartments. */
+        int *compartments = (int *)R_alloc(
+            Rf_length(cases) + Rf_length(population), sizeof(int));
+        for (int i = 0; i < Rf_length(cases) + Rf_length(population); i++) {
+            const int j = i < Rf_length(cases) ?
+                INTEGER(cases)[i] :
+                INTEGER(population)[i - Rf_length(cases)];
+            if (j == NA_INTEGER || j < 1 || j > args->Nc)
+                return SIMINF_ERR_INVALID_CONTROL;
+            compartments[i] = j - 1;
+        }
+        args->Ncases = Rf_length(cases);
+        args->cases = compartments;
+        args->Npopulation = Rf_length(population);
+        args->population = &compartments[args->Ncases];
+    }
+
+    return 0;
+}
+
+/**
+ * Allocate the output of the reducers of the solution.
+ *
+ * @param model The model with the result from the simulation.
+ * @param args Structure with data for the solver. The pointers to
+ *        the output of the reducers are set to the allocated data.
+ * @return A named list with the model and the output of the
+ *         reducers.
+ */
+static SEXP
+SimInf_reducers_alloc(
+    SEXP model,
+    SimInf_solver_args *args)
+{
+    SEXP out, names;
+    int k = 0, n = 1 + (args->Ngroup > 0 ? 2 : 0) + (args->Nfirst > 0) +
+        (args->Ncases > 0);
+
+    PROTECT(out = Rf_allocVector(VECSXP, n));
+    PROTECT(names = Rf_allocVector(STRSXP, n));
+
+    SET_VECTOR_ELT(out, k, model);
+    SET_STRING_ELT(names, k++, Rf_mkChar("model"));
+
+    if (args->Ngroup > 0) {
+        SET_VECTOR_ELT(out, k, Rf_allocMatrix(
+            REALSXP, args->Ngroup * args->Nc, args->tlen));
+        args->sum_U = REAL(VECTOR_ELT(out, k));
+        SET_STRING_ELT(names, k++, Rf_mkChar("U"));
+
+        SET_VECTOR_ELT(out, k, Rf_allocMatrix(
+            REALSXP, args->Ngroup * args->Nd, args->tlen));
+        args->sum_V = REAL(VECTOR_ELT(out, k));
+        SET_STRING_ELT(names, k++, Rf_mkChar("V"));
+    }
+
+    if (args->Nfirst > 0) {
+        SET_VECTOR_ELT(out, k, Rf_allocVector(REALSXP, args->Nn));
+        args->first = REAL(VECTOR_ELT(out, k));
+        SET_STRING_ELT(names, k++, Rf_mkChar("first"));
+    }
+
+    if (args->Ncases > 0) {
+        SET_VECTOR_ELT(out, k, Rf_allocMatrix(REALSXP, 2, args->tlen));
+        args->prevalence = REAL(VECTOR_ELT(out, k));
+        SET_STRING_ELT(names, k++, Rf_mkChar("prevalence"));
+    }
+
+    Rf_setAttrib(out, R_NamesSymbol, names);
+    UNPROTECT(2);
+
+    return out;
+}
+
+/**
+ * Create a list with the profile of a simulation.
+ *
+ * @param profile the profile of the simulation.
+ * @return a list with the wall time and the imbalance between the
+ *         threads of each phase of the solver, and the work of the
+ *         solver.
+ */
+static SEXP
+SimInf_profile_list(
+    const SimInf_profile *profile)
+{
+    static const char *phases[] = {
+        "transitions", "E1", "E2", "post_time_step", "store"};
+    static const char *elements[] = {
+        "time", "imbalance", "transitions", "rates",
+        "events_E1", "events_E2", "threads"};
+    SEXP out, names, time, imbalance, time_names, imbalance_names;
+    int k;
+
+    PROTECT(out = Rf_allocVector(VECSXP, 7));
+    PROTECT(names = Rf_allocVector(STRSXP, 7));
+    for (k = 0; k < 7; k++)
+        SET_STRING_ELT(names, k, Rf_mkChar(elements[k]));
+    Rf_setAttrib(out, R_NamesSymbol, names);
+
+    SET_VECTOR_ELT(out, 0, time = Rf_allocVector(REALSXP, SIMINF_PROFILE_N + 1));
+    SET_VECTOR_ELT(out, 1, imbalance = Rf_allocVector(REALSXP, SIMINF_PROFILE_N));
+    PROTECT(time_names = Rf_allocVector(STRSXP, SIMINF_PROFILE_N + 1));
+    PROTECT(imbalance_names = Rf_allocVector(STRSXP, SIMINF_PROFILE_N));
+    for (k = 0; k < SIMINF_PROFILE_N; k++) {
+        REAL(time)[k] = profile->time[k];
+        REAL(imbalance)[k] = profile->imbalance[k];
+        SET_STRING_ELT(time_names, k, Rf_mkChar(phases[k]));
+        SET_STRING_ELT(imbalance_names, k, Rf_mkChar(phases[k]));
+    }
+    REAL(time)[SIMINF_PROFILE_N] = profile->total;
+    SET_STRING_ELT(time_names, SIMINF_PROFILE_N, Rf_mkChar("total"));
+    Rf_setAttrib(time, R_NamesSymbol, time_names);
+    Rf_setAttrib(imbalance, R_NamesSymbol, imbalance_names);
+
+    SET_VECTOR_ELT(out, 2, Rf_ScalarReal(profile->transitions));
+    SET_VECTOR_ELT(out, 3, Rf_ScalarReal(profile->rates));
+    SET_VECTOR_ELT(out, 4, Rf_ScalarReal(profile->events_E1));
+    SET_VECTOR_ELT(out, 5, Rf_ScalarReal(profile->events_E2));
+    SET_VECTOR_ELT(out, 6, Rf_ScalarInteger(profile->Nthread));
+
+    UNPROTECT(4);
+
+    return out;
+}
+
+/**
+ * Set the data of a slot in a replicate to the data that the
+ * replicate is simulated with, e.g. its initial state. The first
+ * replicate is the duplicated model and its slot is set in place.
+ * The other replicates are shallow duplicates that share the slot
+ * with the first, and are therefore given a copy of the slot.
+ *
+ * @param rep the replicate.
+ * @param name the name of the integer or numeric slot.
+ * @param data the data of the replicate with the same length as the
+ *        slot.
+ * @param copy non-zero to copy the slot before the data is set.
+ */
+static void
+SimInf_replicate_slot(
+    SEXP rep,
+    const char *name,
+    const void *data,
+    int copy)
+{
+    SEXP sym = Rf_install(name);
+    SEXP slot = R_do_slot(rep, sym);
+
+    if (copy) {
+        PROTECT(slot = Rf_duplicate(slot));
+        R_do_slot_assign(rep, sym, slot);
+        UNPROTECT(1);
+    }
+
+    if (TYPEOF(slot) == INTSXP)
+        memcpy(INTEGER(slot), data, XLENGTH(slot) * sizeof(int));
+    else
+        memcpy(REAL(slot), data, XLENGTH(slot) * sizeof(double));
+}
+
+/**
+ * Run replicates of the simulation in parallel. The replicates are
+ * split into one block for each thread, and each block of replicates
+ * is simulated with one setup of the data structures of the solver.
+ *
+ * @param args Structure with data for the solver and the seed and
+ *        output of each replicate.
+ * @param run_solver The solver to run.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_run_replicates(
+    SimInf_solver_args *args,
+    int (*run_solver)(SimInf_solver_args *args))
+{
+    int error = 0;
+    const int Nrep = args->Nrep;
+
+    /* Make sure to not use more threads than the number of
+     * replicates. Each replicate is simulated on a single thread, so
+     * set the number of threads in the parallel region of the solver
+     * to one. */
+    const int Nblock = SimInf_set_num_threads(Nrep);
+    SimInf_set_num_threads(1);
+
+    #ifdef _OPENMP
+    #  pragma omp parallel for num_threads(Nblock) schedule(static, 1)
+    #endif
+    for (int i = 0; i < Nblock; i++) {
+        SimInf_solver_args a = *args;
+        const int first = (int)(((long long)i * Nrep) / Nblock);
+        const int last = (int)(((long long)(i + 1) * Nrep) / Nblock);
+        int e;
+
+        /* Bind the thread before the data structures of the solver
+         * are allocated and initialised for the block. */
+        SimInf_bind_thread();
+
+        a.Nrep = last - first;
+        a.seed_rep = &args->seed_rep[first];
+        if (args->u0_rep) {
+            a.u0_rep = &args->u0_rep[first];
+            a.v0_rep = &args->v0_rep[first];
+        }
+        if (args->gdata_rep)
+            a.gdata_rep = &args->gdata_rep[first];
+        a.U_rep = &args->U_rep[first];
+        a.V_rep = &args->V_rep[first];
+        a.prU_rep = &args->prU_rep[first];
+        a.prV_rep = &args->prV_rep[first];
+        a.sum_U_rep = &args->sum_U_rep[first];
+        a.sum_V_rep = &args->sum_V_rep[first];
+        a.first_rep = &args->first_rep[first];
+        a.prevalence_rep = &args->prevalence_rep[first];
+
+        e = run_solver(&a);
+        if (e) {
+            #ifdef _OPENMP
+            #  pragma omp critical
+            #endif
+            if (!error)
+                error = e;
+        }
+    }
+
+    return error;
+}
+
 /**
  * Initiate and run the simulation
  *
  * @param model The SimInf_model
- * @param solver The numerical solver.
+ * @param solver The numerical solver. Control parameters to the
+ *        solver can be attached to the solver as a named list in the
+ *        attribute 'control'.
  * @param tr_fun Vector of function pointers to transition rate functions.
+ * @param rates_fun Function pointer to compute the rates of several
+ *        transitions in a node, or NULL to use tr_fun.
+ * @param nodes_fun Function pointer to compute the rates of all
+ *        transitions in many nodes, or NULL.
  * @param pts_fun Function pointer to callback after each time step
  *        e.g. update infectious pressure.
+ * @param pts_neighbors_fun Function pointer to callback after each
+ *        time step with the neighbors of the nodes, or NULL to use
+ *        pts_fun.
  */
-SEXP attribute_hidden
-SimInf_run(
+static SEXP
+SimInf_run_model(
     SEXP model,
     SEXP solver,
     TRFun *tr_fun,
-    PTSFun pts_fun)
+    TRRatesFun rates_fun,
+    TRNodesFun nodes_fun,
+    PTSFun pts_fun,
+    PTSNeighborsFun pts_neighbors_fun)
 {
-    int error = 0, nprotect = 0;
+    int error = 0, nprotect = 0, partitions = 0, replicates = 0, reduce;
+    int compact = 0;
+    int (*run_solver)(SimInf_solver_args *args) = NULL;
     SEXP result = R_NilValue;
     SEXP ext_events, E, G, N, S, prS;
     SEXP tspan;
-    SEXP U, V, U_sparse, V_sparse;
+    SEXP U, V, U_sparse, V_sparse, file, events_file, save, resume, prof;
+    SEXP cmpct;
+    SEXP u0_rep, v0_rep, gdata_rep;
     SimInf_solver_args args = {0};
+    SimInf_checkpoint checkpoint = {0}, restore = {0};
+    SimInf_profile profile = {0};
+    double start = 0.0;
 
     /* If the model ldata is a 0x0 matrix, i.e. Nld == 0, then use
      * ldata_tmp in the transition rate functions. This is to make
@@ -134,6 +467,154 @@ SimInf_run(
         }
     }
 
+    /* Control parameters to the solver. */
+    {
+        static const char *E2[] = {"serial", "parallel", NULL};
+        static const char *rng[] = {"mt19937", "philox", NULL};
+        static const char *select[] = {"direct", "tree", NULL};
+        static const char *sum[] = {"incremental", "compensated", NULL};
+
+        if (SimInf_arg_control_match(&args.E2_parallel, solver, "E2", E2)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        if (SimInf_arg_control_match(&args.philox, solver, "rng", rng)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        if (SimInf_arg_control_match(&args.tree_select, solver, "select", select)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        if (SimInf_arg_control_match(&args.compensated, solver, "sum", sum)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        if (SimInf_arg_control_real(&args.tleap_epsilon, solver, "epsilon",
+                                    SIMINF_TLEAP_EPSILON)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        if (SimInf_arg_control_integer(&partitions, solver, "partitions")) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        if (SimInf_arg_control_integer(&replicates, solver, "replicates")) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        /* The initial state of each replicate. */
+        u0_rep = SimInf_arg_control(solver, "u0");
+        v0_rep = SimInf_arg_control(solver, "v0");
+        if ((!Rf_isNull(u0_rep) || !Rf_isNull(v0_rep)) &&
+            (!Rf_isInteger(u0_rep) || !Rf_isMatrix(u0_rep) ||
+             !Rf_isReal(v0_rep) || !Rf_isMatrix(v0_rep) ||
+             Rf_ncols(u0_rep) != replicates ||
+             Rf_ncols(v0_rep) != replicates)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        /* The global data of each replicate. */
+        gdata_rep = SimInf_arg_control(solver, "gdata");
+        if (!Rf_isNull(gdata_rep) &&
+            (!Rf_isReal(gdata_rep) || !Rf_isMatrix(gdata_rep) ||
+             Rf_ncols(gdata_rep) != replicates)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        /* The trajectory of replicates cannot be written to one
+         * file. */
+        file = SimInf_arg_control(solver, "file");
+        if (!Rf_isNull(file) &&
+            (!Rf_isString(file) || Rf_length(file) != 1 ||
+             STRING_ELT(file, 0) == NA_STRING || replicates > 0)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        /* The events of replicates cannot be read from one file. */
+        events_file = SimInf_arg_control(solver, "events");
+        if (!Rf_isNull(events_file) &&
+            (!Rf_isString(events_file) || Rf_length(events_file) != 1 ||
+             STRING_ELT(events_file, 0) == NA_STRING || replicates > 0)) {
+            error = SIMINF_ERR_INVALID_CONTROL;
+            goto cleanup;
+        }
+
+        /* Save the state of the solver at the end of the simulation
+         * to a checkpoint. */
+        save = SimInf_arg_control(solver, "checkpoint");
+        if (!Rf_isNull(save)) {
+            if (!Rf_isLogical(save) || Rf_length(save) != 1 ||
+                LOGICAL(save)[0] == NA_LOGICAL || replicates > 0) {
+                error = SIMINF_ERR_INVALID_CONTROL;
+                goto cleanup;
+            }
+
+            if (LOGICAL(save)[0])
+                args.checkpoint = &checkpoint;
+        }
+
+        /* Record the time of each phase of the solver and the work
+         * of the solver in a profile. */
+        prof = SimInf_arg_control(solver, "profile");
+        if (!Rf_isNull(prof)) {
+            if (!Rf_isLogical(prof) || Rf_length(prof) != 1 ||
+                LOGICAL(prof)[0] == NA_LOGICAL || replicates > 0) {
+                error = SIMINF_ERR_INVALID_CONTROL;
+                goto cleanup;
+            }
+
+            if (LOGICAL(prof)[0])
+                args.profile = &profile;
+        }
+
+        /* Store the dense trajectory compactly, with the number of
+         * individuals in U as 16-bit unsigned integers and the
+         * continuous state in V as single precision floating point
+         * numbers. */
+        cmpct = SimInf_arg_control(solver, "compact");
+        if (!Rf_isNull(cmpct)) {
+            if (!Rf_isLogical(cmpct) || Rf_length(cmpct) != 1 ||
+                LOGICAL(cmpct)[0] == NA_LOGICAL || replicates > 0) {
+                error = SIMINF_ERR_INVALID_CONTROL;
+                goto cleanup;
+            }
+
+            compact = LOGICAL(cmpct)[0];
+        }
+
+        /* Resume the simulation from a checkpoint. The partitions
+         * of the nodes and the random number generator are given by
+         * the checkpoint. */
+        resume = SimInf_arg_control(solver, "resume");
+        if (!Rf_isNull(resume)) {
+            if (TYPEOF(resume) != RAWSXP || replicates > 0 ||
+                !Rf_isNull(events_file)) {
+                error = SIMINF_ERR_INVALID_CONTROL;
+                goto cleanup;
+            }
+
+            restore.data = RAW(resume);
+            restore.size = XLENGTH(resume);
+            restore.restore = 1;
+            error = SimInf_checkpoint_partitions(
+                &restore, &partitions, &args.philox);
+            if (error)
+                goto cleanup;
+            args.resume = &restore;
+        }
+    }
+
     /* seed */
     GetRNGstate();
     args.seed = (unsigned long int)(unif_rand() * UINT_MAX);
@@ -142,6 +623,8 @@ SimInf_run(
     /* Duplicate model. */
     PROTECT(result = Rf_duplicate(model));
     nprotect++;
+    Rf_setAttrib(result, Rf_install("checkpoint"), R_NilValue);
+    Rf_setAttrib(result, Rf_install("profile"), R_NilValue);
 
     /* Dependency graph */
     PROTECT(G = R_do_slot(result, Rf_install("G")));
@@ -182,12 +665,22 @@ SimInf_run(
     args.irE = INTEGER(R_do_slot(E, Rf_install("i")));
     args.jcE = INTEGER(R_do_slot(E, Rf_install("p")));
     args.prE = REAL(R_do_slot(E, Rf_install("x")));
+    args.Nselect = INTEGER(R_do_slot(E, Rf_install("Dim")))[1];
 
     /* Shift matrix. */
     PROTECT(N = R_do_slot(ext_events, Rf_install("N")));
     nprotect++;
-    if (Rf_nrows(N) == INTEGER(R_do_slot(E, Rf_install("Dim")))[0])
+    if (Rf_nrows(N) == INTEGER(R_do_slot(E, Rf_install("Dim")))[0]) {
         args.N = INTEGER(N);
+        args.Nshift = Rf_ncols(N);
+    }
+
+    /* The scheduled events are either in the model or in the file
+     * with events. */
+    if (!Rf_isNull(events_file) && args.len > 0) {
+        error = SIMINF_ERR_INVALID_CONTROL;
+        goto cleanup;
+    }
 
     /* Constants */
     args.Nn = INTEGER(R_do_slot(R_do_slot(result, Rf_install("u0")), R_DimSymbol))[1];
@@ -197,13 +690,35 @@ SimInf_run(
     args.Nld = INTEGER(R_do_slot(R_do_slot(result, Rf_install("ldata")), R_DimSymbol))[0];
     args.tlen = LENGTH(R_do_slot(result, Rf_install("tspan")));
 
-    /* Output array (to hold a single trajectory) */
+    /* Reducers of the solution. If the solution is reduced, the
+     * trajectory is not stored. */
+    error = SimInf_reducers_setup(&args, solver);
+    if (error)
+        goto cleanup;
+    reduce = args.Ngroup > 0 || args.Nfirst > 0 || args.Ncases > 0;
+
+    /* Output array (to hold a single trajectory). If the trajectory
+     * is written to a file, U and V are empty matrices with the name
+     * of the file in the attribute 'file'. */
     PROTECT(U_sparse = R_do_slot(result, Rf_install("U_sparse")));
     nprotect++;
-    if (SimInf_sparse(U_sparse, args.Nn * args.Nc, args.tlen)) {
+    if (reduce || !Rf_isNull(file)) {
+        PROTECT(U = Rf_allocMatrix(INTSXP, 0, 0));
+        nprotect++;
+        if (!Rf_isNull(file))
+            Rf_setAttrib(U, Rf_install("file"), file);
+        R_do_slot_assign(result, Rf_install("U"), U);
+    } else if (SimInf_sparse(U_sparse, args.Nn * args.Nc, args.tlen)) {
         args.irU = INTEGER(R_do_slot(U_sparse, Rf_install("i")));
         args.jcU = INTEGER(R_do_slot(U_sparse, Rf_install("p")));
         args.prU = REAL(R_do_slot(U_sparse, Rf_install("x")));
+    } else if (compact) {
+        PROTECT(U = SimInf_trajectory_compact_alloc(
+                    INTSXP, args.Nn * args.Nc, args.tlen));
+        nprotect++;
+        R_do_slot_assign(result, Rf_install("U"), U);
+        args.U16 = SimInf_trajectory_compact_data(
+            R_do_slot(result, Rf_install("U")));
     } else {
         PROTECT(U = Rf_allocMatrix(INTSXP, args.Nn * args.Nc, args.tlen));
         nprotect++;
@@ -214,10 +729,23 @@ SimInf_run(
     /* Output array (to hold a single trajectory) */
     PROTECT(V_sparse = R_do_slot(result, Rf_install("V_sparse")));
     nprotect++;
-    if (SimInf_sparse(V_sparse, args.Nn * args.Nd, args.tlen)) {
+    if (reduce || !Rf_isNull(file)) {
+        PROTECT(V = Rf_allocMatrix(REALSXP, 0, 0));
+        nprotect++;
+        if (!Rf_isNull(file))
+            Rf_setAttrib(V, Rf_install("file"), file);
+        R_do_slot_assign(result, Rf_install("V"), V);
+    } else if (SimInf_sparse(V_sparse, args.Nn * args.Nd, args.tlen)) {
         args.irV = INTEGER(R_do_slot(V_sparse, Rf_install("i")));
         args.jcV = INTEGER(R_do_slot(V_sparse, Rf_install("p")));
         args.prV = REAL(R_do_slot(V_sparse, Rf_install("x")));
+    } else if (compact) {
+        PROTECT(V = SimInf_trajectory_compact_alloc(
+                    REALSXP, args.Nn * args.Nd, args.tlen));
+        nprotect++;
+        R_do_slot_assign(result, Rf_install("V"), V);
+        args.V32 = SimInf_trajectory_compact_data(
+            R_do_slot(result, Rf_install("V")));
     } else {
         PROTECT(V = Rf_allocMatrix(REALSXP, args.Nn * args.Nd, args.tlen));
         nprotect++;
@@ -235,26 +763,280 @@ SimInf_run(
     else
         args.ldata = ldata_tmp;
 
+    /* Neighbors. A model that was saved before the slot was added,
+     * or that has an empty (0 x 0) matrix, has no neighbors. The
+     * models whose post time step function depends on the neighbors
+     * check that the slot exists before they are run. */
+    if (R_has_slot(result, Rf_install("neighbors"))) {
+        SEXP neighbors = R_do_slot(result, Rf_install("neighbors"));
+        const int *dim = INTEGER(R_do_slot(neighbors, Rf_install("Dim")));
+
+        if (dim[0] > 0 || dim[1] > 0) {
+            if (SimInf_arg_check_neighbors(result)) {
+                error = SIMINF_ERR_INVALID_NEIGHBORS;
+                goto cleanup;
+            }
+
+            args.irN = INTEGER(R_do_slot(neighbors, Rf_install("i")));
+            args.jcN = INTEGER(R_do_slot(neighbors, Rf_install("p")));
+            args.prN = REAL(R_do_slot(neighbors, Rf_install("x")));
+        }
+    }
+
     /* Global data */
     args.gdata = REAL(R_do_slot(result, Rf_install("gdata")));
 
     /* Function pointers */
     args.tr_fun = tr_fun;
+    args.rates_fun = rates_fun;
+    args.nodes_fun = nodes_fun;
     args.pts_fun = pts_fun;
+    args.pts_neighbors_fun = pts_neighbors_fun;
+
+    /* Replicates of the simulation. The first replicate is the
+     * duplicated model, and the other replicates are shallow
+     * duplicates with their own output. */
+    if (replicates > 0) {
+        SEXP list;
+        unsigned long int *seed_rep;
+
+        PROTECT(list = Rf_allocVector(VECSXP, replicates));
+        nprotect++;
+
+        seed_rep = (unsigned long int *)R_alloc(
+            replicates, sizeof(unsigned long int));
+        args.Nrep = replicates;
+        args.seed_rep = seed_rep;
+        args.U_rep = (int **)R_alloc(replicates, sizeof(int *));
+        args.V_rep = (double **)R_alloc(replicates, sizeof(double *));
+        args.prU_rep = (double **)R_alloc(replicates, sizeof(double *));
+        args.prV_rep = (double **)R_alloc(replicates, sizeof(double *));
+        args.sum_U_rep = (double **)R_alloc(replicates, sizeof(double *));
+        args.sum_V_rep = (double **)R_alloc(replicates, sizeof(double *));
+        args.first_rep = (double **)R_alloc(replicates, sizeof(double *));
+        args.prevalence_rep = (double **)R_alloc(replicates, sizeof(double *));
+
+        if (!Rf_isNull(u0_rep)) {
+            if (Rf_nrows(u0_rep) != args.Nn * args.Nc ||
+                Rf_nrows(v0_rep) != args.Nn * args.Nd) {
+                error = SIMINF_ERR_INVALID_CONTROL;
+                goto cleanup;
+            }
+
+            args.u0_rep = (const int **)R_alloc(replicates, sizeof(int *));
+            args.v0_rep = (const double **)R_alloc(replicates, sizeof(double *));
+            for (int r = 0; r < replicates; r++) {
+                args.u0_rep[r] = &INTEGER(u0_rep)[(size_t)r * args.Nn * args.Nc];
+                args.v0_rep[r] = &REAL(v0_rep)[(size_t)r * args.Nn * args.Nd];
+            }
+        }
+
+        if (!Rf_isNull(gdata_rep)) {
+            const int Ngdata = LENGTH(R_do_slot(result, Rf_install("gdata")));
+
+            if (Rf_nrows(gdata_rep) != Ngdata) {
+                error = SIMINF_ERR_INVALID_CONTROL;
+                goto cleanup;
+            }
+
+            args.gdata_rep = (const double **)R_alloc(replicates, sizeof(double *));
+            for (int r = 0; r < replicates; r++)
+                args.gdata_rep[r] = &REAL(gdata_rep)[(size_t)r * Ngdata];
+        }
+
+        GetRNGstate();
+        for (int r = 0; r < replicates; r++) {
+            SEXP rep = result;
+
+            if (r == 0) {
+                seed_rep[r] = args.seed;
+            } else {
+                rep = Rf_shallow_duplicate(result);
+                seed_rep[r] = (unsigned long int)(unif_rand() * UINT_MAX);
+            }
+            PROTECT(rep);
+
+            args.U_rep[r] = NULL;
+            args.prU_rep[r] = NULL;
+            args.V_rep[r] = NULL;
+            args.prV_rep[r] = NULL;
+            args.sum_U_rep[r] = NULL;
+            args.sum_V_rep[r] = NULL;
+            args.first_rep[r] = NULL;
+            args.prevalence_rep[r] = NULL;
+
+            if (reduce) {
+                SET_VECTOR_ELT(list, r, SimInf_reducers_alloc(rep, &args));
+                args.sum_U_rep[r] = args.sum_U;
+                args.sum_V_rep[r] = args.sum_V;
+                args.first_rep[r] = args.first;
+                args.prevalence_rep[r] = args.prevalence;
+                UNPROTECT(1);
+                continue;
+            }
+
+            SET_VECTOR_ELT(list, r, rep);
+            UNPROTECT(1);
+
+            /* The initial state of the replicate. */
+            if (args.u0_rep) {
+                SimInf_replicate_slot(rep, "u0", args.u0_rep[r], r > 0);
+                SimInf_replicate_slot(rep, "v0", args.v0_rep[r], r > 0);
+            }
+
+            /* The global data of the replicate. */
+            if (args.gdata_rep)
+                SimInf_replicate_slot(rep, "gdata", args.gdata_rep[r], r > 0);
+
+            if (args.U) {
+                if (r > 0) {
+                    SEXP slot = PROTECT(Rf_allocMatrix(
+                        INTSXP, args.Nn * args.Nc, args.tlen));
+                    R_do_slot_assign(rep, Rf_install("U"), slot);
+                    UNPROTECT(1);
+                }
+                args.U_rep[r] = INTEGER(R_do_slot(rep, Rf_install("U")));
+            } else {
+                if (r > 0) {
+                    SEXP slot = PROTECT(Rf_duplicate(U_sparse));
+                    R_do_slot_assign(rep, Rf_install("U_sparse"), slot);
+                    UNPROTECT(1);
+                }
+                args.prU_rep[r] = REAL(R_do_slot(R_do_slot(rep,
+                    Rf_install("U_sparse")), Rf_install("x")));
+            }
+
+            if (args.V) {
+                if (r > 0) {
+                    SEXP slot = PROTECT(Rf_allocMatrix(
+                        REALSXP, args.Nn * args.Nd, args.tlen));
+                    R_do_slot_assign(rep, Rf_install("V"), slot);
+                    UNPROTECT(1);
+                }
+                args.V_rep[r] = REAL(R_do_slot(rep, Rf_install("V")));
+            } else {
+                if (r > 0) {
+                    SEXP slot = PROTECT(Rf_duplicate(V_sparse));
+                    R_do_slot_assign(rep, Rf_install("V_sparse"), slot);
+                    UNPROTECT(1);
+                }
+                args.prV_rep[r] = REAL(R_do_slot(R_do_slot(rep,
+                    Rf_install("V_sparse")), Rf_install("x")));
+            }
+        }
+        PutRNGstate();
+
+        result = list;
+    } else if (reduce) {
+        PROTECT(result = SimInf_reducers_alloc(result, &args));
+        nprotect++;
+    }
 
     /* Specify the number of threads to use. Make sure to not use more
      * threads than the number of nodes in the model. */
-    args.Nthread = SimInf_set_num_threads(args.Nn);
+    if (replicates > 0) {
+        /* The replicates are distributed among the threads in
+         * SimInf_run_replicates. */
+        if (partitions > 0)
+            args.Nthread = partitions < args.Nn ? partitions : args.Nn;
+        else
+            args.Nthread = 1;
+    } else if (partitions > 0) {
+        /* Split the nodes into a fixed number of partitions that are
+         * distributed dynamically among the threads. Each partition
+         * has its own random number stream, so the trajectory does
+         * not depend on the number of threads. Make sure to not use
+         * more threads than partitions. */
+        args.Nthread = partitions < args.Nn ? partitions : args.Nn;
+        SimInf_set_num_threads(args.Nthread);
+    } else {
+        args.Nthread = SimInf_set_num_threads(args.Nn);
+    }
 
     /* Run the simulation solver. */
     if (Rf_isNull(solver) || (strcmp(CHAR(STRING_ELT(solver, 0)), "ssm") == 0))
-        error = SimInf_run_solver_ssm(&args);
+        run_solver = SimInf_run_solver_ssm;
     else if (strcmp(CHAR(STRING_ELT(solver, 0)), "aem") == 0)
-        error = SimInf_run_solver_aem(&args);
-    else
+        run_solver = SimInf_run_solver_aem;
+    else if (strcmp(CHAR(STRING_ELT(solver, 0)), "tleap") == 0)
+        run_solver = SimInf_run_solver_tleap;
+
+    if (!run_solver) {
         error = SIMINF_ERR_UNKNOWN_SOLVER;
+        goto cleanup;
+    }
+
+    /* Open the file to write the trajectory to. */
+    if (!Rf_isNull(file)) {
+        args.file = fopen(R_ExpandFileName(CHAR(STRING_ELT(file, 0))), "wb");
+        if (!args.file) {
+            error = SIMINF_ERR_WRITE_FILE;
+            goto cleanup;
+        }
+
+        error = SimInf_trajectory_file_header(
+            args.file, args.Nn, args.Nc, args.Nd, args.tlen);
+        if (error)
+            goto cleanup;
+    }
+
+    /* Open the file to read the scheduled events from. */
+    if (!Rf_isNull(events_file)) {
+        args.events_file = fopen(
+            R_ExpandFileName(CHAR(STRING_ELT(events_file, 0))), "rb");
+        if (!args.events_file) {
+            error = SIMINF_ERR_READ_EVENTS;
+            goto cleanup;
+        }
+
+        error = SimInf_events_file_header(args.events_file);
+        if (error)
+            goto cleanup;
+    }
+
+    /* Keep track of the time of each thread in the parallel regions
+     * of the solver. */
+    if (args.profile) {
+        if (SimInf_profile_create(&profile, SimInf_num_threads())) {
+            error = SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
+            goto cleanup;                           /* #nocov */
+        }
+        start = SimInf_profile_time();
+    }
+
+    if (args.Nrep > 0)
+        error = SimInf_run_replicates(&args, run_solver);
+    else
+        error = run_solver(&args);
+
+    /* Attach the state of the solver at the end of the simulation to
+     * the result. */
+    if (!error && args.checkpoint) {
+        SEXP raw = PROTECT(Rf_allocVector(RAWSXP, checkpoint.size));
+        nprotect++;
+        memcpy(RAW(raw), checkpoint.data, checkpoint.size);
+        Rf_setAttrib(result, Rf_install("checkpoint"), raw);
+    }
+
+    /* Attach the profile of the simulation to the result. */
+    if (!error && args.profile) {
+        profile.total = SimInf_profile_time() - start;
+        Rf_setAttrib(result, Rf_install("profile"),
+                     SimInf_profile_list(&profile));
+    }
 
 cleanup:
+    /* Release the main thread if it was bound to a processor during
+     * the simulation. */
+    SimInf_restore_thread_affinity();
+
+    if (args.file && fclose(args.file) && !error)
+        error = SIMINF_ERR_WRITE_FILE;
+    if (args.events_file)
+        fclose(args.events_file);
+    SimInf_checkpoint_free(&checkpoint);
+    SimInf_profile_free(&profile);
+
     if (error)
         SimInf_raise_error(error);
 
@@ -263,3 +1045,85 @@ cleanup:
 
     return result;
 }
+
+/**
+ * Initiate and run the simulation
+ *
+ * @param model The SimInf_model
+ * @param solver The numerical solver. Control parameters to the
+ *        solver can be attached to the solver as a named list in the
+ *        attribute 'control'.
+ * @param tr_fun Vector of function pointers to transition rate functions.
+ * @param pts_fun Function pointer to callback after each time step
+ *        e.g. update infectious pressure.
+ */
+SEXP attribute_hidden
+SimInf_run(
+    SEXP model,
+    SEXP solver,
+    TRFun *tr_fun,
+    PTSFun pts_fun)
+{
+    return SimInf_run_model(model, solver, tr_fun, NULL, NULL, pts_fun,
+                            NULL);
+}
+
+/**
+ * Initiate and run the simulation, where the solvers compute the
+ * transition rates in a node with one call to rates_fun, and the
+ * transition rates in many nodes with one call to nodes_fun.
+ *
+ * @param model The SimInf_model
+ * @param solver The numerical solver. Control parameters to the
+ *        solver can be attached to the solver as a named list in the
+ *        attribute 'control'.
+ * @param tr_fun Vector of function pointers to transition rate functions.
+ * @param rates_fun Function pointer to compute the rates of several
+ *        transitions in a node, or NULL to use tr_fun.
+ * @param nodes_fun Function pointer to compute the rates of all
+ *        transitions in many nodes, or NULL.
+ * @param pts_fun Function pointer to callback after each time step
+ *        e.g. update infectious pressure.
+ */
+SEXP attribute_hidden
+SimInf_run_rates(
+    SEXP model,
+    SEXP solver,
+    TRFun *tr_fun,
+    TRRatesFun rates_fun,
+    TRNodesFun nodes_fun,
+    PTSFun pts_fun)
+{
+    return SimInf_run_model(model, solver, tr_fun, rates_fun, nodes_fun,
+                            pts_fun, NULL);
+}
+
+/**
+ * Initiate and run the simulation of a model where the post time
+ * step function receives the neighbors of the nodes in the
+ * 'neighbors' slot of the model, see SimInf_run_rates.
+ *
+ * @param model The SimInf_model
+ * @param solver The numerical solver. Control parameters to the
+ *        solver can be attached to the solver as a named list in the
+ *        attribute 'control'.
+ * @param tr_fun Vector of function pointers to transition rate functions.
+ * @param rates_fun Function pointer to compute the rates of several
+ *        transitions in a node, or NULL to use tr_fun.
+ * @param nodes_fun Function pointer to compute the rates of all
+ *        transitions in many nodes, or NULL.
+ * @param pts_fun Function pointer to callback after each time step
+ *        e.g. update infectious pressure.
+ */
+SEXP attribute_hidden
+SimInf_run_neighbors(
+    SEXP model,
+    SEXP solver,
+    TRFun *tr_fun,
+    TRRatesFun rates_fun,
+    TRNodesFun nodes_fun,
+    PTSNeighborsFun pts_fun)
+{
+    return SimInf_run_model(model, solver, tr_fun, rates_fun, nodes_fun,
+                            NULL, pts_fun);
+}
@@ -25,6 +25,7 @@
 #include <R_ext/Rdynload.h>
 #include <R_ext/Visibility.h>
 #include "SimInf.h"
+#include "misc/SimInf_trajectory.h"
 
 /* Declare functions to register */
 SEXP SEIR_run(SEXP, SEXP);
@@ -39,11 +40,15 @@ SEXP SimInf_abc_weights(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 SEXP SimInf_clean_indiv_events(SEXP, SEXP, SEXP, SEXP, SEXP);
 SEXP SimInf_distance_matrix(SEXP, SEXP, SEXP, SEXP);
 SEXP SimInf_have_openmp(void);
-SEXP SimInf_init_threads(SEXP);
+SEXP SimInf_init_threads(SEXP, SEXP);
 SEXP SimInf_ldata_sp(SEXP, SEXP, SEXP);
+SEXP SimInf_neighbors_sp(SEXP, SEXP);
+SEXP SimInf_prevalence(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 SEXP SimInf_split_events(SEXP, SEXP);
 SEXP SimInf_systematic_resampling(SEXP);
 SEXP SimInf_trajectory(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP SimInf_trajectory_file(SEXP, SEXP, SEXP);
+SEXP SimInf_trajectory_view(SEXP, SEXP);
 
 #define CALLDEF(name, n) {#name, (DL_FUNC) &name, n}
 
@@ -61,11 +66,15 @@ static const R_CallMethodDef callMethods[] =
     CALLDEF(SimInf_clean_indiv_events, 5),
     CALLDEF(SimInf_distance_matrix, 4),
     CALLDEF(SimInf_have_openmp, 0),
-    CALLDEF(SimInf_init_threads, 1),
+    CALLDEF(SimInf_init_threads, 2),
     CALLDEF(SimInf_ldata_sp, 3),
+    CALLDEF(SimInf_neighbors_sp, 2),
+    CALLDEF(SimInf_prevalence, 7),
     CALLDEF(SimInf_split_events, 2),
     CALLDEF(SimInf_systematic_resampling, 1),
     CALLDEF(SimInf_trajectory, 10),
+    CALLDEF(SimInf_trajectory_file, 3),
+    CALLDEF(SimInf_trajectory_view, 2),
     {NULL, NULL, 0}
 };
 
@@ -83,9 +92,17 @@ R_init_SimInf(
     R_forceSymbols(info, TRUE);
     R_RegisterCCallable("SimInf", "SimInf_local_spread",
                         (DL_FUNC) &SimInf_local_spread);
+    R_RegisterCCallable("SimInf", "SimInf_local_spread_neighbors",
+                        (DL_FUNC) &SimInf_local_spread_neighbors);
     R_RegisterCCallable("SimInf", "SimInf_forward_euler_linear_decay",
                         (DL_FUNC) &SimInf_forward_euler_linear_decay);
     R_RegisterCCallable("SimInf", "SimInf_run",
                         (DL_FUNC) &SimInf_run);
-    SimInf_init_threads(R_NilValue);
+    R_RegisterCCallable("SimInf", "SimInf_run_rates",
+                        (DL_FUNC) &SimInf_run_rates);
+    R_RegisterCCallable("SimInf", "SimInf_run_neighbors",
+                        (DL_FUNC) &SimInf_run_neighbors);
+    SimInf_trajectory_view_init(info);
+    SimInf_trajectory_compact_init(info);
+    SimInf_init_threads(R_NilValue, R_NilValue);
 }
@@ -26,6 +26,11 @@
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_rng.h>
 #include "SimInf_arg.h"
+#include "SimInf_openmp.h"
+
+/* The number of particles in a block of the kernel sum, such that
+ * the whitened particles in a block are kept in the cache. */
+#define SIMINF_ABC_BLOCK 128
 
 static void
 SimInf_abc_error(
@@ -261,6 +266,103 @@ cleanup:
     return xx;
 }
 
+/**
+ * Whiten particles with the Cholesky factor of the
+ * variance-covariance matrix, i.e., solve L z = x for every particle,
+ * such that the quadratic form of the multivariate normal density of
+ * two particles is the squared distance between the whitened
+ * particles.
+ *
+ * @param L the Cholesky factor in the lower triangle.
+ * @param x a numeric matrix (particles x parameters).
+ * @param n the number of particles.
+ * @param z the whitened particles, where z[i * d + k] is parameter k
+ *        of particle i.
+ */
+static void
+SimInf_abc_whiten(
+    const gsl_matrix *L,
+    const double *x,
+    int n,
+    double *z)
+{
+    const int d = L->size1;
+
+    #ifdef _OPENMP
+    #  pragma omp parallel for num_threads(SimInf_num_threads())
+    #endif
+    for (int i = 0; i < n; i++) {
+        double *zi = &z[(size_t)i * d];
+
+        for (int k = 0; k < d; k++) {
+            double v = x[(size_t)k * n + i];
+
+            for (int m = 0; m < k; m++)
+                v -= gsl_matrix_get(L, k, m) * zi[m];
+            zi[k] = v / gsl_matrix_get(L, k, k);
+        }
+    }
+}
+
+/**
+ * Squared distance between two whitened particles.
+ */
+static inline double
+SimInf_abc_dist2(
+    const double *a,
+    const double *b,
+    int d)
+{
+    double q = 0.0;
+
+    for (int k = 0; k < d; k++) {
+        const double delta = a[k] - b[k];
+        q += delta * delta;
+    }
+
+    return q;
+}
+
+/**
+ * Calculate the log of the weighted sum of the multivariate normal
+ * kernel of a particle against every particle in the previous
+ * generation, with log-sum-exp such that the sum does not underflow
+ * when every term underflows.
+ */
+static double
+SimInf_abc_log_kernel_sum(
+    const double *zi,
+    const double *z,
+    const double *w,
+    int n,
+    int d,
+    double log_c)
+{
+    double max_t = -INFINITY, sum = 0.0;
+
+    for (int j = 0; j < n; j++) {
+        if (w[j] > 0.0) {
+            const double t = log(w[j]) -
+                0.5 * SimInf_abc_dist2(zi, &z[(size_t)j * d], d);
+            if (t > max_t)
+                max_t = t;
+        }
+    }
+
+    if (!R_FINITE(max_t))
+        return max_t;
+
+    for (int j = 0; j < n; j++) {
+        if (w[j] > 0.0) {
+            sum += exp(log(w[j]) -
+                       0.5 * SimInf_abc_dist2(zi, &z[(size_t)j * d], d) -
+                       max_t);
+        }
+    }
+
+    return log_c + max_t + log(sum);
+}
+
 /**
  * Utility function for implementing the Approximate Bayesian
  * Computation Sequential Monte Carlo (ABC-SMC) algorithm of Toni et
@@ -297,11 +399,13 @@ SimInf_abc_weights(
     int n_parameters, n_particles = Rf_nrows(xx);
     gsl_matrix_view v_sigma;
     gsl_matrix *SIGMA = NULL;
-    gsl_vector *work = NULL;
     SEXP ww;
     const double *ptr_p1, *ptr_p2, *ptr_w;
-    double *ptr_x, *ptr_xx, *ptr_ww;
-    double sum, max_ww = 0.0;
+    double *ptr_x, *ptr_xx, *ptr_ww, *z = NULL, *zz = NULL, *log_sum;
+    double sum, log_c, max_ww = -INFINITY;
+
+    /* Use all available threads in parallel regions. */
+    SimInf_set_num_threads(-1);
 
     PROTECT(ww = Rf_allocVector(REALSXP, n_particles));
     ptr_ww = REAL(ww);
@@ -317,7 +421,6 @@ SimInf_abc_weights(
     ptr_x = REAL(x);
     ptr_xx = REAL(xx);
     ptr_w = REAL(w);
-    work = gsl_vector_alloc(n_parameters);
 
     /* Setup variance-covariance matrix. */
     v_sigma = gsl_matrix_view_array(REAL(sigma), n_parameters, n_parameters);
@@ -329,12 +432,69 @@ SimInf_abc_weights(
     gsl_matrix_memcpy(SIGMA, &v_sigma.matrix);
     gsl_linalg_cholesky_decomp1(SIGMA);
 
-    for (int i = 0; i < n_particles; i++) {
-        gsl_vector_view v_xx = gsl_vector_view_array_with_stride(
-            &ptr_xx[i],    /* double *base */
-            n_particles,   /* size_t stride */
-            n_parameters); /* size_t n */
+    /* The log of the normalizing constant of the multivariate normal
+     * density. */
+    log_c = -0.5 * n_parameters * log(2.0 * M_PI);
+    for (int k = 0; k < n_parameters; k++)
+        log_c -= log(gsl_matrix_get(SIGMA, k, k));
+
+    /* Whiten the particles of both generations once with the shared
+     * Cholesky factor, instead of one triangular solve for every
+     * pair of particles. */
+    z = malloc((size_t)n_particles * n_parameters * sizeof(double));
+    zz = malloc((size_t)n_particles * n_parameters * sizeof(double));
+    if (!z || !zz) {
+        error = 1;    /* #nocov */
+        goto cleanup; /* #nocov */
+    }
+    SimInf_abc_whiten(SIGMA, ptr_x, n_particles, z);
+    SimInf_abc_whiten(SIGMA, ptr_xx, n_particles, zz);
+
+    /* Calculate the log of the weighted kernel sum of every particle
+     * in blocks of particles, where the particles are distributed
+     * among the threads. The sum is accumulated in the same order
+     * for every particle, independent of the number of threads. */
+    log_sum = (double *)R_alloc(n_particles, sizeof(double));
+
+    #ifdef _OPENMP
+    #  pragma omp parallel for num_threads(SimInf_num_threads()) schedule(dynamic)
+    #endif
+    for (int ib = 0; ib < n_particles; ib += SIMINF_ABC_BLOCK) {
+        const int i_end = ib + SIMINF_ABC_BLOCK < n_particles ?
+            ib + SIMINF_ABC_BLOCK : n_particles;
+        double block_sum[SIMINF_ABC_BLOCK] = {0};
+
+        for (int jb = 0; jb < n_particles; jb += SIMINF_ABC_BLOCK) {
+            const int j_end = jb + SIMINF_ABC_BLOCK < n_particles ?
+                jb + SIMINF_ABC_BLOCK : n_particles;
+
+            for (int i = ib; i < i_end; i++) {
+                const double *zi = &zz[(size_t)i * n_parameters];
+                double s = 0.0;
+
+                for (int j = jb; j < j_end; j++) {
+                    const double q = SimInf_abc_dist2(
+                        zi, &z[(size_t)j * n_parameters], n_parameters);
+                    s += ptr_w[j] * exp(log_c - 0.5 * q);
+                }
 
+                block_sum[i - ib] += s;
+            }
+        }
+
+        for (int i = ib; i < i_end; i++) {
+            if (R_FINITE(block_sum[i - ib]) && block_sum[i - ib] > 0.0) {
+                log_sum[i] = log(block_sum[i - ib]);
+            } else {
+                /* The sum underflows, use the log-space reduction. */
+                log_sum[i] = SimInf_abc_log_kernel_sum(
+                    &zz[(size_t)i * n_parameters], z, ptr_w,
+                    n_particles, n_parameters, log_c);
+            }
+        }
+    }
+
+    for (int i = 0; i < n_particles; i++) {
         ptr_ww[i] = 0.0;
         for (int d = 0; d < n_parameters; d++) {
             switch(R_CHAR(STRING_ELT(distribution, d))[0]) {
@@ -367,27 +527,12 @@ SimInf_abc_weights(
             goto cleanup;
         }
 
-        sum = 0.0;
-        for (int j = 0; j < n_particles; j++) {
-            double pdf;
-            gsl_vector_view v_x = gsl_vector_view_array_with_stride(
-                &ptr_x[j],     /* double *base */
-                n_particles,   /* size_t stride */
-                n_parameters); /* size_t n */
-
-            gsl_ran_multivariate_gaussian_pdf(&v_xx.vector, &v_x.vector,
-                                              SIGMA, &pdf, work);
-
-            sum += ptr_w[j] * pdf;
-        }
-
-        if (!R_FINITE(sum) || sum <= 0.0) {
+        if (!R_FINITE(log_sum[i])) {
             error = 4;    /* #nocov */
             goto cleanup; /* #nocov */
         }
 
-        sum = log(sum);
-        ptr_ww[i] -= sum;
+        ptr_ww[i] -= log_sum[i];
         if (ptr_ww[i] > max_ww)
             max_ww = ptr_ww[i];
     }
@@ -405,7 +550,8 @@ SimInf_abc_weights(
 
 cleanup:
     gsl_matrix_free(SIGMA);
-    gsl_vector_free(work);
+    free(z);
+    free(zz);
 
     if (error)
         SimInf_abc_error(error);
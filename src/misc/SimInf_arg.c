@@ -110,6 +110,166 @@ SimInf_arg_check_model(
     return 0;
 }
 
+/**
+ * Check the 'neighbors' slot of a model
+ *
+ * @param model The model to check.
+ * @return 0 if the model has a 'neighbors' slot with a dgCMatrix
+ *         with one row and one column for each node, else -1.
+ */
+int attribute_hidden
+SimInf_arg_check_neighbors(
+    SEXP model)
+{
+    SEXP neighbors;
+    int Nn;
+
+    if (!R_has_slot(model, Rf_install("neighbors")))
+        return -1;
+    neighbors = R_do_slot(model, Rf_install("neighbors"));
+    if (SimInf_arg_check_dgCMatrix(neighbors))
+        return -1;
+
+    Nn = INTEGER(R_do_slot(R_do_slot(model, Rf_install("u0")), R_DimSymbol))[1];
+    if (INTEGER(R_do_slot(neighbors, Rf_install("Dim")))[0] != Nn ||
+        INTEGER(R_do_slot(neighbors, Rf_install("Dim")))[1] != Nn)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Get a control parameter to the solver
+ *
+ * The control parameters are attached to the 'solver' argument as a
+ * named list in the attribute 'control'.
+ *
+ * @param solver The solver argument.
+ * @param name The name of the control parameter.
+ * @return The value of the control parameter, or R_NilValue if the
+ *         control parameter is not specified.
+ */
+SEXP attribute_hidden
+SimInf_arg_control(
+    SEXP solver,
+    const char *name)
+{
+    SEXP control, names;
+
+    control = Rf_getAttrib(solver, Rf_install("control"));
+    if (!Rf_isNewList(control))
+        return R_NilValue;
+
+    names = Rf_getAttrib(control, R_NamesSymbol);
+    if (!Rf_isString(names))
+        return R_NilValue;
+
+    for (R_xlen_t i = 0; i < XLENGTH(control); i++) {
+        if (strcmp(CHAR(STRING_ELT(names, i)), name) == 0)
+            return VECTOR_ELT(control, i);
+    }
+
+    return R_NilValue;
+}
+
+/**
+ * Match a character control parameter to the solver
+ *
+ * @param out The index to the matching choice. Set to 0 (the
+ *        default) if the control parameter is not specified.
+ * @param solver The solver argument.
+ * @param name The name of the control parameter.
+ * @param choices NULL terminated vector with the valid values of the
+ *        control parameter. The first choice is the default.
+ * @return 0 if OK, else -1
+ */
+int attribute_hidden
+SimInf_arg_control_match(
+    int *out,
+    SEXP solver,
+    const char *name,
+    const char **choices)
+{
+    SEXP value = SimInf_arg_control(solver, name);
+
+    *out = 0;
+    if (Rf_isNull(value))
+        return 0;
+
+    if (!Rf_isString(value) ||
+        Rf_length(value) != 1 ||
+        STRING_ELT(value, 0) == NA_STRING)
+        return -1;
+
+    for (int i = 0; choices[i]; i++) {
+        if (strcmp(CHAR(STRING_ELT(value, 0)), choices[i]) == 0) {
+            *out = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Get a positive integer control parameter to the solver
+ *
+ * @param out The value of the control parameter. Set to 0 (the
+ *        default) if the control parameter is not specified.
+ * @param solver The solver argument.
+ * @param name The name of the control parameter.
+ * @return 0 if OK, else -1
+ */
+int attribute_hidden
+SimInf_arg_control_integer(
+    int *out,
+    SEXP solver,
+    const char *name)
+{
+    SEXP value = SimInf_arg_control(solver, name);
+
+    *out = 0;
+    if (Rf_isNull(value))
+        return 0;
+
+    if (SimInf_arg_check_integer_gt_zero(value))
+        return -1;
+
+    *out = Rf_asInteger(value);
+    return 0;
+}
+
+/**
+ * Get a positive real control parameter to the solver
+ *
+ * @param out The value of the control parameter. Set to 'value_default'
+ *        if the control parameter is not specified.
+ * @param solver The solver argument.
+ * @param name The name of the control parameter.
+ * @param value_default The default value of the control parameter.
+ * @return 0 if OK, else -1
+ */
+int attribute_hidden
+SimInf_arg_control_real(
+    double *out,
+    SEXP solver,
+    const char *name,
+    double value_default)
+{
+    SEXP value = SimInf_arg_control(solver, name);
+
+    *out = value_default;
+    if (Rf_isNull(value))
+        return 0;
+
+    if (!Rf_isReal(value) || Rf_length(value) != 1 ||
+        !R_FINITE(REAL(value)[0]) || REAL(value)[0] <= 0.0)
+        return -1;
+
+    *out = REAL(value)[0];
+    return 0;
+}
+
 /**
  * Check if the trajectory data is stored in a sparse matrix.
  *
@@ -27,10 +27,17 @@
 #include <Rinternals.h>
 
 int SimInf_arg_check_dgCMatrix(SEXP arg);
+SEXP SimInf_arg_control(SEXP solver, const char *name);
+int SimInf_arg_control_integer(int *out, SEXP solver, const char *name);
+int SimInf_arg_control_real(double *out, SEXP solver, const char *name,
+                            double value_default);
+int SimInf_arg_control_match(int *out, SEXP solver, const char *name,
+                             const char **choices);
 int SimInf_arg_check_integer(SEXP arg);
 int SimInf_arg_check_integer_gt_zero(SEXP arg);
 int SimInf_arg_check_matrix(SEXP arg);
 int SimInf_arg_check_model(SEXP arg);
+int SimInf_arg_check_neighbors(SEXP model);
 int SimInf_get_solver(int *out, SEXP solver);
 int SimInf_sparse(SEXP m, R_xlen_t i, R_xlen_t j);
 
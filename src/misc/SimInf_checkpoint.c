@@ -0,0 +1,119 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <R_ext/Visibility.h>
+#include "SimInf.h"
+#include "SimInf_checkpoint.h"
+
+/**
+ * Save or restore a block of data in the checkpoint
+ *
+ * @param cp the checkpoint.
+ * @param data the data to append to the checkpoint, or to copy the
+ *        data from the checkpoint to when the state is restored.
+ * @param size the number of bytes of data.
+ * @return 0 if Ok, SIMINF_ERR_INVALID_CHECKPOINT if the checkpoint
+ *         is too short to restore the data, or
+ *         SIMINF_ERR_ALLOC_MEMORY_BUFFER.
+ */
+int attribute_hidden
+SimInf_checkpoint_data(
+    SimInf_checkpoint *cp,
+    void *data,
+    size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    if (cp->restore) {
+        if (cp->size - cp->pos < size)
+            return SIMINF_ERR_INVALID_CHECKPOINT;
+        memcpy(data, &cp->data[cp->pos], size);
+        cp->pos += size;
+        return 0;
+    }
+
+    if (cp->capacity - cp->size < size) {
+        size_t capacity = cp->capacity ? cp->capacity : 4096;
+        unsigned char *ptr;
+
+        while (capacity - cp->size < size)
+            capacity *= 2;
+        ptr = realloc(cp->data, capacity);
+        if (!ptr)
+            return SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
+        cp->data = ptr;
+        cp->capacity = capacity;
+    }
+
+    memcpy(&cp->data[cp->size], data, size);
+    cp->size += size;
+
+    return 0;
+}
+
+/**
+ * Save or restore the state of a random number generator in the
+ * checkpoint
+ *
+ * The size of the state is saved before the state to detect that
+ * the state is restored to a generator of another type.
+ *
+ * @param cp the checkpoint.
+ * @param rng the random number generator.
+ * @return 0 if Ok, else error code.
+ */
+int attribute_hidden
+SimInf_checkpoint_rng(
+    SimInf_checkpoint *cp,
+    gsl_rng *rng)
+{
+    uint64_t size = gsl_rng_size(rng);
+    const uint64_t expected = size;
+    int error;
+
+    error = SimInf_checkpoint_data(cp, &size, sizeof(size));
+    if (!error && size != expected)
+        error = SIMINF_ERR_INVALID_CHECKPOINT;
+    if (!error)
+        error = SimInf_checkpoint_data(cp, gsl_rng_state(rng), size);
+
+    return error;
+}
+
+/**
+ * Free the data of a checkpoint that has been saved.
+ *
+ * @param cp the checkpoint.
+ */
+void attribute_hidden
+SimInf_checkpoint_free(
+    SimInf_checkpoint *cp)
+{
+    if (cp && !cp->restore) {
+        free(cp->data);
+        cp->data = NULL;
+        cp->size = 0;
+        cp->capacity = 0;
+    }
+}
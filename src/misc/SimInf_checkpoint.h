@@ -0,0 +1,55 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_SIMINF_CHECKPOINT_H
+#define INCLUDE_SIMINF_CHECKPOINT_H
+
+#include <stddef.h>
+#include <gsl/gsl_rng.h>
+
+/**
+ * Buffer with the state of a solver, to save the state at the end
+ * of a simulation and to resume a simulation from the state. The
+ * same functions are used to save and to restore the state, such
+ * that the data is always read in the order it was written.
+ */
+typedef struct SimInf_checkpoint
+{
+    unsigned char *data; /**< The state of the solver. */
+    size_t size;         /**< Number of bytes in data. */
+    size_t capacity;     /**< Number of allocated bytes in data when
+                          *   the state is saved. */
+    size_t pos;          /**< Position to read the next data from
+                          *   when the state is restored. */
+    int restore;         /**< Non-zero to restore the state from
+                          *   data, else the state is appended to
+                          *   data. */
+} SimInf_checkpoint;
+
+int SimInf_checkpoint_data(
+    SimInf_checkpoint *cp, void *data, size_t size);
+
+int SimInf_checkpoint_rng(
+    SimInf_checkpoint *cp, gsl_rng *rng);
+
+void SimInf_checkpoint_free(
+    SimInf_checkpoint *cp);
+
+#endif
@@ -25,9 +25,72 @@
 #include "SimInf.h"
 #include "SimInf_openmp.h"
 
+/* The number of events of an individual to schedule the search for
+ * the longest path as a separate task, and the number of individuals
+ * per task for the individuals with fewer events. */
+#define SIMINF_CLEAN_INDIV_EVENTS_HEAVY 64
+#define SIMINF_CLEAN_INDIV_EVENTS_CHUNK 1024
+
+/**
+ * Find the next event in the search for a path through the events
+ * of an individual. The events are sorted by time, and the next
+ * event after 'prev' from the event 'parent' is the first event
+ * after 'prev' at a later time than 'prev' that leaves the node of
+ * the individual after 'parent'. The search from 'parent' ends after
+ * an exit event.
+ *
+ * @param event integer vector with the event type.
+ * @param time integer vector with the time for each event.
+ * @param node integer vector with the node that the event operates
+ *        on.
+ * @param dest integer vector with the destination node for an
+ *        external transfer event.
+ * @param n the number of events.
+ * @param parent the zero-based index of the event to continue the
+ *        path from.
+ * @param prev the zero-based index of the previous next event from
+ *        'parent', or -1 to find the first.
+ * @return the zero-based index of the next event, or -1 if there
+ *         are no more events.
+ */
+static int
+SimInf_next_event(
+    const int *event,
+    const int *time,
+    const int *node,
+    const int *dest,
+    const int n,
+    const int parent,
+    const int prev)
+{
+    const int from = event[parent] == ENTER_EVENT ? node[parent] : dest[parent];
+    const int i = prev < 0 ? parent : prev;
+
+    if (prev >= 0 && event[prev] == EXIT_EVENT)
+        return -1;
+
+    for (int j = i + 1; j < n; j++) {
+        if (time[j] > time[i] &&
+            from == node[j] &&
+            from != dest[j] &&
+            (event[j] == EXIT_EVENT || event[j] == EXTERNAL_TRANSFER_EVENT))
+        {
+            return j;
+        }
+    }
+
+    return -1;
+}
+
 /**
  * Find the longest path through the events.
  *
+ * The longest path is found with dynamic programming over the
+ * events in reverse time order, where the length of the longest
+ * path from an event is one plus the longest path from the next
+ * events. If several paths have the longest length, the path with
+ * the first events is kept.
+ *
  * @param event integer vector with the event type. Each entry must
  *        contain one of '0' (exit), '1' (enter) or '3' (external
  *        transfer event, i.e., movement).
@@ -37,8 +100,9 @@
  * @param dest integer vector with the destination node for an
  *        external transfer event i.e.of proposals to generate Not
  *        used for the other event types.
- * @param path integer vector for temporary storage of one-based
- *        indices to the events in the current search.
+ * @param length integer vector for temporary storage of the length
+ *        of the longest path from each event, or 0 if there is no
+ *        path from the event.
  * @param keep integer vector for results with 1 for each event to
  *        keep, else 0.
  */
@@ -48,11 +112,11 @@ SimInf_find_longest_path(
     const int *time,
     const int *node,
     const int *dest,
-    int *path,
+    int *length,
     int *keep,
     const int n)
 {
-    int longest_path = 0;
+    int longest_path = 0, begin = -1;
     int must_enter = 0;
     int must_exit = 0;
 
@@ -67,82 +131,42 @@ SimInf_find_longest_path(
             must_exit = 1;
     }
 
-    /* Iterate over all events to identify an event that should begin
-     * each path. */
-    for (int begin = 0; begin < n; begin++) {
-        int depth = 1;
+    /* Determine the length of the longest path from each event. The
+     * next events are after the event, so iterate from the last
+     * event. */
+    for (int i = n - 1; i >= 0; i--) {
+        length[i] = (must_exit == 0 || event[i] == EXIT_EVENT) ? 1 : 0;
 
-        if (must_enter && event[begin] != ENTER_EVENT)
-            continue;
+        for (int j = SimInf_next_event(event, time, node, dest, n, i, -1);
+             j >= 0;
+             j = SimInf_next_event(event, time, node, dest, n, i, j))
+        {
+            if (length[j] > 0 && length[j] + 1 > length[i])
+                length[i] = length[j] + 1;
+        }
+    }
 
-        /* Clear the path. */
-        memset(path, 0, n * sizeof(int));
-
-        /* Initialize the path with the first event. This is the root
-         * for the search. */
-        path[0] = begin + 1;
-
-        /* Check if this event might be the longest path, for example,
-         * if there are no more events. */
-        if (longest_path == 0) {
-            if ((must_exit == 0 && event[begin] == ENTER_EVENT) ||
-                (must_exit == 0 && event[begin] == EXTERNAL_TRANSFER_EVENT) ||
-                (must_exit == 1 && event[begin] == EXIT_EVENT))
-            {
-                longest_path = 1;
-                keep[path[0] - 1] = 1;
-            }
+    /* Identify the first event that begins a longest path. */
+    for (int i = 0; i < n; i++) {
+        if (must_enter && event[i] != ENTER_EVENT)
+            continue;
+        if (length[i] > longest_path) {
+            longest_path = length[i];
+            begin = i;
         }
+    }
 
-        /* Perform a depth first search of the events to find the
-         * longest path. */
-        while (depth > 0 &&
-               depth < (n - begin) &&
-               longest_path < (n - begin))
-        {
-            int i = path[depth - 1] - 1;
-            int from = event[i] == ENTER_EVENT ? node[i] : dest[i];
-
-            /* Continue the search from a previous search at this
-             * depth? */
-            if (path[depth] > 0) {
-                i = path[depth] - 1;
-                path[depth] = 0;
-            }
+    /* Keep the events in the path, where each event is followed by
+     * the first next event with the remaining length. */
+    for (int i = begin, k = longest_path; k > 0; k--) {
+        keep[i] = 1;
 
-            /* Find an event that is consistent with 'from' in the
-             * previous event. */
-            for (int j = i + 1; j < n && path[depth] == 0; j++) {
-                if (time[j] > time[i] &&
-                    from == node[j] &&
-                    from != dest[j] &&
-                    (event[j] == EXIT_EVENT || event[j] == EXTERNAL_TRANSFER_EVENT))
-                {
-                    path[depth] = j + 1;
-                    if (!(must_exit && event[j] == EXTERNAL_TRANSFER_EVENT) &&
-                        (depth + 1) > longest_path)
-                    {
-                        longest_path = depth + 1;
-                        memset(keep, 0, n * sizeof(int));
-                        for (int k = 0; k < longest_path; k++)
-                            keep[path[k] - 1] = 1;
-                    }
-                }
-            }
+        if (k > 1) {
+            int j = SimInf_next_event(event, time, node, dest, n, i, -1);
 
-            if (path[depth] == 0) {
-                /* No new event found at this depth, move up in the
-                 * search tree. */
-                depth -= 1;
-            } else if (event[path[depth] - 1] == EXIT_EVENT) {
-                /* The last event is an exit event, move up in the
-                 * search tree. */
-                path[depth] = 0;
-                depth -= 1;
-            } else {
-                /* Go down in the search tree. */
-                depth += 1;
-            }
+            while (length[j] != k - 1)
+                j = SimInf_next_event(event, time, node, dest, n, i, j);
+            i = j;
         }
     }
 }
@@ -181,6 +205,7 @@ SimInf_clean_indiv_events(
     SEXP keep;
     int *ptr_keep;
     int *ptr_path;
+    R_xlen_t *ptr_begin, n_indiv;
 
     /* Use all available threads in parallel regions. */
     SimInf_set_num_threads(-1);
@@ -209,8 +234,8 @@ SimInf_clean_indiv_events(
     }
 
     /* Allocate transient storage of an integer vector for keeping
-     * track of the current path when searching for the longest
-     * path. R will reclaim the memory at the end of the call. */
+     * track of the length of the longest path from each event. R
+     * will reclaim the memory at the end of the call. */
     ptr_path = (int*)R_alloc(len, sizeof(int));
 
     PROTECT(keep = Rf_allocVector(LGLSXP, len));
@@ -219,26 +244,64 @@ SimInf_clean_indiv_events(
     /* The default is to drop all events. */
     memset(ptr_keep, 0, len * sizeof(int));
 
+    /* Determine the first event of each individual, where the last
+     * entry is the number of events. */
+    n_indiv = 0;
+    for (R_xlen_t i = 0; i < len; i++) {
+        if (i == 0 || ptr_id[i] != ptr_id[i - 1])
+            n_indiv++;
+    }
+    ptr_begin = (R_xlen_t*)R_alloc(n_indiv + 1, sizeof(R_xlen_t));
+    for (R_xlen_t i = 0, k = 0; i < len; i++) {
+        if (i == 0 || ptr_id[i] != ptr_id[i - 1])
+            ptr_begin[k++] = i;
+    }
+    ptr_begin[n_indiv] = len;
+
+    /* Search the individuals with many events one at a time, since
+     * the work grows with the square of the number of events. The
+     * individuals with few events are searched in large chunks to
+     * reduce the scheduling overhead. */
     #ifdef _OPENMP
     #  pragma omp parallel num_threads(SimInf_num_threads())
-    #  pragma omp single
     #endif
-    for (R_xlen_t i = 0, j = 0; i < len; i++) {
-        /* Check for last event or a new individual. */
-        if (i == (len - 1) || ptr_id[i] != ptr_id[i + 1]) {
-            #ifdef _OPENMP
-            #  pragma omp task
-            #endif
-            SimInf_find_longest_path(
-                &ptr_event[j],
-                &ptr_time[j],
-                &ptr_node[j],
-                &ptr_dest[j],
-                &ptr_path[j],
-                &ptr_keep[j],
-                i - j + 1);
-
-            j = i + 1;
+    {
+        #ifdef _OPENMP
+        #  pragma omp for schedule(dynamic, 1) nowait
+        #endif
+        for (R_xlen_t k = 0; k < n_indiv; k++) {
+            const R_xlen_t j = ptr_begin[k];
+            const R_xlen_t n = ptr_begin[k + 1] - j;
+
+            if (n >= SIMINF_CLEAN_INDIV_EVENTS_HEAVY) {
+                SimInf_find_longest_path(
+                    &ptr_event[j],
+                    &ptr_time[j],
+                    &ptr_node[j],
+                    &ptr_dest[j],
+                    &ptr_path[j],
+                    &ptr_keep[j],
+                    n);
+            }
+        }
+
+        #ifdef _OPENMP
+        #  pragma omp for schedule(dynamic, SIMINF_CLEAN_INDIV_EVENTS_CHUNK)
+        #endif
+        for (R_xlen_t k = 0; k < n_indiv; k++) {
+            const R_xlen_t j = ptr_begin[k];
+            const R_xlen_t n = ptr_begin[k + 1] - j;
+
+            if (n < SIMINF_CLEAN_INDIV_EVENTS_HEAVY) {
+                SimInf_find_longest_path(
+                    &ptr_event[j],
+                    &ptr_time[j],
+                    &ptr_node[j],
+                    &ptr_dest[j],
+                    &ptr_path[j],
+                    &ptr_keep[j],
+                    n);
+            }
         }
     }
 
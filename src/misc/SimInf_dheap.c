@@ -0,0 +1,150 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <R_ext/Visibility.h>
+#include "SimInf_dheap.h"
+
+/* The number of children of every entry in the heap. A 4-ary heap
+ * has half the depth of a binary heap, and the children of an entry
+ * are adjacent in memory. It can be set when the package is built,
+ * e.g. to 2 to benchmark against a binary heap. */
+#ifndef SIMINF_DHEAP_D
+#  define SIMINF_DHEAP_D 4
+#endif
+
+/**
+ * Move the entry at position k down in the heap until no child has
+ * an earlier time.
+ *
+ * @param heap the entries of the heap.
+ * @param pos the position in the heap of every item.
+ * @param n the number of entries in the heap.
+ * @param k the position of the entry to move.
+ */
+static void
+SimInf_dheap_down(
+    SimInf_dheap_entry *heap,
+    int *pos,
+    int n,
+    int k)
+{
+    const SimInf_dheap_entry e = heap[k];
+
+    for (;;) {
+        int c, child = SIMINF_DHEAP_D * k + 1;
+        const int last = child + SIMINF_DHEAP_D < n ?
+            child + SIMINF_DHEAP_D : n;
+
+        if (child >= n)
+            break;
+
+        /* Find the child with the earliest time. */
+        for (c = child + 1; c < last; c++) {
+            if (heap[c].time < heap[child].time)
+                child = c;
+        }
+
+        if (!(heap[child].time < e.time))
+            break;
+
+        heap[k] = heap[child];
+        pos[heap[k].index] = k;
+        k = child;
+    }
+
+    heap[k] = e;
+    pos[e.index] = k;
+}
+
+/**
+ * Move the entry at position k up in the heap until the parent has
+ * an earlier or the same time.
+ *
+ * @param heap the entries of the heap.
+ * @param pos the position in the heap of every item.
+ * @param k the position of the entry to move.
+ */
+static void
+SimInf_dheap_up(
+    SimInf_dheap_entry *heap,
+    int *pos,
+    int k)
+{
+    const SimInf_dheap_entry e = heap[k];
+
+    while (k > 0) {
+        const int parent = (k - 1) / SIMINF_DHEAP_D;
+
+        if (!(e.time < heap[parent].time))
+            break;
+
+        heap[k] = heap[parent];
+        pos[heap[k].index] = k;
+        k = parent;
+    }
+
+    heap[k] = e;
+    pos[e.index] = k;
+}
+
+/**
+ * Build the heap from the entries in arbitrary order.
+ *
+ * @param heap the entries of the heap.
+ * @param pos the position in the heap of every item, set by the
+ *        function.
+ * @param n the number of entries in the heap.
+ */
+void attribute_hidden
+SimInf_dheap_init(
+    SimInf_dheap_entry *heap,
+    int *pos,
+    int n)
+{
+    int k;
+
+    for (k = 0; k < n; k++)
+        pos[heap[k].index] = k;
+    for (k = (n - 2) / SIMINF_DHEAP_D; k >= 0 && n > 1; k--)
+        SimInf_dheap_down(heap, pos, n, k);
+}
+
+/**
+ * Restore the heap after the time of the entry at position k has
+ * changed.
+ *
+ * @param heap the entries of the heap.
+ * @param pos the position in the heap of every item.
+ * @param n the number of entries in the heap.
+ * @param k the position of the entry with a new time.
+ */
+void attribute_hidden
+SimInf_dheap_update(
+    SimInf_dheap_entry *heap,
+    int *pos,
+    int n,
+    int k)
+{
+    if (k > 0 && heap[k].time < heap[(k - 1) / SIMINF_DHEAP_D].time)
+        SimInf_dheap_up(heap, pos, k);
+    else
+        SimInf_dheap_down(heap, pos, n, k);
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef INCLUDE_SIMINF_DHEAP_H
+#define INCLUDE_SIMINF_DHEAP_H
+
+/* An entry in an indexed d-ary min-heap. The time and the index of
+ * the item are stored together, so that comparing and moving an
+ * entry touches a single cache line. */
+typedef struct SimInf_dheap_entry
+{
+    double time;
+    int index;
+} SimInf_dheap_entry;
+
+void SimInf_dheap_init(SimInf_dheap_entry *heap, int *pos, int n);
+void SimInf_dheap_update(SimInf_dheap_entry *heap, int *pos, int n, int k);
+
+#endif
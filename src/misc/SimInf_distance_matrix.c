@@ -20,6 +20,35 @@
 
 #include <Rinternals.h>
 #include <R_ext/Visibility.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SimInf_openmp.h"
+#include "kvec.h"
+
+/* A neighbor of a node within the cutoff. */
+typedef struct SimInf_neighbor
+{
+    int index;
+    double distance;
+} SimInf_neighbor;
+
+typedef kvec_t(SimInf_neighbor) SimInf_neighbor_vec;
+
+/* A uniform grid of square cells, where the nodes are sorted by the
+ * cell they are located in, and by index within a cell. The side of
+ * a cell is larger than the cutoff, so the neighbors within the cutoff
+ * of a node are in the same or in one of the eight adjacent cells. */
+typedef struct SimInf_grid
+{
+    double x_min;   /**< The smallest x coordinate. */
+    double y_min;   /**< The smallest y coordinate. */
+    double side;    /**< The side of a cell. */
+    R_xlen_t nx;    /**< The number of cells along x. */
+    R_xlen_t ny;    /**< The number of cells along y. */
+    R_xlen_t *jc;   /**< The nodes in cell k are node[jc[k]] to
+                     *   node[jc[k + 1] - 1]. */
+    int *node;      /**< The nodes sorted by cell. */
+} SimInf_grid;
 
 static R_xlen_t
 SimInf_Euclidean_distance(
@@ -74,6 +103,236 @@ SimInf_Euclidean_distance(
     return n;
 }
 
+static int
+SimInf_neighbor_cmp(
+    const void *a,
+    const void *b)
+{
+    const int i = ((const SimInf_neighbor*)a)->index;
+    const int j = ((const SimInf_neighbor*)b)->index;
+
+    return (i > j) - (i < j);
+}
+
+/**
+ * Append a neighbor to the vector of neighbors.
+ *
+ * @return 0 if Ok, or -1 if memory could not be allocated.
+ */
+static int
+SimInf_neighbor_push(
+    SimInf_neighbor_vec *neighbors,
+    int index,
+    double distance)
+{
+    if (kv_size(*neighbors) == kv_max(*neighbors)) {
+        const size_t m = kv_max(*neighbors) ? 2 * kv_max(*neighbors) : 64;
+        SimInf_neighbor *a = realloc(neighbors->a, m * sizeof(SimInf_neighbor));
+
+        if (!a)
+            return -1; /* #nocov */
+        neighbors->a = a;
+        neighbors->m = m;
+    }
+
+    kv_A(*neighbors, neighbors->n).index = index;
+    kv_A(*neighbors, neighbors->n).distance = distance;
+    neighbors->n++;
+
+    return 0;
+}
+
+static R_xlen_t
+SimInf_grid_cell_x(
+    const SimInf_grid *grid,
+    double x)
+{
+    R_xlen_t k = (R_xlen_t)((x - grid->x_min) / grid->side);
+    return k < grid->nx ? k : grid->nx - 1;
+}
+
+static R_xlen_t
+SimInf_grid_cell_y(
+    const SimInf_grid *grid,
+    double y)
+{
+    R_xlen_t k = (R_xlen_t)((y - grid->y_min) / grid->side);
+    return k < grid->ny ? k : grid->ny - 1;
+}
+
+static void
+SimInf_grid_free(
+    SimInf_grid *grid)
+{
+    free(grid->jc);
+    grid->jc = NULL;
+    free(grid->node);
+    grid->node = NULL;
+}
+
+/**
+ * Sort the nodes into a uniform grid.
+ *
+ * @param grid the resulting grid.
+ * @param x the x coordinate of each node.
+ * @param y the y coordinate of each node.
+ * @param cutoff the largest distance between neighbors.
+ * @param len the number of nodes.
+ * @return 0 if Ok, 1 if the grid cannot be used for the coordinates,
+ *         or -1 if memory could not be allocated.
+ */
+static int
+SimInf_grid_create(
+    SimInf_grid *grid,
+    const double *x,
+    const double *y,
+    double cutoff,
+    R_xlen_t len)
+{
+    double x_max, y_max, scale;
+    R_xlen_t i, k, *pos = NULL;
+
+    memset(grid, 0, sizeof(SimInf_grid));
+
+    /* Use the exact computation of all distances to report invalid
+     * distances. */
+    x_max = grid->x_min = x[0];
+    y_max = grid->y_min = y[0];
+    for (i = 0; i < len; i++) {
+        if (!R_FINITE(x[i]) || !R_FINITE(y[i]))
+            return 1;
+        if (x[i] < grid->x_min)
+            grid->x_min = x[i];
+        if (x[i] > x_max)
+            x_max = x[i];
+        if (y[i] < grid->y_min)
+            grid->y_min = y[i];
+        if (y[i] > y_max)
+            y_max = y[i];
+    }
+    if (!R_FINITE(hypot(x_max - grid->x_min, y_max - grid->y_min)))
+        return 1;
+
+    /* The side of a cell is slightly larger than the cutoff, so that
+     * rounding errors when determining the cell of a node cannot
+     * move two neighbors more than one cell apart. Make the cells
+     * larger to keep the number of cells at most in proportion to
+     * the number of nodes. */
+    scale = fmax(fmax(fabs(grid->x_min), fabs(x_max)),
+                 fmax(fabs(grid->y_min), fabs(y_max)));
+    grid->side = fmax(cutoff * 1.001, scale * 1e-9);
+    if (grid->side <= 0.0)
+        grid->side = 1.0;
+    for (;;) {
+        const double nx = floor((x_max - grid->x_min) / grid->side) + 1.0;
+        const double ny = floor((y_max - grid->y_min) / grid->side) + 1.0;
+
+        if (nx * ny <= 4.0 * len + 16.0) {
+            grid->nx = (R_xlen_t)nx;
+            grid->ny = (R_xlen_t)ny;
+            break;
+        }
+
+        grid->side *= 2.0;
+    }
+
+    /* Counting sort of the nodes by cell. */
+    grid->jc = calloc(grid->nx * grid->ny + 1, sizeof(R_xlen_t));
+    grid->node = malloc(len * sizeof(int));
+    pos = malloc(len * sizeof(R_xlen_t));
+    if (!grid->jc || !grid->node || !pos) {
+        free(pos);              /* #nocov */
+        SimInf_grid_free(grid); /* #nocov */
+        return -1;              /* #nocov */
+    }
+
+    for (i = 0; i < len; i++) {
+        pos[i] = SimInf_grid_cell_y(grid, y[i]) * grid->nx +
+            SimInf_grid_cell_x(grid, x[i]);
+        grid->jc[pos[i] + 1]++;
+    }
+    for (k = 0; k < grid->nx * grid->ny; k++)
+        grid->jc[k + 1] += grid->jc[k];
+    for (i = 0; i < len; i++)
+        grid->node[grid->jc[pos[i]]++] = i;
+    for (k = grid->nx * grid->ny; k > 0; k--)
+        grid->jc[k] = grid->jc[k - 1];
+    grid->jc[0] = 0;
+
+    free(pos);
+
+    return 0;
+}
+
+/**
+ * Determine the neighbors within the cutoff of the nodes from, ...,
+ * to - 1 with the grid. The neighbors are appended to 'neighbors' by
+ * increasing index for each node, and the number of neighbors of
+ * node i is stored in n[i].
+ *
+ * @return 0 if Ok, 1 if 'min_dist' is invalid and needed, or -1 if
+ *         memory could not be allocated.
+ */
+static int
+SimInf_grid_distance(
+    const SimInf_grid *grid,
+    const double* x,
+    const double* y,
+    double cutoff,
+    double min_dist,
+    R_xlen_t from,
+    R_xlen_t to,
+    SimInf_neighbor_vec *neighbors,
+    int *n)
+{
+    for (R_xlen_t i = from; i < to; i++) {
+        const R_xlen_t cx = SimInf_grid_cell_x(grid, x[i]);
+        const R_xlen_t cy = SimInf_grid_cell_y(grid, y[i]);
+        const size_t start = kv_size(*neighbors);
+
+        for (R_xlen_t ky = cy > 0 ? cy - 1 : 0;
+             ky <= cy + 1 && ky < grid->ny; ky++) {
+            for (R_xlen_t kx = cx > 0 ? cx - 1 : 0;
+                 kx <= cx + 1 && kx < grid->nx; kx++) {
+                const R_xlen_t k = ky * grid->nx + kx;
+
+                for (R_xlen_t l = grid->jc[k]; l < grid->jc[k + 1]; l++) {
+                    const int j = grid->node[l];
+
+                    if (i != j) {
+                        /* Calculate the Euclidean distance. */
+                        double d = hypot(x[i] - x[j], y[i] - y[j]);
+
+                        if (d <= cutoff) {
+                            if (d <= 0) {
+                                if (!R_FINITE(min_dist) || min_dist < 0)
+                                    return 1;
+                                d = min_dist;
+                            }
+
+                            if (SimInf_neighbor_push(neighbors, j, d))
+                                return -1; /* #nocov */
+                        }
+                    }
+                }
+            }
+        }
+
+        /* The nodes are sorted by index within a cell, but not
+         * across cells. */
+        for (size_t k = start + 1; k < kv_size(*neighbors); k++) {
+            if (kv_A(*neighbors, k).index < kv_A(*neighbors, k - 1).index) {
+                qsort(&kv_A(*neighbors, start), kv_size(*neighbors) - start,
+                      sizeof(SimInf_neighbor), SimInf_neighbor_cmp);
+                break;
+            }
+        }
+        n[i] = kv_size(*neighbors) - start;
+    }
+
+    return 0;
+}
+
 SEXP attribute_hidden
 SimInf_distance_matrix(
     SEXP x_,
@@ -91,6 +350,9 @@ SimInf_distance_matrix(
     SEXP row_indices;
     SEXP col_indices;
     SEXP result;
+    SimInf_grid grid;
+    R_xlen_t Nchunk;
+    int error;
 
     /* Check that the input vectors have an identical length > 0. */
     if (len < 1)
@@ -102,34 +364,121 @@ SimInf_distance_matrix(
     if (!R_FINITE(cutoff) || cutoff < 0)
         Rf_error("'cutoff' must be > 0.");
 
-    /* First, iterate over all the elements to determine the required
-     * length for the result vector. */
-    n = SimInf_Euclidean_distance(
-        x,
-        y,
-        cutoff,
-        min_dist,
-        len,
-        NULL,
-        NULL,
-        NULL);
-
-    /* Allocate vectors for the sparse matrix. */
-    PROTECT(distance = Rf_allocVector(REALSXP, n));
-    PROTECT(row_indices = Rf_allocVector(INTSXP, n));
-    PROTECT(col_indices = Rf_allocVector(INTSXP, len + 1));
-
-    /* Now, iterate over all the elements again and save the result in
-     * the allocated result vectors. */
-    SimInf_Euclidean_distance(
-        x,
-        y,
-        cutoff,
-        min_dist,
-        len,
-        REAL(distance),
-        INTEGER(row_indices),
-        INTEGER(col_indices));
+    /* Sort the nodes into a grid, so that only the nodes in adjacent
+     * cells are candidates for the neighbors of a node. */
+    error = SimInf_grid_create(&grid, x, y, cutoff, len);
+    if (error < 0)
+        Rf_error("Unable to allocate memory buffer."); /* #nocov */
+
+    if (error == 0) {
+        SimInf_neighbor_vec *neighbors = NULL;
+        double *d;
+        int *col, *row;
+
+        /* Use all available threads in parallel regions. */
+        SimInf_set_num_threads(-1);
+
+        /* Split the nodes into chunks that are processed in parallel,
+         * where each chunk appends the neighbors of its nodes to a
+         * separate vector. */
+        Nchunk = 8 * (R_xlen_t)SimInf_num_threads();
+        if (Nchunk > len)
+            Nchunk = len;
+        neighbors = calloc(Nchunk, sizeof(SimInf_neighbor_vec));
+        if (!neighbors) {
+            SimInf_grid_free(&grid);                       /* #nocov */
+            Rf_error("Unable to allocate memory buffer."); /* #nocov */
+        }
+
+        PROTECT(col_indices = Rf_allocVector(INTSXP, len + 1));
+        col = INTEGER(col_indices);
+
+        #ifdef _OPENMP
+        #  pragma omp parallel for num_threads(SimInf_num_threads()) schedule(dynamic)
+        #endif
+        for (R_xlen_t c = 0; c < Nchunk; c++) {
+            const int rc = SimInf_grid_distance(
+                &grid, x, y, cutoff, min_dist,
+                c * len / Nchunk, (c + 1) * len / Nchunk,
+                &neighbors[c], &col[1]);
+
+            if (rc) {
+                #ifdef _OPENMP
+                #  pragma omp critical
+                #endif
+                if (!error || rc < 0)
+                    error = rc;
+            }
+        }
+
+        SimInf_grid_free(&grid);
+
+        if (!error) {
+            /* Determine the start of each column, and copy the
+             * neighbors of each chunk to the result vectors. */
+            col[0] = 0;
+            for (R_xlen_t i = 0; i < len; i++)
+                col[i + 1] += col[i];
+            n = col[len];
+
+            PROTECT(distance = Rf_allocVector(REALSXP, n));
+            PROTECT(row_indices = Rf_allocVector(INTSXP, n));
+            d = REAL(distance);
+            row = INTEGER(row_indices);
+
+            #ifdef _OPENMP
+            #  pragma omp parallel for num_threads(SimInf_num_threads())
+            #endif
+            for (R_xlen_t c = 0; c < Nchunk; c++) {
+                const R_xlen_t offset = col[c * len / Nchunk];
+
+                for (size_t k = 0; k < kv_size(neighbors[c]); k++) {
+                    d[offset + k] = kv_A(neighbors[c], k).distance;
+                    row[offset + k] = kv_A(neighbors[c], k).index;
+                }
+            }
+        }
+
+        for (R_xlen_t c = 0; c < Nchunk; c++)
+            kv_destroy(neighbors[c]);
+        free(neighbors);
+
+        if (error < 0)
+            Rf_error("Unable to allocate memory buffer."); /* #nocov */
+        if (error > 0) {
+            Rf_error("Invalid 'min_dist' argument. "
+                     "Please provide 'min_dist' > 0.");
+        }
+    } else {
+        /* First, iterate over all the elements to determine the
+         * required length for the result vector. */
+        n = SimInf_Euclidean_distance(
+            x,
+            y,
+            cutoff,
+            min_dist,
+            len,
+            NULL,
+            NULL,
+            NULL);
+
+        /* Allocate vectors for the sparse matrix. */
+        PROTECT(col_indices = Rf_allocVector(INTSXP, len + 1));
+        PROTECT(distance = Rf_allocVector(REALSXP, n));
+        PROTECT(row_indices = Rf_allocVector(INTSXP, n));
+
+        /* Now, iterate over all the elements again and save the
+         * result in the allocated result vectors. */
+        SimInf_Euclidean_distance(
+            x,
+            y,
+            cutoff,
+            min_dist,
+            len,
+            REAL(distance),
+            INTEGER(row_indices),
+            INTEGER(col_indices));
+    }
 
     /* Create the sparse matrix. */
     PROTECT(result = R_do_new_object(R_do_MAKE_CLASS("dgCMatrix")));
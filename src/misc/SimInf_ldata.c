@@ -24,6 +24,31 @@
 #include <R_ext/Visibility.h>
 #include "SimInf.h"
 #include "SimInf_arg.h"
+#include "SimInf_openmp.h"
+
+/**
+ * Determine the value of a neighbor from the distance to it.
+ *
+ * @param distance The distance to the neighbor.
+ * @param degree The number of neighbors of the neighbor.
+ * @param metric The type of value to calculate, see SimInf_ldata_sp.
+ * @return The value of the neighbor.
+ */
+static double
+SimInf_neighbor_value(
+    double distance,
+    int degree,
+    int metric)
+{
+    switch (metric) {
+    case 1:
+        return distance;
+    case 2:
+        return 1.0 / (distance * distance);
+    default:
+        return degree;
+    }
+}
 
 /**
  * Combine local model parameters and spatial coupling to neighbors in
@@ -81,21 +106,20 @@ SimInf_ldata_sp(
     if (Nn != (LENGTH(R_do_slot(distance, Rf_install("p"))) - 1))
         Rf_error("The number of nodes in 'data' and 'distance' are not equal.");
 
+    /* Use all available threads in parallel regions. */
+    SimInf_set_num_threads(-1);
+
     /* Calculate length of 'Nld' in 'ldata' for each node in the
      * following three steps: 1), 2), and 3).
      */
 
     /* 1) Determine the maximum number of neighbors in the 'distance'
-     * matrix and the number of neighbors (degree) for each node. */
-    degree = malloc(Nn * sizeof(int));
-    if (!degree)
-        Rf_error("Unable to allocate memory buffer."); /* #nocov */
+     * matrix. */
     Nld = 0;
     for (i = 0; i < Nn; i++) {
         const int k = jc[i + 1] - jc[i];
         if (k > Nld)
             Nld = k;
-        degree[i] = k;
     }
 
     /* 2) Create one pair for each neighbor (index, value) and add one
@@ -111,27 +135,30 @@ SimInf_ldata_sp(
     memset(REAL(result), 0, Nn * Nld * sizeof(double));
     ldata = REAL(result);
 
+    /* Determine the number of neighbors (degree) for each node. The
+     * buffer is allocated after the R objects, so that it does not
+     * leak if an allocation fails. */
+    degree = malloc((Nn > 0 ? Nn : 1) * sizeof(int));
+    if (!degree)
+        Rf_error("Unable to allocate memory buffer."); /* #nocov */
+    for (i = 0; i < Nn; i++)
+        degree[i] = jc[i + 1] - jc[i];
+
+    #ifdef _OPENMP
+    #  pragma omp parallel for num_threads(SimInf_num_threads())
+    #endif
     for (node = 0; node < Nn; node++) {
         int k = 0;
 
         /* Copy local model parameters */
-        for (i = 0; i < n_data; i++, k++)
+        for (int j = 0; j < n_data; j++, k++)
             ldata[node * Nld + k] = ld[node * n_data + k];
 
         /* Copy neighbor data */
-        for (i = jc[node]; i < jc[node + 1]; i++) {
-            ldata[node * Nld + k++] = ir[i];
-            switch (m) {
-            case 1:
-                ldata[node * Nld + k++] = val[i];
-                break;
-            case 2:
-                ldata[node * Nld + k++] = 1.0 / (val[i] * val[i]);
-                break;
-            default:
-                ldata[node * Nld + k++] = degree[ir[i]];
-                break;
-            }
+        for (int j = jc[node]; j < jc[node + 1]; j++) {
+            ldata[node * Nld + k++] = ir[j];
+            ldata[node * Nld + k++] =
+                SimInf_neighbor_value(val[j], degree[ir[j]], m);
         }
 
         /* Add stop */
@@ -145,3 +172,100 @@ SimInf_ldata_sp(
 
     return result;
 }
+
+/**
+ * Create the sparse matrix with the neighbors of each node, that is
+ * passed to the solver in the 'neighbors' slot of the model.
+ *
+ * @param distance Sparse matrix with distances between nodes.
+ * @param metric The type of value to calculate for each neighbor:
+ *   0: degree
+ *   1: distance
+ *   2: 1 / (distance * distance)
+ * @return A sparse matrix (dgCMatrix) with the same structure as
+ *   'distance', where the neighbors of node j are in column j and
+ *   the values are determined by the metric argument.
+ */
+SEXP attribute_hidden
+SimInf_neighbors_sp(
+    SEXP distance,
+    SEXP metric)
+{
+    SEXP result, i_result, p_result, x_result;
+    const double *val;
+    double *x;
+    const int *ir, *jc;
+    int *degree, *i, *p, Nn, nnz, m;
+
+    /* Check arguments */
+    if (SimInf_arg_check_dgCMatrix(distance))
+        Rf_error("Invalid 'distance' argument.");
+    if (SimInf_arg_check_integer(metric))
+        Rf_error("Invalid 'metric' argument.");
+
+    /* Extract data from the distance matrix */
+    ir = INTEGER(R_do_slot(distance, Rf_install("i")));
+    jc = INTEGER(R_do_slot(distance, Rf_install("p")));
+    val = REAL(R_do_slot(distance, Rf_install("x")));
+    Nn = LENGTH(R_do_slot(distance, Rf_install("p"))) - 1;
+    nnz = jc[Nn];
+
+    /* Extract data from 'metric' */
+    m = INTEGER(metric)[0];
+
+    /* Use all available threads in parallel regions. */
+    SimInf_set_num_threads(-1);
+
+    PROTECT(i_result = Rf_allocVector(INTSXP, nnz));
+    PROTECT(p_result = Rf_allocVector(INTSXP, Nn + 1));
+    PROTECT(x_result = Rf_allocVector(REALSXP, nnz));
+    i = INTEGER(i_result);
+    p = INTEGER(p_result);
+    x = REAL(x_result);
+
+    /* Determine the number of neighbors (degree) for each node. The
+     * buffer is allocated after the R objects, so that it does not
+     * leak if an allocation fails. */
+    degree = malloc((Nn > 0 ? Nn : 1) * sizeof(int));
+    if (!degree)
+        Rf_error("Unable to allocate memory buffer."); /* #nocov */
+
+    #ifdef _OPENMP
+    #  pragma omp parallel num_threads(SimInf_num_threads())
+    #endif
+    {
+        #ifdef _OPENMP
+        #  pragma omp for
+        #endif
+        for (int node = 0; node <= Nn; node++) {
+            p[node] = jc[node];
+            if (node < Nn)
+                degree[node] = jc[node + 1] - jc[node];
+        }
+
+        /* The degree of every node must be known before the
+         * values are calculated, which is ensured by the implicit
+         * barrier at the end of the loop above. */
+        #ifdef _OPENMP
+        #  pragma omp for
+        #endif
+        for (int k = 0; k < nnz; k++) {
+            i[k] = ir[k];
+            x[k] = SimInf_neighbor_value(val[k], degree[ir[k]], m);
+        }
+    }
+
+    free(degree);
+
+    /* Create the sparse matrix. */
+    PROTECT(result = R_do_new_object(R_do_MAKE_CLASS("dgCMatrix")));
+    R_do_slot_assign(result, Rf_install("x"), x_result);
+    R_do_slot_assign(result, Rf_install("i"), i_result);
+    R_do_slot_assign(result, Rf_install("p"), p_result);
+    INTEGER(R_do_slot(result, Rf_install("Dim")))[0] = Nn;
+    INTEGER(R_do_slot(result, Rf_install("Dim")))[1] = Nn;
+
+    UNPROTECT(4);
+
+    return result;
+}
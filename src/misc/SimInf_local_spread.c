@@ -22,6 +22,48 @@
  */
 
 #include <R_ext/Visibility.h>
+#include <stddef.h>
+#include "SimInf.h"
+#include "SimInf_local_spread.h"
+
+/* The number of individuals in each node, counted by the solver
+ * before the post time step function is called for the nodes in a
+ * partition. There is one context for each thread, so that the
+ * solvers can run concurrently, e.g., replicates in parallel. */
+typedef struct SimInf_local_spread_data
+{
+    const int *u;    /**< The compartment state vector in the first
+                      *   node, or NULL. */
+    const double *N; /**< The number of individuals in each node. */
+    int Nc;          /**< The number of compartments in each node. */
+} SimInf_local_spread_data;
+
+static SimInf_local_spread_data context = {NULL, NULL, 0};
+#ifdef _OPENMP
+#  pragma omp threadprivate(context)
+#endif
+
+/**
+ * Set the number of individuals in each node to use in
+ * SimInf_local_spread in the current thread, instead of counting the
+ * individuals in every neighbor.
+ *
+ * @param u The compartment state vector in the first node, or NULL
+ *        to clear the context.
+ * @param N The number of individuals in each node when the
+ *        compartment state is u.
+ * @param Nc The number of compartments in each node.
+ */
+void attribute_hidden
+SimInf_local_spread_context(
+    const int *u,
+    const double *N,
+    int Nc)
+{
+    context.u = u;
+    context.N = N;
+    context.Nc = Nc;
+}
 
 /**
  * Local spread of the environmental infectious pressure phi among
@@ -53,6 +95,24 @@ SimInf_local_spread(
     double N_j, ls = 0.0;
     const double phi_i_N_i = phi_i * N_i;
 
+    /* Use the number of individuals counted by the solver if it was
+     * counted from the same compartment state. */
+    if (context.N && context.u == u && context.Nc == Nc) {
+        const double *N = context.N;
+
+        j = (int)*neighbors++;
+        while (j >= 0) {
+            if (N[j] > 0.0)
+                ls += ((phi[j] * N[j] - phi_i_N_i) * D) / (N_i * (*neighbors));
+
+            /* Move to next neighbor pair (index, distance) */
+            neighbors++;
+            j = (int)*neighbors++;
+        }
+
+        return ls;
+    }
+
     j = (int)*neighbors++;
     while (j >= 0) {
         /* Count number of individuals in node j */
@@ -69,3 +129,62 @@ SimInf_local_spread(
 
     return ls;
 }
+
+/**
+ * Local spread of the environmental infectious pressure phi among
+ * the neighbors of a node in the 'neighbors' matrix of the model.
+ *
+ * @param ls The contribution from neighbors to phi in node i, or 0
+ * if the model has no neighbors.
+ * @param neighbors The neighbors of each node, that the solver
+ * passes to the post time step function.
+ * @param node The node i.
+ * @param phi Vector with phi in each node
+ * @param u The compartment state vector in each node.
+ * @param N_i The number of individuals in node i.
+ * @param phi_i The environmental infectious pressure phi in node i.
+ * @param Nc The number of compartments in each node.
+ * @param D The spatial coupling of the environmental infectious
+ * pressure phi among proximal nodes.
+ * @return 0 if Ok, else SIMINF_ERR_INVALID_NEIGHBORS if neighbors is
+ * NULL.
+ */
+int attribute_hidden
+SimInf_local_spread_neighbors(
+    double *ls,
+    const SimInf_neighbors *neighbors,
+    const int node,
+    const double *phi,
+    const int *u,
+    const double N_i,
+    const double phi_i,
+    const int Nc,
+    const double D)
+{
+    const double phi_i_N_i = phi_i * N_i;
+
+    *ls = 0.0;
+    if (!neighbors)
+        return SIMINF_ERR_INVALID_NEIGHBORS;
+    if (!neighbors->ir)
+        return 0;
+
+    for (int k = neighbors->jc[node]; k < neighbors->jc[node + 1]; k++) {
+        const int j = neighbors->ir[k];
+        double N_j = 0.0;
+
+        if (neighbors->N) {
+            N_j = neighbors->N[j];
+        } else {
+            /* Count number of individuals in node j */
+            for (int l = j * Nc; l < (j + 1) * Nc; l++)
+                N_j += u[l];
+        }
+
+        if (N_j > 0.0)
+            *ls += ((phi[j] * N_j - phi_i_N_i) * D) /
+                (N_i * neighbors->pr[k]);
+    }
+
+    return 0;
+}
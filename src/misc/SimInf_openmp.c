@@ -21,6 +21,16 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+/* The thread affinity is set with sched_setaffinity, which is only
+ * available on Linux. */
+#if defined(__linux__) && defined(_OPENMP)
+#  ifndef _GNU_SOURCE
+#    define _GNU_SOURCE
+#  endif
+#  include <sched.h>
+#  define SIMINF_HAVE_AFFINITY 1
+#endif
+
 #include <Rinternals.h>
 #include <R_ext/Visibility.h>
 #include <stdlib.h>
@@ -41,6 +51,28 @@ static int SimInf_max_threads = -1;
  * run. */
 static int SimInf_threads = -1;
 
+/* Non-zero if the partitions of the nodes are assigned to the
+ * threads in a fixed order and each thread is bound to a processor,
+ * so that the state of a partition is first touched by, and stays in
+ * the memory local to, the thread that simulates it. */
+static int SimInf_numa = 0;
+
+#ifdef SIMINF_HAVE_AFFINITY
+/* The processors that the process could run on when SimInf was
+ * loaded, and a flag to indicate that threads may have been bound to
+ * one of them and must be released when SimInf_numa is zero. */
+static cpu_set_t SimInf_cpuset;
+static int SimInf_have_cpuset = 0;
+static int SimInf_bound = 0;
+
+/* The processors that the main thread could run on before it was
+ * bound to a processor in SimInf_bind_thread(), and a flag to
+ * indicate that they must be restored by
+ * SimInf_restore_thread_affinity(). */
+static cpu_set_t SimInf_cpuset_main;
+static int SimInf_have_cpuset_main = 0;
+#endif
+
 int attribute_hidden SimInf_num_threads(void)
 {
     return SimInf_threads;
@@ -57,6 +89,89 @@ int attribute_hidden SimInf_set_num_threads(int threads)
     return SimInf_threads;
 }
 
+/* Bind the calling thread to a processor if SimInf_numa is non-zero,
+ * else release it if it has been bound. The threads of the outermost
+ * parallel region are spread evenly over the processors that the
+ * process could run on when SimInf was loaded, so that the threads
+ * are distributed among the NUMA nodes. The function has no effect
+ * if thread affinity is not supported. */
+void attribute_hidden SimInf_bind_thread(void)
+{
+#ifdef SIMINF_HAVE_AFFINITY
+    if (SimInf_have_cpuset && (SimInf_numa || SimInf_bound)) {
+        cpu_set_t cpuset = SimInf_cpuset;
+
+        if (SimInf_numa) {
+            const int Ncpu = CPU_COUNT(&SimInf_cpuset);
+            const int level = omp_get_level() > 0 ? 1 : 0;
+            const int n = omp_get_team_size(level);
+            const int k = omp_get_ancestor_thread_num(level);
+            int cpu = -1, j = (int)(((long long)k * Ncpu) / n);
+
+            /* Find the j:th available processor. */
+            while (j >= 0) {
+                cpu++;
+                if (CPU_ISSET(cpu, &SimInf_cpuset))
+                    j--;
+            }
+
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu, &cpuset);
+
+            /* Save the processors of the main thread, i.e., the
+             * thread that runs R, so that it is not confined to one
+             * processor after the simulation. */
+            if (k == 0 && !SimInf_have_cpuset_main &&
+                sched_getaffinity(0, sizeof(SimInf_cpuset_main),
+                                  &SimInf_cpuset_main) == 0)
+            {
+                SimInf_have_cpuset_main = 1;
+            }
+        }
+
+        /* Binding the thread is an optimization, so ignore any
+         * error. */
+        if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == 0 &&
+            SimInf_numa)
+        {
+            #pragma omp atomic write
+            SimInf_bound = 1;
+        }
+    }
+#endif
+}
+
+/* Restore the processors that the main thread could run on before
+ * it was bound to a processor in SimInf_bind_thread(). Must be called
+ * by the main thread outside the parallel regions after the
+ * simulation. */
+void attribute_hidden SimInf_restore_thread_affinity(void)
+{
+#ifdef SIMINF_HAVE_AFFINITY
+    if (SimInf_have_cpuset_main) {
+        sched_setaffinity(0, sizeof(SimInf_cpuset_main),
+                          &SimInf_cpuset_main);
+        SimInf_have_cpuset_main = 0;
+    }
+#endif
+}
+
+/* Set the schedule of the loops over the partitions of the nodes in
+ * the solvers, which use schedule(runtime). The partitions are
+ * distributed dynamically among the threads to balance the load, or
+ * in a fixed order if the state of a partition should stay local to
+ * one thread. Must be called by every thread at the start of a
+ * parallel region. The schedule is then only set in the implicit
+ * tasks of that region, so the schedule of other OpenMP code in the
+ * process, e.g. from the OMP_SCHEDULE environment variable, is not
+ * changed. */
+void attribute_hidden SimInf_set_schedule(void)
+{
+#ifdef _OPENMP
+    omp_set_schedule(SimInf_numa ? omp_sched_static : omp_sched_dynamic, 1);
+#endif
+}
+
 /* Get the value of the environmental variable 'SIMINF_NUM_THREADS'
  * (if it exists and is greater than 0). */
 #ifdef _OPENMP
@@ -82,13 +197,32 @@ static int SimInf_get_max_threads(void)
  * 'OMP_THREAD_LIMIT', 'OMP_NUM_THREADS', and 'SIMINF_NUM_THREADS' to
  * find the number of threads. Additionally, it can be controlled by
  * the 'threads' argument when called from 'R'. If called from R, it
- * returns the old value of the maximum number of threads used. */
-SEXP attribute_hidden SimInf_init_threads(SEXP threads)
+ * returns the old value of the maximum number of threads used. The
+ * 'numa' argument determines if the state of a partition of the
+ * nodes should stay local to the thread that simulates it, see
+ * SimInf_numa. */
+SEXP attribute_hidden SimInf_init_threads(SEXP threads, SEXP numa)
 {
     int old_value = SimInf_max_threads;
 
+#ifdef SIMINF_HAVE_AFFINITY
+    /* Save the processors that the process can run on the first time
+     * this function is called, i.e., before any thread is bound. */
+    if (!SimInf_have_cpuset &&
+        sched_getaffinity(0, sizeof(SimInf_cpuset), &SimInf_cpuset) == 0 &&
+        CPU_COUNT(&SimInf_cpuset) > 0)
+    {
+        SimInf_have_cpuset = 1;
+    }
+#endif
+
+    /* Keep the state of a partition local to one thread. */
+    SimInf_numa = Rf_isLogical(numa) && LENGTH(numa) == 1 &&
+        LOGICAL(numa)[0] == TRUE;
+
 #ifdef _OPENMP
     int thread_limit;
+
     SimInf_max_threads = omp_get_num_procs();
 
     /* The thread limit can be set with the OMP_THREAD_LIMIT
@@ -30,5 +30,8 @@
 
 int SimInf_num_threads(void);
 int SimInf_set_num_threads(int threads);
+void SimInf_bind_thread(void);
+void SimInf_restore_thread_affinity(void);
+void SimInf_set_schedule(void);
 
 #endif
@@ -0,0 +1,150 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Counter-based random number generator Philox4x32-10, see
+ * Salmon JK, Moraes MA, Dror RO, Shaw DE (2011) Parallel random
+ * numbers: as easy as 1, 2, 3. Proceedings of the International
+ * Conference for High Performance Computing, Networking, Storage and
+ * Analysis. doi: 10.1145/2063384.2063405
+ *
+ * The output is a function of a key and a counter only. The key is
+ * the seed, and the two high words of the counter identify a stream,
+ * e.g., a node in the model, while the two low words of the counter
+ * are incremented for each block of four random numbers. Hence, all
+ * streams are independent of each other and of the order in which
+ * they are used. */
+
+#include <R_ext/Visibility.h>
+
+#include "misc/SimInf_philox.h"
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+#define PHILOX_ROUNDS 10
+
+typedef struct SimInf_philox_state
+{
+    uint32_t key[2];  /**< The seed. */
+    uint32_t ctr[4];  /**< The counter of the next block. */
+    uint32_t out[4];  /**< The current block of random numbers. */
+    int index;        /**< Index to the next random number in out. */
+} SimInf_philox_state;
+
+static void
+SimInf_philox_block(
+    SimInf_philox_state *state)
+{
+    uint32_t c0 = state->ctr[0], c1 = state->ctr[1];
+    uint32_t c2 = state->ctr[2], c3 = state->ctr[3];
+    uint32_t k0 = state->key[0], k1 = state->key[1];
+
+    for (int i = 0; i < PHILOX_ROUNDS; i++) {
+        const uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        const uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    state->out[0] = c0;
+    state->out[1] = c1;
+    state->out[2] = c2;
+    state->out[3] = c3;
+    state->index = 0;
+
+    /* Increment the block counter. */
+    if (++state->ctr[0] == 0)
+        state->ctr[1]++;
+}
+
+static unsigned long int
+SimInf_philox_get(
+    void *vstate)
+{
+    SimInf_philox_state *state = (SimInf_philox_state *)vstate;
+
+    if (state->index > 3)
+        SimInf_philox_block(state);
+
+    return state->out[state->index++];
+}
+
+static double
+SimInf_philox_get_double(
+    void *vstate)
+{
+    return SimInf_philox_get(vstate) / 4294967296.0;
+}
+
+static void
+SimInf_philox_seed(
+    void *vstate,
+    unsigned long int seed)
+{
+    SimInf_philox_state *state = (SimInf_philox_state *)vstate;
+
+    state->key[0] = (uint32_t)seed;
+    state->key[1] = (uint32_t)((uint64_t)seed >> 32);
+    state->ctr[0] = 0;
+    state->ctr[1] = 0;
+    state->ctr[2] = 0;
+    state->ctr[3] = 0;
+    state->index = 4;
+}
+
+static const gsl_rng_type SimInf_philox_type =
+{
+    "philox4x32",                /* name */
+    0xffffffffUL,                /* RAND_MAX */
+    0,                           /* RAND_MIN */
+    sizeof(SimInf_philox_state),
+    &SimInf_philox_seed,
+    &SimInf_philox_get,
+    &SimInf_philox_get_double
+};
+
+const gsl_rng_type attribute_hidden *SimInf_rng_philox = &SimInf_philox_type;
+
+/**
+ * Set the seed and the stream of a Philox random number generator.
+ *
+ * @param r a random number generator of type SimInf_rng_philox.
+ * @param seed the seed, i.e., the key of the generator.
+ * @param stream the index of the stream, e.g., the node.
+ */
+void attribute_hidden
+SimInf_philox_set(
+    gsl_rng *r,
+    unsigned long int seed,
+    uint64_t stream)
+{
+    SimInf_philox_state *state = (SimInf_philox_state *)r->state;
+
+    SimInf_philox_seed(state, seed);
+    state->ctr[2] = (uint32_t)stream;
+    state->ctr[3] = (uint32_t)(stream >> 32);
+}
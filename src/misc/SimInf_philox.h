@@ -0,0 +1,33 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_SIMINF_PHILOX_H
+#define INCLUDE_SIMINF_PHILOX_H
+
+#include <stdint.h>
+#include <gsl/gsl_rng.h>
+
+/* Counter-based random number generator Philox4x32-10 for use with
+ * the GSL random number distributions. */
+extern const gsl_rng_type *SimInf_rng_philox;
+
+void SimInf_philox_set(gsl_rng *r, unsigned long int seed, uint64_t stream);
+
+#endif
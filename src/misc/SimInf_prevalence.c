@@ -0,0 +1,206 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <Rdefines.h>
+#include <R_ext/Visibility.h>
+#include "SimInf.h"
+#include "SimInf_openmp.h"
+#include "SimInf_prevalence.h"
+
+/**
+ * Calculate the prevalence from the trajectory in one pass over the
+ * compartments of the nodes at each time point.
+ *
+ * @param m the trajectory 'U', a dense integer matrix or a sparse
+ *        'dgCMatrix', with the compartments of node i in the rows
+ *        (i * Nc + 1) to ((i + 1) * Nc).
+ * @param cases integer vector with the one-based compartments of the
+ *        cases.
+ * @param population integer vector with the one-based compartments
+ *        of the population.
+ * @param condition NULL or a logical matrix (length(index) X tlen)
+ *        that selects the nodes to include at each time point. A
+ *        missing value gives a missing prevalence.
+ * @param n_nodes the number of nodes in the trajectory.
+ * @param level 1 (population prevalence), 2 (node prevalence) or 3
+ *        (within-node prevalence).
+ * @param index NULL or an integer vector with the one-based and
+ *        sorted nodes to include.
+ * @return a numeric vector with the prevalence at each time point
+ *         for level 1 and 2, else a numeric matrix (length(index) X
+ *         tlen) with the prevalence in each node.
+ */
+SEXP attribute_hidden
+SimInf_prevalence(
+    SEXP m,
+    SEXP cases,
+    SEXP population,
+    SEXP condition,
+    SEXP n_nodes,
+    SEXP level,
+    SEXP index)
+{
+    SEXP result;
+    const int m_sparse = Rf_isS4(m) && Rf_inherits(m, "dgCMatrix") ? 1 : 0;
+    const int Nn = Rf_asInteger(n_nodes);
+    const int c_level = Rf_asInteger(level);
+    const int n_id = Rf_isNull(index) ? Nn : Rf_length(index);
+    const int *p_cond = Rf_isNull(condition) ? NULL : LOGICAL(condition);
+    const int *p_index = Rf_isNull(index) ? NULL : INTEGER(index);
+    int Nc, tlen, *weight, *map;
+    double *p_result;
+
+    if (m_sparse) {
+        SEXP dim = R_do_slot(m, Rf_install("Dim"));
+        Nc = INTEGER(dim)[0] / Nn;
+        tlen = INTEGER(dim)[1];
+    } else {
+        Nc = Rf_nrows(m) / Nn;
+        tlen = Rf_ncols(m);
+    }
+
+    /* The number of times each compartment is counted in the cases
+     * and in the population. */
+    weight = (int *)R_alloc(2 * Nc, sizeof(int));
+    memset(weight, 0, 2 * Nc * sizeof(int));
+    for (int i = 0; i < Rf_length(cases); i++)
+        weight[INTEGER(cases)[i] - 1]++;
+    for (int i = 0; i < Rf_length(population); i++)
+        weight[Nc + INTEGER(population)[i] - 1]++;
+
+    /* Map the nodes to the zero-based position in the result, or -1
+     * if the node is not included. */
+    map = (int *)R_alloc(Nn, sizeof(int));
+    for (int i = 0; i < Nn; i++)
+        map[i] = p_index ? -1 : i;
+    if (p_index) {
+        for (int i = 0; i < n_id; i++)
+            map[p_index[i] - 1] = i;
+    }
+
+    if (c_level == 3)
+        PROTECT(result = Rf_allocMatrix(REALSXP, n_id, tlen));
+    else
+        PROTECT(result = Rf_allocVector(REALSXP, tlen));
+    p_result = REAL(result);
+
+    /* Use all available threads in parallel regions. */
+    SimInf_set_num_threads(-1);
+
+    if (m_sparse) {
+        const int *m_ir = INTEGER(R_do_slot(m, Rf_install("i")));
+        const int *m_jc = INTEGER(R_do_slot(m, Rf_install("p")));
+        const double *m_x = REAL(R_do_slot(m, Rf_install("x")));
+
+        #ifdef _OPENMP
+        #  pragma omp parallel for num_threads(SimInf_num_threads())
+        #endif
+        for (int t = 0; t < tlen; t++) {
+            double sum[2] = {0, 0}, c = 0, p = 0;
+            double *out = c_level == 3 ? &p_result[(size_t)t * n_id] : NULL;
+            int node = -1, na = 0;
+
+            /* The nodes without data in a column have no cases and
+             * no population. */
+            if (c_level == 3) {
+                for (int i = 0; i < n_id; i++)
+                    out[i] = R_NaN;
+            }
+
+            /* The rows in a column are sorted, so the compartments of
+             * a node are contiguous. */
+            for (int k = m_jc[t]; k <= m_jc[t + 1]; k++) {
+                const int row = k < m_jc[t + 1] ? m_ir[k] : -1;
+
+                if (row < 0 || row / Nc != node) {
+                    if (node >= 0 && map[node] >= 0) {
+                        const int cond = p_cond ?
+                            p_cond[(size_t)t * n_id + map[node]] : 1;
+
+                        if (cond == NA_LOGICAL) {
+                            na = 1;
+                            if (out)
+                                out[map[node]] = NA_REAL;
+                        } else if (cond) {
+                            SimInf_prevalence_node(
+                                c_level, c, p, sum,
+                                out ? &out[map[node]] : NULL);
+                        }
+                    }
+
+                    if (row < 0)
+                        break;
+                    node = row / Nc;
+                    c = p = 0;
+                }
+
+                c += weight[row % Nc] * m_x[k];
+                p += weight[Nc + row % Nc] * m_x[k];
+            }
+
+            if (c_level != 3)
+                p_result[t] = na ? NA_REAL : sum[0] / sum[1];
+        }
+    } else {
+        const int *p_m = INTEGER(m);
+
+        #ifdef _OPENMP
+        #  pragma omp parallel for num_threads(SimInf_num_threads())
+        #endif
+        for (int t = 0; t < tlen; t++) {
+            double sum[2] = {0, 0};
+            double *out = c_level == 3 ? &p_result[(size_t)t * n_id] : NULL;
+            int na = 0;
+
+            for (int i = 0; i < n_id; i++) {
+                const int node = p_index ? p_index[i] - 1 : i;
+                const int *u = &p_m[((size_t)t * Nn + node) * Nc];
+                const int cond = p_cond ? p_cond[(size_t)t * n_id + i] : 1;
+                double c = 0, p = 0;
+
+                if (cond == NA_LOGICAL) {
+                    na = 1;
+                    if (out)
+                        out[i] = NA_REAL;
+                    continue;
+                } else if (!cond) {
+                    if (out)
+                        out[i] = R_NaN;
+                    continue;
+                }
+
+                for (int j = 0; j < Nc; j++) {
+                    c += weight[j] * u[j];
+                    p += weight[Nc + j] * u[j];
+                }
+
+                SimInf_prevalence_node(c_level, c, p, sum,
+                                       out ? &out[i] : NULL);
+            }
+
+            if (c_level != 3)
+                p_result[t] = na ? NA_REAL : sum[0] / sum[1];
+        }
+    }
+
+    UNPROTECT(1);
+
+    return result;
+}
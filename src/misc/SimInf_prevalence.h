@@ -0,0 +1,59 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_SIMINF_PREVALENCE_H
+#define INCLUDE_SIMINF_PREVALENCE_H
+
+/**
+ * Accumulate the cases and the population in a node at one time
+ * point to the prevalence at the level. The prevalence at level 1
+ * and 2 is sum[0] / sum[1] when all nodes have been accumulated.
+ *
+ * @param level 1 (population), 2 (nodes) or 3 (within-node).
+ * @param cases the number of cases in the node.
+ * @param population the number of individuals in the node.
+ * @param sum the sums of the cases and the population at level 1
+ *        and 2.
+ * @param out the prevalence in the node at level 3.
+ */
+static inline void
+SimInf_prevalence_node(
+    int level,
+    double cases,
+    double population,
+    double *sum,
+    double *out)
+{
+    switch (level) {
+    case 1:
+        sum[0] += cases;
+        sum[1] += population;
+        break;
+    case 2:
+        sum[0] += cases > 0;
+        sum[1] += population > 0;
+        break;
+    default:
+        *out = cases / population;
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <R_ext/Visibility.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "SimInf_openmp.h"
+#include "SimInf_profile.h"
+
+/**
+ * The wall time in seconds.
+ *
+ * @return the time since an arbitrary point in the past.
+ */
+double attribute_hidden
+SimInf_profile_time(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/**
+ * Initialize the profile of a simulation.
+ *
+ * @param profile the profile to initialize.
+ * @param Nthread the number of threads in the parallel regions.
+ * @return 0 if Ok, else -1.
+ */
+int attribute_hidden
+SimInf_profile_create(
+    SimInf_profile *profile,
+    int Nthread)
+{
+    memset(profile, 0, sizeof(SimInf_profile));
+    profile->Nthread = Nthread > 0 ? Nthread : 1;
+    profile->busy = calloc((size_t)SIMINF_PROFILE_N * profile->Nthread,
+                           sizeof(double));
+    if (!profile->busy)
+        return -1; /* #nocov */
+    return 0;
+}
+
+/**
+ * Free allocated memory in the profile of a simulation.
+ *
+ * @param profile the profile to free.
+ */
+void attribute_hidden
+SimInf_profile_free(
+    SimInf_profile *profile)
+{
+    if (profile) {
+        free(profile->busy);
+        profile->busy = NULL;
+    }
+}
+
+/**
+ * Start to time a phase in the calling thread.
+ *
+ * @param profile the profile, or NULL if the simulation is not
+ *        profiled.
+ * @return the time, or 0 if profile is NULL.
+ */
+double attribute_hidden
+SimInf_profile_start(
+    const SimInf_profile *profile)
+{
+    return profile ? SimInf_profile_time() : 0.0;
+}
+
+/**
+ * Add the time since start to the time that the calling thread has
+ * spent in a phase during the current time step, and restart the
+ * timer such that the next phase can be timed from start.
+ *
+ * @param profile the profile, or NULL if the simulation is not
+ *        profiled.
+ * @param phase the phase to add the time to.
+ * @param start the time when the phase started. Set to the current
+ *        time.
+ */
+void attribute_hidden
+SimInf_profile_stop(
+    SimInf_profile *profile,
+    int phase,
+    double *start)
+{
+    int tid = 0;
+    double now;
+
+    if (!profile)
+        return;
+
+    #ifdef _OPENMP
+    tid = omp_get_thread_num();
+    #endif
+    if (tid >= profile->Nthread)
+        tid = profile->Nthread - 1; /* #nocov */
+
+    now = SimInf_profile_time();
+    profile->busy[tid * SIMINF_PROFILE_N + phase] += now - *start;
+    *start = now;
+}
+
+/**
+ * Accumulate the time of each phase in the time step that has
+ * finished. The time of a phase is the time of the slowest thread,
+ * since the threads wait for it at the barrier after the phase, and
+ * the imbalance is how much longer the slowest thread was busy than
+ * the mean of the threads. Must be called outside the parallel
+ * region.
+ *
+ * @param profile the profile, or NULL if the simulation is not
+ *        profiled.
+ */
+void attribute_hidden
+SimInf_profile_step(
+    SimInf_profile *profile)
+{
+    if (!profile)
+        return;
+
+    for (int phase = 0; phase < SIMINF_PROFILE_N; phase++) {
+        double max = 0.0, sum = 0.0;
+
+        for (int tid = 0; tid < profile->Nthread; tid++) {
+            const double busy = profile->busy[tid * SIMINF_PROFILE_N + phase];
+
+            if (busy > max)
+                max = busy;
+            sum += busy;
+            profile->busy[tid * SIMINF_PROFILE_N + phase] = 0.0;
+        }
+
+        profile->time[phase] += max;
+        profile->imbalance[phase] += max - sum / profile->Nthread;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_SIMINF_PROFILE_H
+#define INCLUDE_SIMINF_PROFILE_H
+
+/* The phases of a time step in the solvers that are timed. */
+enum {
+    SIMINF_PROFILE_TRANSITIONS,    /* (1) The continuous-time Markov
+                                    *     chain in each node. */
+    SIMINF_PROFILE_E1,             /* (2) The E1 events. */
+    SIMINF_PROFILE_E2,             /* (3) The E2 events. */
+    SIMINF_PROFILE_POST_TIME_STEP, /* (4) The post time step function
+                                    *     and the update of the
+                                    *     transition rates. */
+    SIMINF_PROFILE_STORE,          /* (6) Store the solution. */
+    SIMINF_PROFILE_N
+};
+
+/**
+ * Structure with the profile of a simulation.
+ */
+typedef struct SimInf_profile
+{
+    int Nthread;     /**< Number of threads in busy. */
+    double *busy;    /**< Matrix (SIMINF_PROFILE_N X Nthread) with
+                      *   the time that each thread has spent in each
+                      *   phase during the current time step. */
+    double time[SIMINF_PROFILE_N]; /**< The wall time of each phase,
+                                    *   i.e., the sum over the time
+                                    *   steps of the time of the
+                                    *   slowest thread. */
+    double imbalance[SIMINF_PROFILE_N]; /**< The sum over the time
+                                         *   steps of the time of the
+                                         *   slowest thread minus the
+                                         *   mean time of the
+                                         *   threads in each
+                                         *   phase. */
+    double total;       /**< The wall time of the simulation. */
+    double transitions; /**< Number of transitions that fired. */
+    double rates;       /**< Number of evaluated transition
+                         *   rates. */
+    double events_E1;   /**< Number of processed E1 events. */
+    double events_E2;   /**< Number of processed E2 events. */
+} SimInf_profile;
+
+double SimInf_profile_time(void);
+int SimInf_profile_create(SimInf_profile *profile, int Nthread);
+void SimInf_profile_free(SimInf_profile *profile);
+double SimInf_profile_start(const SimInf_profile *profile);
+void SimInf_profile_stop(SimInf_profile *profile, int phase, double *start);
+void SimInf_profile_step(SimInf_profile *profile);
+
+#endif
@@ -21,12 +21,20 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
 #include <Rdefines.h>
 #include <R_ext/Visibility.h>
 #include "SimInf.h"
 #include "SimInf_openmp.h"
+#include "SimInf_trajectory.h"
 #include "kvec.h"
 
+/* Identifies a file with a trajectory written by the solvers. The
+ * magic is followed by the number of nodes, compartments, continuous
+ * state variables and time points, and then the columns of U and V
+ * at each time point, in the native byte order. */
+static const char SimInf_trajectory_magic[8] = "SimInf1";
+
 typedef struct {
     R_xlen_t id;
     R_xlen_t time;
@@ -288,10 +296,14 @@ SimInf_sparse2df_real(
     }
 }
 
+/* Copy the dense matrix 'm' to integer vectors in the data.frame
+ * 'dst'. If 'm16' is non-NULL, the values are instead read from the
+ * compact matrix 'm16' with the same layout as 'm'. */
 static void
 SimInf_dense2df_int(
     SEXP dst,
     const int *m,
+    const uint16_t *m16,
     const int *m_i,
     R_xlen_t m_i_len,
     R_xlen_t m_stride,
@@ -305,7 +317,8 @@ SimInf_dense2df_int(
     for (R_xlen_t i = 0; i < m_i_len; i++) {
         SEXP vec;
         int *p_vec;
-        const int *p_m = m + m_i[i] - 1;
+        const int *p_m = m16 ? NULL : m + m_i[i] - 1;
+        const uint16_t *p_m16 = m16 ? m16 + m_i[i] - 1 : NULL;
 
         SET_VECTOR_ELT(dst, col++, vec = Rf_allocVector(INTSXP, nrow));
         p_vec = INTEGER(vec);
@@ -317,8 +330,9 @@ SimInf_dense2df_int(
             #endif
             for (R_xlen_t t = 0; t < tlen; t++) {
                 for (R_xlen_t j = 0; j < id_len; j++) {
-                    p_vec[t * id_len + j] =
-                        p_m[(t * id_n + p_id[j] - 1) * m_stride];
+                    const R_xlen_t k = (t * id_n + p_id[j] - 1) * m_stride;
+
+                    p_vec[t * id_len + j] = p_m16 ? p_m16[k] : p_m[k];
                 }
             }
         } else {
@@ -327,18 +341,23 @@ SimInf_dense2df_int(
             #endif
             for (R_xlen_t t = 0; t < tlen; t++) {
                 for (R_xlen_t j = 0; j < id_len; j++) {
-                    p_vec[t * id_len + j] =
-                        p_m[(t * id_n + j) * m_stride];
+                    const R_xlen_t k = (t * id_n + j) * m_stride;
+
+                    p_vec[t * id_len + j] = p_m16 ? p_m16[k] : p_m[k];
                 }
             }
         }
     }
 }
 
+/* Copy the dense matrix 'm' to numeric vectors in the data.frame
+ * 'dst'. If 'm32' is non-NULL, the values are instead read from the
+ * compact matrix 'm32' with the same layout as 'm'. */
 static void
 SimInf_dense2df_real(
     SEXP dst,
     const double *m,
+    const float *m32,
     const int *m_i,
     R_xlen_t m_i_len,
     R_xlen_t m_stride,
@@ -352,7 +371,8 @@ SimInf_dense2df_real(
     for (R_xlen_t i = 0; i < m_i_len; i++) {
         SEXP vec;
         double *p_vec;
-        const double *p_m = m + m_i[i] - 1;
+        const double *p_m = m32 ? NULL : m + m_i[i] - 1;
+        const float *p_m32 = m32 ? m32 + m_i[i] - 1 : NULL;
 
         SET_VECTOR_ELT(dst, col++, vec = Rf_allocVector(REALSXP, nrow));
         p_vec = REAL(vec);
@@ -364,8 +384,9 @@ SimInf_dense2df_real(
             #endif
             for (R_xlen_t t = 0; t < tlen; t++) {
                 for (R_xlen_t j = 0; j < id_len; j++) {
-                    p_vec[t * id_len + j] =
-                        p_m[(t * id_n + p_id[j] - 1) * m_stride];
+                    const R_xlen_t k = (t * id_n + p_id[j] - 1) * m_stride;
+
+                    p_vec[t * id_len + j] = p_m32 ? p_m32[k] : p_m[k];
                 }
             }
         } else {
@@ -374,8 +395,9 @@ SimInf_dense2df_real(
             #endif
             for (R_xlen_t t = 0; t < tlen; t++) {
                 for (R_xlen_t j = 0; j < id_len; j++) {
-                    p_vec[t * id_len + j] =
-                        p_m[(t * id_n + j) * m_stride];
+                    const R_xlen_t k = (t * id_n + j) * m_stride;
+
+                    p_vec[t * id_len + j] = p_m32 ? p_m32[k] : p_m[k];
                 }
             }
         }
@@ -584,8 +606,11 @@ SimInf_trajectory(
         SimInf_sparse2df_int(result, ri, dm, INTEGER(dm_i), dm_i_len,
                              dm_stride, nrow, tlen, id_len, 2);
     } else {
-        SimInf_dense2df_int(result, INTEGER(dm), INTEGER(dm_i), dm_i_len,
-                            dm_stride, nrow, tlen, id_len, c_id_n, 2, p_id);
+        const uint16_t *dm16 = SimInf_trajectory_compact_data(dm);
+
+        SimInf_dense2df_int(result, dm16 ? NULL : INTEGER(dm), dm16,
+                            INTEGER(dm_i), dm_i_len, dm_stride, nrow, tlen,
+                            id_len, c_id_n, 2, p_id);
     }
 
     /* Copy data from the continuous state matrix. */
@@ -593,8 +618,11 @@ SimInf_trajectory(
         SimInf_sparse2df_real(result, ri, cm, INTEGER(cm_i), cm_i_len,
                               cm_stride, nrow, tlen, id_len, 2 + dm_i_len);
     } else {
-        SimInf_dense2df_real(result, REAL(cm), INTEGER(cm_i), cm_i_len, cm_stride,
-                             nrow, tlen, id_len, c_id_n, 2 + dm_i_len, p_id);
+        const float *cm32 = SimInf_trajectory_compact_data(cm);
+
+        SimInf_dense2df_real(result, cm32 ? NULL : REAL(cm), cm32,
+                             INTEGER(cm_i), cm_i_len, cm_stride, nrow, tlen,
+                             id_len, c_id_n, 2 + dm_i_len, p_id);
     }
 
 cleanup:
@@ -611,3 +639,141 @@ cleanup:
 
     return result;
 }
+
+/**
+ * Write the header of a file with a trajectory.
+ *
+ * @param file the file to write the header to.
+ * @param Nn number of nodes.
+ * @param Nc number of compartments in each node.
+ * @param Nd number of continuous state variables in each node.
+ * @param tlen number of time points in the trajectory.
+ * @return 0 if Ok, else error code.
+ */
+int attribute_hidden
+SimInf_trajectory_file_header(
+    FILE *file,
+    int Nn,
+    int Nc,
+    int Nd,
+    int tlen)
+{
+    const int dim[4] = {Nn, Nc, Nd, tlen};
+
+    if (fwrite(SimInf_trajectory_magic, 1, 8, file) != 8 ||
+        fwrite(dim, sizeof(int), 4, file) != 4)
+        return SIMINF_ERR_WRITE_FILE;
+    return 0;
+}
+
+/**
+ * Read the discrete or continuous state of a trajectory from a file
+ * that was written by the solvers. Only one column of the trajectory
+ * is kept in memory at a time, and only the data for the nodes in
+ * 'id' is included in the result.
+ *
+ * @param file character vector of length one with the name of the
+ *        file.
+ * @param name "U" to read the discrete state or "V" to read the
+ *        continuous state.
+ * @param id NULL or an integer vector with (1-based) indices of the
+ *        nodes to include in the result.
+ * @return A matrix with the state of the nodes in 'id', or all nodes
+ *         if 'id' is NULL, at each time point.
+ */
+SEXP attribute_hidden
+SimInf_trajectory_file(
+    SEXP file,
+    SEXP name,
+    SEXP id)
+{
+    SEXP result;
+    FILE *fp;
+    char magic[8];
+    int dim[4], Nn, n, discrete, valid;
+    R_xlen_t id_len, skip_before, size;
+    char *buf = NULL;
+
+    if (!Rf_isString(file) || Rf_length(file) != 1 ||
+        STRING_ELT(file, 0) == NA_STRING)
+        Rf_error("'file' must be a character vector of length one.");
+    discrete = strcmp(CHAR(STRING_ELT(name, 0)), "U") == 0;
+
+    /* Read the header, and close the file before the result is
+     * allocated, since an error in R would leak the file. */
+    fp = fopen(R_ExpandFileName(CHAR(STRING_ELT(file, 0))), "rb");
+    if (!fp)
+        Rf_error("Unable to open the trajectory file.");
+    valid = fread(magic, 1, 8, fp) == 8 &&
+        memcmp(magic, SimInf_trajectory_magic, 8) == 0 &&
+        fread(dim, sizeof(int), 4, fp) == 4;
+    fclose(fp);
+    if (!valid)
+        Rf_error("Invalid trajectory file.");
+
+    Nn = dim[0];
+    n = discrete ? dim[1] : dim[2];
+    id_len = Rf_isNull(id) ? Nn : XLENGTH(id);
+    for (R_xlen_t i = 0; i < id_len && !Rf_isNull(id); i++) {
+        if (INTEGER(id)[i] < 1 || INTEGER(id)[i] > Nn)
+            Rf_error("'index' is out of bounds.");
+    }
+
+    /* Each column of V follows the corresponding column of U. The
+     * size is the number of bytes of the requested column, and the
+     * other column is skipped. */
+    size = discrete ? (R_xlen_t)Nn * n * sizeof(int) :
+        (R_xlen_t)Nn * n * sizeof(double);
+    skip_before = discrete ? 0 : (R_xlen_t)Nn * dim[1] * sizeof(int);
+
+    PROTECT(result = Rf_allocMatrix(discrete ? INTSXP : REALSXP,
+                                    id_len * n, dim[3]));
+
+    if (!Rf_isNull(id) && size > 0) {
+        buf = (char *)R_alloc(size, 1);
+    }
+
+    /* Open the file again after the allocations to read the data
+     * after the header. */
+    fp = fopen(R_ExpandFileName(CHAR(STRING_ELT(file, 0))), "rb");
+    if (!fp)
+        Rf_error("Unable to open the trajectory file.");
+    if (fseek(fp, 8 + sizeof(dim), SEEK_SET))
+        goto read_error;
+
+    for (int t = 0; t < dim[3]; t++) {
+        char *col = discrete ? (char *)&INTEGER(result)[(R_xlen_t)t * id_len * n] :
+            (char *)&REAL(result)[(R_xlen_t)t * id_len * n];
+        R_xlen_t skip_after = discrete ?
+            (R_xlen_t)Nn * dim[2] * sizeof(double) : 0;
+
+        if (skip_before && fseek(fp, skip_before, SEEK_CUR))
+            goto read_error;
+
+        if (size > 0 && fread(buf ? buf : col, 1, size, fp) != (size_t)size)
+            goto read_error;
+
+        if (skip_after && fseek(fp, skip_after, SEEK_CUR))
+            goto read_error;
+
+        if (buf) {
+            const size_t elem = discrete ? sizeof(int) : sizeof(double);
+
+            for (R_xlen_t i = 0; i < id_len; i++) {
+                memcpy(&col[i * n * elem],
+                       &buf[(R_xlen_t)(INTEGER(id)[i] - 1) * n * elem],
+                       n * elem);
+            }
+        }
+    }
+
+    fclose(fp);
+    UNPROTECT(1);
+
+    return result;
+
+read_error:
+    fclose(fp);
+    Rf_error("Invalid trajectory file.");
+    return R_NilValue; /* #nocov */
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 Pavol Bauer
+ * Copyright (C) 2017 -- 2019 Robin Eriksson
+ * Copyright (C) 2015 -- 2019 Stefan Engblom
+ * Copyright (C) 2015 -- 2022 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_SIMINF_TRAJECTORY_H
+#define INCLUDE_SIMINF_TRAJECTORY_H
+
+#include <stdio.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+int SimInf_trajectory_file_header(
+    FILE *file, int Nn, int Nc, int Nd, int tlen);
+
+void SimInf_trajectory_view_init(DllInfo *info);
+
+void SimInf_trajectory_compact_init(DllInfo *info);
+SEXP SimInf_trajectory_compact_alloc(SEXPTYPE type, int nrow, int ncol);
+void *SimInf_trajectory_compact_data(SEXP x);
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+#include <R_ext/Rdynload.h>
+#include <R_ext/Visibility.h>
+#include "SimInf_trajectory.h"
+
+/* A compact dense trajectory matrix 'U' or 'V', where the values of
+ * 'U' are stored as 16-bit unsigned integers and the values of 'V'
+ * as single precision floating point numbers. The first data of the
+ * matrix is a raw vector with the values, which is written by the
+ * solver. The second data is NULL until the data pointer of the
+ * matrix is requested, and then the values are expanded to an
+ * integer or numeric vector that is used for the remaining lifetime
+ * of the matrix. */
+static R_altrep_class_t SimInf_compact_integer_class;
+static R_altrep_class_t SimInf_compact_real_class;
+
+static R_xlen_t
+SimInf_compact_length(
+    SEXP x)
+{
+    const R_xlen_t size = TYPEOF(x) == INTSXP ?
+        sizeof(uint16_t) : sizeof(float);
+
+    return XLENGTH(R_altrep_data1(x)) / size;
+}
+
+static Rboolean
+SimInf_compact_inspect(
+    SEXP x,
+    int pre,
+    int deep,
+    int pvec,
+    void (*inspect_subtree)(SEXP, int, int, int))
+{
+    Rprintf("SimInf compact trajectory (%s, materialized = %s)\n",
+            TYPEOF(x) == INTSXP ? "uint16" : "float",
+            Rf_isNull(R_altrep_data2(x)) ? "FALSE" : "TRUE");
+    return TRUE;
+}
+
+static SEXP
+SimInf_compact_materialize(
+    SEXP x)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (Rf_isNull(data)) {
+        const R_xlen_t len = SimInf_compact_length(x);
+        const void *src = RAW(R_altrep_data1(x));
+
+        PROTECT(data = Rf_allocVector(TYPEOF(x), len));
+        if (TYPEOF(x) == INTSXP) {
+            int *dst = INTEGER(data);
+            for (R_xlen_t i = 0; i < len; i++)
+                dst[i] = ((const uint16_t *)src)[i];
+        } else {
+            double *dst = REAL(data);
+            for (R_xlen_t i = 0; i < len; i++)
+                dst[i] = ((const float *)src)[i];
+        }
+
+        R_set_altrep_data2(x, data);
+        UNPROTECT(1);
+    }
+
+    return data;
+}
+
+static void *
+SimInf_compact_dataptr(
+    SEXP x,
+    Rboolean writeable)
+{
+    SEXP data = SimInf_compact_materialize(x);
+
+    if (TYPEOF(data) == INTSXP)
+        return INTEGER(data);
+    return REAL(data);
+}
+
+static const void *
+SimInf_compact_dataptr_or_null(
+    SEXP x)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (Rf_isNull(data))
+        return NULL;
+    if (TYPEOF(data) == INTSXP)
+        return INTEGER(data);
+    return REAL(data);
+}
+
+/**
+ * Duplicate the matrix without expanding the values. The raw vector
+ * is shared, since it is not modified after the simulation.
+ */
+static SEXP
+SimInf_compact_duplicate(
+    SEXP x,
+    Rboolean deep)
+{
+    if (!Rf_isNull(R_altrep_data2(x)))
+        return NULL;
+    if (TYPEOF(x) == INTSXP)
+        return R_new_altrep(SimInf_compact_integer_class,
+                            R_altrep_data1(x), R_NilValue);
+    return R_new_altrep(SimInf_compact_real_class,
+                        R_altrep_data1(x), R_NilValue);
+}
+
+/**
+ * Serialize the matrix as the raw vector, e.g. when the model is
+ * saved, unless the values have been expanded and possibly
+ * modified.
+ */
+static SEXP
+SimInf_compact_serialized_state(
+    SEXP x)
+{
+    if (!Rf_isNull(R_altrep_data2(x)))
+        return NULL;
+    return R_altrep_data1(x);
+}
+
+static SEXP
+SimInf_compact_integer_unserialize(
+    SEXP class,
+    SEXP state)
+{
+    return R_new_altrep(SimInf_compact_integer_class, state, R_NilValue);
+}
+
+static SEXP
+SimInf_compact_real_unserialize(
+    SEXP class,
+    SEXP state)
+{
+    return R_new_altrep(SimInf_compact_real_class, state, R_NilValue);
+}
+
+static int
+SimInf_compact_integer_elt(
+    SEXP x,
+    R_xlen_t i)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (!Rf_isNull(data))
+        return INTEGER(data)[i];
+    return ((const uint16_t *)RAW(R_altrep_data1(x)))[i];
+}
+
+static R_xlen_t
+SimInf_compact_integer_get_region(
+    SEXP x,
+    R_xlen_t start,
+    R_xlen_t size,
+    int *buf)
+{
+    const R_xlen_t len = SimInf_compact_length(x);
+    const R_xlen_t n = len - start < size ? len - start : size;
+
+    for (R_xlen_t k = 0; k < n; k++)
+        buf[k] = SimInf_compact_integer_elt(x, start + k);
+
+    return n;
+}
+
+static double
+SimInf_compact_real_elt(
+    SEXP x,
+    R_xlen_t i)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (!Rf_isNull(data))
+        return REAL(data)[i];
+    return ((const float *)RAW(R_altrep_data1(x)))[i];
+}
+
+static R_xlen_t
+SimInf_compact_real_get_region(
+    SEXP x,
+    R_xlen_t start,
+    R_xlen_t size,
+    double *buf)
+{
+    const R_xlen_t len = SimInf_compact_length(x);
+    const R_xlen_t n = len - start < size ? len - start : size;
+
+    for (R_xlen_t k = 0; k < n; k++)
+        buf[k] = SimInf_compact_real_elt(x, start + k);
+
+    return n;
+}
+
+/**
+ * Register the classes of the compact trajectory.
+ *
+ * @param info information about the DLL.
+ */
+void
+SimInf_trajectory_compact_init(
+    DllInfo *info)
+{
+    SimInf_compact_integer_class =
+        R_make_altinteger_class("SimInf_compact_integer", "SimInf", info);
+    R_set_altrep_Length_method(SimInf_compact_integer_class,
+                               SimInf_compact_length);
+    R_set_altrep_Inspect_method(SimInf_compact_integer_class,
+                                SimInf_compact_inspect);
+    R_set_altrep_Duplicate_method(SimInf_compact_integer_class,
+                                  SimInf_compact_duplicate);
+    R_set_altrep_Serialized_state_method(SimInf_compact_integer_class,
+                                         SimInf_compact_serialized_state);
+    R_set_altrep_Unserialize_method(SimInf_compact_integer_class,
+                                    SimInf_compact_integer_unserialize);
+    R_set_altvec_Dataptr_method(SimInf_compact_integer_class,
+                                SimInf_compact_dataptr);
+    R_set_altvec_Dataptr_or_null_method(SimInf_compact_integer_class,
+                                        SimInf_compact_dataptr_or_null);
+    R_set_altinteger_Elt_method(SimInf_compact_integer_class,
+                                SimInf_compact_integer_elt);
+    R_set_altinteger_Get_region_method(SimInf_compact_integer_class,
+                                       SimInf_compact_integer_get_region);
+
+    SimInf_compact_real_class =
+        R_make_altreal_class("SimInf_compact_real", "SimInf", info);
+    R_set_altrep_Length_method(SimInf_compact_real_class,
+                               SimInf_compact_length);
+    R_set_altrep_Inspect_method(SimInf_compact_real_class,
+                                SimInf_compact_inspect);
+    R_set_altrep_Duplicate_method(SimInf_compact_real_class,
+                                  SimInf_compact_duplicate);
+    R_set_altrep_Serialized_state_method(SimInf_compact_real_class,
+                                         SimInf_compact_serialized_state);
+    R_set_altrep_Unserialize_method(SimInf_compact_real_class,
+                                    SimInf_compact_real_unserialize);
+    R_set_altvec_Dataptr_method(SimInf_compact_real_class,
+                                SimInf_compact_dataptr);
+    R_set_altvec_Dataptr_or_null_method(SimInf_compact_real_class,
+                                        SimInf_compact_dataptr_or_null);
+    R_set_altreal_Elt_method(SimInf_compact_real_class,
+                             SimInf_compact_real_elt);
+    R_set_altreal_Get_region_method(SimInf_compact_real_class,
+                                    SimInf_compact_real_get_region);
+}
+
+/**
+ * Allocate a compact dense trajectory matrix.
+ *
+ * @param type INTSXP for 'U' with the values stored as 16-bit
+ *        unsigned integers, or REALSXP for 'V' with the values stored
+ *        as single precision floating point numbers.
+ * @param nrow the number of rows.
+ * @param ncol the number of columns.
+ * @return an integer or numeric matrix, where the values are written
+ *         to SimInf_trajectory_compact_data().
+ */
+SEXP attribute_hidden
+SimInf_trajectory_compact_alloc(
+    SEXPTYPE type,
+    int nrow,
+    int ncol)
+{
+    const R_xlen_t size = type == INTSXP ? sizeof(uint16_t) : sizeof(float);
+    SEXP data, result, dim;
+
+    PROTECT(data = Rf_allocVector(RAWSXP, (R_xlen_t)nrow * ncol * size));
+    if (type == INTSXP)
+        PROTECT(result = R_new_altrep(SimInf_compact_integer_class, data, R_NilValue));
+    else
+        PROTECT(result = R_new_altrep(SimInf_compact_real_class, data, R_NilValue));
+
+    PROTECT(dim = Rf_allocVector(INTSXP, 2));
+    INTEGER(dim)[0] = nrow;
+    INTEGER(dim)[1] = ncol;
+    Rf_setAttrib(result, R_DimSymbol, dim);
+
+    UNPROTECT(3);
+
+    return result;
+}
+
+/**
+ * Get the compact values of a trajectory matrix.
+ *
+ * @param x the trajectory matrix.
+ * @return a pointer to the 16-bit unsigned integers or the single
+ *         precision floating point numbers if 'x' is a compact
+ *         trajectory matrix whose values have not been expanded,
+ *         else NULL.
+ */
+void attribute_hidden *
+SimInf_trajectory_compact_data(
+    SEXP x)
+{
+    if (!ALTREP(x) || !Rf_isNull(R_altrep_data2(x)))
+        return NULL;
+    if (!R_altrep_inherits(x, SimInf_compact_integer_class) &&
+        !R_altrep_inherits(x, SimInf_compact_real_class))
+        return NULL;
+    return RAW(R_altrep_data1(x));
+}
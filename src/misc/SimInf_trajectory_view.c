@@ -0,0 +1,313 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+#include <R_ext/Rdynload.h>
+#include <R_ext/Visibility.h>
+#include "SimInf_trajectory.h"
+
+/* A view of a subset of the rows in the dense trajectory matrix 'U'
+ * or 'V' that reads the values from the matrix instead of copying
+ * them. The first data of the view is a list with the matrix and the
+ * zero-based rows in the view. The second data is NULL until the
+ * data pointer of the view is requested, and then the rows are
+ * copied to a vector that is used for the remaining lifetime of the
+ * view. */
+static R_altrep_class_t SimInf_view_integer_class;
+static R_altrep_class_t SimInf_view_real_class;
+
+static SEXP
+SimInf_view_matrix(
+    SEXP x)
+{
+    return VECTOR_ELT(R_altrep_data1(x), 0);
+}
+
+static SEXP
+SimInf_view_rows(
+    SEXP x)
+{
+    return VECTOR_ELT(R_altrep_data1(x), 1);
+}
+
+static R_xlen_t
+SimInf_view_length(
+    SEXP x)
+{
+    return XLENGTH(SimInf_view_rows(x)) *
+        (R_xlen_t)Rf_ncols(SimInf_view_matrix(x));
+}
+
+/**
+ * Determine the index in the matrix of an element in the view.
+ */
+static R_xlen_t
+SimInf_view_index(
+    SEXP x,
+    R_xlen_t i)
+{
+    SEXP m = SimInf_view_matrix(x);
+    SEXP rows = SimInf_view_rows(x);
+    R_xlen_t nrow = XLENGTH(rows);
+
+    return INTEGER(rows)[i % nrow] + (i / nrow) * (R_xlen_t)Rf_nrows(m);
+}
+
+static Rboolean
+SimInf_view_inspect(
+    SEXP x,
+    int pre,
+    int deep,
+    int pvec,
+    void (*inspect_subtree)(SEXP, int, int, int))
+{
+    Rprintf("SimInf trajectory view (rows = %d, materialized = %s)\n",
+            (int)XLENGTH(SimInf_view_rows(x)),
+            Rf_isNull(R_altrep_data2(x)) ? "FALSE" : "TRUE");
+    return TRUE;
+}
+
+static SEXP
+SimInf_view_materialize(
+    SEXP x)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (Rf_isNull(data)) {
+        const R_xlen_t len = SimInf_view_length(x);
+        SEXP m = SimInf_view_matrix(x);
+
+        /* Read a compact trajectory without expanding it. */
+        const void *compact = SimInf_trajectory_compact_data(m);
+
+        PROTECT(data = Rf_allocVector(TYPEOF(m), len));
+        if (TYPEOF(m) == INTSXP && compact) {
+            int *dst = INTEGER(data);
+            const uint16_t *src = compact;
+            for (R_xlen_t i = 0; i < len; i++)
+                dst[i] = src[SimInf_view_index(x, i)];
+        } else if (TYPEOF(m) == INTSXP) {
+            int *dst = INTEGER(data);
+            const int *src = INTEGER(m);
+            for (R_xlen_t i = 0; i < len; i++)
+                dst[i] = src[SimInf_view_index(x, i)];
+        } else if (compact) {
+            double *dst = REAL(data);
+            const float *src = compact;
+            for (R_xlen_t i = 0; i < len; i++)
+                dst[i] = src[SimInf_view_index(x, i)];
+        } else {
+            double *dst = REAL(data);
+            const double *src = REAL(m);
+            for (R_xlen_t i = 0; i < len; i++)
+                dst[i] = src[SimInf_view_index(x, i)];
+        }
+
+        R_set_altrep_data2(x, data);
+        UNPROTECT(1);
+    }
+
+    return data;
+}
+
+static void *
+SimInf_view_dataptr(
+    SEXP x,
+    Rboolean writeable)
+{
+    SEXP data = SimInf_view_materialize(x);
+
+    if (TYPEOF(data) == INTSXP)
+        return INTEGER(data);
+    return REAL(data);
+}
+
+static const void *
+SimInf_view_dataptr_or_null(
+    SEXP x)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (Rf_isNull(data))
+        return NULL;
+    if (TYPEOF(data) == INTSXP)
+        return INTEGER(data);
+    return REAL(data);
+}
+
+static int
+SimInf_view_integer_elt(
+    SEXP x,
+    R_xlen_t i)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (!Rf_isNull(data))
+        return INTEGER(data)[i];
+    return INTEGER_ELT(SimInf_view_matrix(x), SimInf_view_index(x, i));
+}
+
+static R_xlen_t
+SimInf_view_integer_get_region(
+    SEXP x,
+    R_xlen_t start,
+    R_xlen_t size,
+    int *buf)
+{
+    const R_xlen_t len = SimInf_view_length(x);
+    const R_xlen_t n = len - start < size ? len - start : size;
+
+    for (R_xlen_t k = 0; k < n; k++)
+        buf[k] = SimInf_view_integer_elt(x, start + k);
+
+    return n;
+}
+
+static double
+SimInf_view_real_elt(
+    SEXP x,
+    R_xlen_t i)
+{
+    SEXP data = R_altrep_data2(x);
+
+    if (!Rf_isNull(data))
+        return REAL(data)[i];
+    return REAL_ELT(SimInf_view_matrix(x), SimInf_view_index(x, i));
+}
+
+static R_xlen_t
+SimInf_view_real_get_region(
+    SEXP x,
+    R_xlen_t start,
+    R_xlen_t size,
+    double *buf)
+{
+    const R_xlen_t len = SimInf_view_length(x);
+    const R_xlen_t n = len - start < size ? len - start : size;
+
+    for (R_xlen_t k = 0; k < n; k++)
+        buf[k] = SimInf_view_real_elt(x, start + k);
+
+    return n;
+}
+
+/**
+ * Register the classes of the trajectory view.
+ *
+ * @param info information about the DLL.
+ */
+void
+SimInf_trajectory_view_init(
+    DllInfo *info)
+{
+    SimInf_view_integer_class =
+        R_make_altinteger_class("SimInf_view_integer", "SimInf", info);
+    R_set_altrep_Length_method(SimInf_view_integer_class, SimInf_view_length);
+    R_set_altrep_Inspect_method(SimInf_view_integer_class, SimInf_view_inspect);
+    R_set_altvec_Dataptr_method(SimInf_view_integer_class, SimInf_view_dataptr);
+    R_set_altvec_Dataptr_or_null_method(SimInf_view_integer_class,
+                                        SimInf_view_dataptr_or_null);
+    R_set_altinteger_Elt_method(SimInf_view_integer_class,
+                                SimInf_view_integer_elt);
+    R_set_altinteger_Get_region_method(SimInf_view_integer_class,
+                                       SimInf_view_integer_get_region);
+
+    SimInf_view_real_class =
+        R_make_altreal_class("SimInf_view_real", "SimInf", info);
+    R_set_altrep_Length_method(SimInf_view_real_class, SimInf_view_length);
+    R_set_altrep_Inspect_method(SimInf_view_real_class, SimInf_view_inspect);
+    R_set_altvec_Dataptr_method(SimInf_view_real_class, SimInf_view_dataptr);
+    R_set_altvec_Dataptr_or_null_method(SimInf_view_real_class,
+                                        SimInf_view_dataptr_or_null);
+    R_set_altreal_Elt_method(SimInf_view_real_class, SimInf_view_real_elt);
+    R_set_altreal_Get_region_method(SimInf_view_real_class,
+                                    SimInf_view_real_get_region);
+}
+
+/**
+ * Create a view of rows in a dense trajectory matrix.
+ *
+ * @param m the integer or numeric matrix 'U' or 'V'.
+ * @param rows an integer vector with the one-based rows in the view.
+ * @return a matrix with the rows of 'm' that reads the values from
+ *         'm' without copying them.
+ */
+SEXP attribute_hidden
+SimInf_trajectory_view(
+    SEXP m,
+    SEXP rows)
+{
+    SEXP data, index, result, dim, dimnames;
+    R_xlen_t n;
+    int nrow;
+
+    if ((!Rf_isInteger(m) && !Rf_isReal(m)) || !Rf_isMatrix(m))
+        Rf_error("'m' must be an integer or numeric matrix.");
+    if (!Rf_isInteger(rows))
+        Rf_error("'rows' must be an integer vector.");
+    n = XLENGTH(rows);
+    nrow = Rf_nrows(m);
+
+    PROTECT(index = Rf_allocVector(INTSXP, n));
+    for (R_xlen_t i = 0; i < n; i++) {
+        const int row = INTEGER(rows)[i];
+        if (row == NA_INTEGER || row < 1 || row > nrow)
+            Rf_error("'rows' must be rows in 'm'.");
+        INTEGER(index)[i] = row - 1;
+    }
+
+    PROTECT(data = Rf_allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(data, 0, m);
+    SET_VECTOR_ELT(data, 1, index);
+
+    if (Rf_isInteger(m))
+        PROTECT(result = R_new_altrep(SimInf_view_integer_class, data, R_NilValue));
+    else
+        PROTECT(result = R_new_altrep(SimInf_view_real_class, data, R_NilValue));
+
+    PROTECT(dim = Rf_allocVector(INTSXP, 2));
+    INTEGER(dim)[0] = n;
+    INTEGER(dim)[1] = Rf_ncols(m);
+    Rf_setAttrib(result, R_DimSymbol, dim);
+
+    dimnames = Rf_getAttrib(m, R_DimNamesSymbol);
+    if (!Rf_isNull(dimnames)) {
+        SEXP rownames = VECTOR_ELT(dimnames, 0);
+        SEXP names = PROTECT(Rf_allocVector(VECSXP, 2));
+
+        if (!Rf_isNull(rownames)) {
+            SEXP selected = PROTECT(Rf_allocVector(STRSXP, n));
+            for (R_xlen_t i = 0; i < n; i++)
+                SET_STRING_ELT(selected, i,
+                               STRING_ELT(rownames, INTEGER(index)[i]));
+            SET_VECTOR_ELT(names, 0, selected);
+            UNPROTECT(1);
+        }
+        SET_VECTOR_ELT(names, 1, VECTOR_ELT(dimnames, 1));
+        Rf_setAttrib(result, R_DimNamesSymbol, names);
+        UNPROTECT(1);
+    }
+
+    UNPROTECT(4);
+
+    return result;
+}
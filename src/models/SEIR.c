@@ -147,6 +147,29 @@ SEIR_post_time_step(
     return 0;
 }
 
+/* Compute the transition rates in n consecutive nodes. */
+static void
+SEIR_rates_nodes(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    SimInf_rates_nodes(&SEIR_S_to_E, 0, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SEIR_E_to_I, 1, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SEIR_I_to_R, 2, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+}
+
 /**
  * Run simulation with the SEIR model
  *
@@ -161,5 +184,6 @@ SEIR_run(
 {
     TRFun tr_fun[] = {&SEIR_S_to_E, &SEIR_E_to_I, &SEIR_I_to_R};
 
-    return SimInf_run(model, solver, tr_fun, &SEIR_post_time_step);
+    return SimInf_run_rates(model, solver, tr_fun, NULL,
+                            &SEIR_rates_nodes, &SEIR_post_time_step);
 }
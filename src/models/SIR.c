@@ -122,6 +122,27 @@ SIR_post_time_step(
     return 0;
 }
 
+/* Compute the transition rates in n consecutive nodes. */
+static void
+SIR_rates_nodes(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    SimInf_rates_nodes(&SIR_S_to_I, 0, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SIR_I_to_R, 1, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+}
+
 /**
  * Run simulation with the SIR model
  *
@@ -136,5 +157,6 @@ SIR_run(
 {
     TRFun tr_fun[] = {&SIR_S_to_I, &SIR_I_to_R};
 
-    return SimInf_run(model, solver, tr_fun, &SIR_post_time_step);
+    return SimInf_run_rates(model, solver, tr_fun, NULL,
+                            &SIR_rates_nodes, &SIR_post_time_step);
 }
@@ -119,6 +119,27 @@ SIS_post_time_step(
     return 0;
 }
 
+/* Compute the transition rates in n consecutive nodes. */
+static void
+SIS_rates_nodes(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    SimInf_rates_nodes(&SIS_S_to_I, 0, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SIS_I_to_R, 1, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+}
+
 /**
  * Run simulation with the SIS model
  *
@@ -133,5 +154,6 @@ SIS_run(
 {
     TRFun tr_fun[] = {&SIS_S_to_I, &SIS_I_to_R};
 
-    return SimInf_run(model, solver, tr_fun, &SIS_post_time_step);
+    return SimInf_run_rates(model, solver, tr_fun, NULL,
+                            &SIS_rates_nodes, &SIS_post_time_step);
 }
@@ -136,6 +136,27 @@ SISe_post_time_step(
     return phi != v_new[PHI]; /* 1 if needs update */
 }
 
+/* Compute the transition rates in n consecutive nodes. */
+static void
+SISe_rates_nodes(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    SimInf_rates_nodes(&SISe_S_to_I, 0, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe_I_to_S, 1, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+}
+
 /**
  * Run simulation with the SISe model
  *
@@ -150,5 +171,6 @@ SISe_run(
 {
     TRFun tr_fun[] = {&SISe_S_to_I, &SISe_I_to_S};
 
-    return SimInf_run(model, solver, tr_fun, &SISe_post_time_step);
+    return SimInf_run_rates(model, solver, tr_fun, NULL,
+                            &SISe_rates_nodes, &SISe_post_time_step);
 }
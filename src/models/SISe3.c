@@ -235,6 +235,35 @@ SISe3_post_time_step(
     return phi != v_new[PHI]; /* 1 if needs update */
 }
 
+/* Compute the transition rates in n consecutive nodes. */
+static void
+SISe3_rates_nodes(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    SimInf_rates_nodes(&SISe3_S_1_to_I_1, 0, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_I_1_to_S_1, 1, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_S_2_to_I_2, 2, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_I_2_to_S_2, 3, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_S_3_to_I_3, 4, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_I_3_to_S_3, 5, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+}
+
 /**
  * Run simulation with the SISe3 model
  *
@@ -251,5 +280,6 @@ SISe3_run(
                       &SISe3_S_2_to_I_2, &SISe3_I_2_to_S_2,
                       &SISe3_S_3_to_I_3, &SISe3_I_3_to_S_3};
 
-    return SimInf_run(model, solver, tr_fun, &SISe3_post_time_step);
+    return SimInf_run_rates(model, solver, tr_fun, NULL,
+                            &SISe3_rates_nodes, &SISe3_post_time_step);
 }
@@ -23,6 +23,7 @@
 
 #include <R_ext/Visibility.h>
 #include "SimInf.h"
+#include "misc/SimInf_arg.h"
 
 /* Offset in integer compartment state vector */
 enum {S_1, I_1, S_2, I_2, S_3, I_3};
@@ -31,7 +32,7 @@ enum {S_1, I_1, S_2, I_2, S_3, I_3};
 enum {PHI};
 
 /* Offsets in node local data (ldata) to parameters in the model */
-enum {END_T1, END_T2, END_T3, END_T4, NEIGHBOR};
+enum {END_T1, END_T2, END_T3, END_T4};
 
 /* Offsets in global data (gdata) to parameters in the model */
 enum {UPSILON_1, UPSILON_2, UPSILON_3, GAMMA_1, GAMMA_2, GAMMA_3,
@@ -195,6 +196,7 @@ SISe3_sp_I_3_to_S_3(
  * @param v The current continuous state vector in the node.
  * @param ldata The local data vector for the node.
  * @param gdata The global data vector.
+ * @param neighbors The neighbors of each node.
  * @param node The node.
  * @param t The current time.
  * @return error code (<0), or 1 if node needs to update the
@@ -208,6 +210,7 @@ SISe3_sp_post_time_step(
     const double *v,
     const double *ldata,
     const double *gdata,
+    const SimInf_neighbors *neighbors,
     int node,
     double t)
 {
@@ -236,9 +239,14 @@ SISe3_sp_post_time_step(
 
     /* Local spread among proximal nodes. */
     if (N_i > 0.0) {
-        v_new[PHI] += gdata[ALPHA] * I_i / N_i +
-            SimInf_local_spread(&ldata[NEIGHBOR], phi_0, u_0,
-                                N_i, phi, Nc, gdata[COUPLING]);
+        double ls;
+        const int error = SimInf_local_spread_neighbors(
+            &ls, neighbors, node, phi_0, u_0, N_i, phi, Nc,
+            gdata[COUPLING]);
+
+        if (error)
+            return error;
+        v_new[PHI] += gdata[ALPHA] * I_i / N_i + ls;
     }
 
     if (!R_FINITE(v_new[PHI]))
@@ -248,6 +256,35 @@ SISe3_sp_post_time_step(
     return phi != v_new[PHI]; /* 1 if needs update */
 }
 
+/* Compute the transition rates in n consecutive nodes. */
+static void
+SISe3_sp_rates_nodes(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    SimInf_rates_nodes(&SISe3_sp_S_1_to_I_1, 0, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_sp_I_1_to_S_1, 1, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_sp_S_2_to_I_2, 2, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_sp_I_2_to_S_2, 3, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_sp_S_3_to_I_3, 4, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe3_sp_I_3_to_S_3, 5, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+}
+
 /**
  * Run simulation with the SISe3_sp model
  *
@@ -264,5 +301,14 @@ SISe3_sp_run(
                       &SISe3_sp_S_2_to_I_2, &SISe3_sp_I_2_to_S_2,
                       &SISe3_sp_S_3_to_I_3, &SISe3_sp_I_3_to_S_3};
 
-    return SimInf_run(model, solver, tr_fun, &SISe3_sp_post_time_step);
+    /* The post time step function reads the neighbors of a node from
+     * the 'neighbors' slot, which a model that was saved before the
+     * slot was added does not have. */
+    if (SimInf_arg_check_model(model))
+        Rf_error("Invalid model.");
+    if (SimInf_arg_check_neighbors(model))
+        Rf_error("Invalid 'neighbors' slot in the model.");
+
+    return SimInf_run_neighbors(model, solver, tr_fun, NULL,
+                                &SISe3_sp_rates_nodes, &SISe3_sp_post_time_step);
 }
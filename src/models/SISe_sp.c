@@ -23,6 +23,7 @@
 
 #include <R_ext/Visibility.h>
 #include "SimInf.h"
+#include "misc/SimInf_arg.h"
 
 /* Offset in integer compartment state vector */
 enum {S, I};
@@ -31,7 +32,7 @@ enum {S, I};
 enum {PHI};
 
 /* Offsets in node local data (ldata) to parameters in the model */
-enum {END_T1, END_T2, END_T3, END_T4, NEIGHBOR};
+enum {END_T1, END_T2, END_T3, END_T4};
 
 /* Offsets in global data (gdata) to parameters in the model */
 enum {UPSILON, GAMMA, ALPHA, BETA_T1, BETA_T2, BETA_T3, BETA_T4, COUPLING};
@@ -96,6 +97,7 @@ SISe_sp_I_to_S(
  * @param v The current continuous state vector in the node.
  * @param ldata The local data vector for the node.
  * @param gdata The global data vector.
+ * @param neighbors The neighbors of each node.
  * @param node The node.
  * @param t The current time.
  * @return error code (<0), or 1 if node needs to update the
@@ -109,6 +111,7 @@ SISe_sp_post_time_step(
     const double *v,
     const double *ldata,
     const double *gdata,
+    const SimInf_neighbors *neighbors,
     int node,
     double t)
 {
@@ -138,9 +141,14 @@ SISe_sp_post_time_step(
 
     /* Local spread among proximal nodes. */
     if (N_i > 0.0) {
-        v_new[PHI] += gdata[ALPHA] * I_i / N_i +
-            SimInf_local_spread(&ldata[NEIGHBOR], phi_0, u_0,
-                                N_i, phi, Nc, gdata[COUPLING]);
+        double ls;
+        const int error = SimInf_local_spread_neighbors(
+            &ls, neighbors, node, phi_0, u_0, N_i, phi, Nc,
+            gdata[COUPLING]);
+
+        if (error)
+            return error;
+        v_new[PHI] += gdata[ALPHA] * I_i / N_i + ls;
     }
 
     if (!R_FINITE(v_new[PHI]))
@@ -150,6 +158,27 @@ SISe_sp_post_time_step(
     return phi != v_new[PHI]; /* 1 if needs update */
 }
 
+/* Compute the transition rates in n consecutive nodes. */
+static void
+SISe_sp_rates_nodes(
+    double *rate,
+    int n,
+    int Nt,
+    const int *u,
+    int Nc,
+    const double *v,
+    int Nd,
+    const double *ldata,
+    int Nld,
+    const double *gdata,
+    double t)
+{
+    SimInf_rates_nodes(&SISe_sp_S_to_I, 0, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+    SimInf_rates_nodes(&SISe_sp_I_to_S, 1, rate, n, Nt,
+                       u, Nc, v, Nd, ldata, Nld, gdata, t);
+}
+
 /**
  * Run simulation with the SISe_sp model
  *
@@ -164,5 +193,14 @@ SISe_sp_run(
 {
     TRFun tr_fun[] = {&SISe_sp_S_to_I, &SISe_sp_I_to_S};
 
-    return SimInf_run(model, solver, tr_fun, &SISe_sp_post_time_step);
+    /* The post time step function reads the neighbors of a node from
+     * the 'neighbors' slot, which a model that was saved before the
+     * slot was added does not have. */
+    if (SimInf_arg_check_model(model))
+        Rf_error("Invalid model.");
+    if (SimInf_arg_check_neighbors(model))
+        Rf_error("Invalid 'neighbors' slot in the model.");
+
+    return SimInf_run_neighbors(model, solver, tr_fun, NULL,
+                                &SISe_sp_rates_nodes, &SISe_sp_post_time_step);
 }
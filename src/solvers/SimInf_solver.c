@@ -22,10 +22,13 @@
  */
 
 #include <R_ext/Visibility.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
+#include <gsl/gsl_sf_gamma.h>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -33,6 +36,257 @@
 
 #include "SimInf.h"
 #include "SimInf_solver.h"
+#include "misc/SimInf_openmp.h"
+#include "misc/SimInf_philox.h"
+#include "misc/SimInf_prevalence.h"
+
+/* The number of individuals to sample in an event from where a
+ * sampling method with a cost that does not grow linearly with the
+ * number of individuals is used. Below it, the individuals are
+ * sampled with the same methods and random numbers as before. */
+#define SIMINF_SAMPLE_LARGE 256
+
+/* Identifies a file with scheduled events written by
+ * 'write_events'. The magic is followed by blocks of events sorted
+ * by time, where each block contains the number of events in the
+ * block followed by the columns event, time, node, dest, n,
+ * proportion, select and shift, in the native byte order. */
+static const char SimInf_events_magic[8] = "SimInfE";
+
+/* Identifies the state of a solver in a checkpoint. The magic is
+ * followed by the name of the solver, the number of nodes,
+ * compartments, continuous state variables, transitions and
+ * partitions, if the Philox generator is used, and then the state
+ * of the model and the scheduled events, in the native byte
+ * order. */
+static const char SimInf_checkpoint_magic[8] = "SimInfC";
+
+/**
+ * Sample from the hypergeometric distribution
+ *
+ * The number of individuals of the first kind when sampling t
+ * individuals without replacement from n1 individuals of the first
+ * kind and n2 individuals of the second kind.
+ * gsl_ran_hypergeometric simulates the urn with one random number
+ * for each sampled individual. When both t and n1 + n2 - t are
+ * large, use inversion that starts at the mode of the distribution
+ * and alternates outwards, which needs one random number and an
+ * expected number of steps proportional to the standard deviation.
+ *
+ * @param rng Random number generator.
+ * @param n1 The number of individuals of the first kind.
+ * @param n2 The number of individuals of the second kind.
+ * @param t The number of individuals to sample. t <= n1 + n2.
+ * @return The number of sampled individuals of the first kind.
+ */
+static int
+SimInf_ran_hypergeometric(
+    gsl_rng *rng,
+    int n1,
+    int n2,
+    int t)
+{
+    int lo, hi, mode, k_lo, k_hi;
+    double p_lo, p_hi, rand;
+
+    if (t < SIMINF_SAMPLE_LARGE || n1 + n2 - t < SIMINF_SAMPLE_LARGE)
+        return gsl_ran_hypergeometric(rng, n1, n2, t);
+
+    /* The support and the mode of the distribution. */
+    lo = t > n2 ? t - n2 : 0;
+    hi = t < n1 ? t : n1;
+    mode = ((double)t + 1.0) * ((double)n1 + 1.0) / ((double)n1 + n2 + 2.0);
+    if (mode < lo)
+        mode = lo;
+    if (mode > hi)
+        mode = hi;
+
+    p_lo = p_hi = exp(gsl_sf_lnchoose(n1, mode) +
+                      gsl_sf_lnchoose(n2, t - mode) -
+                      gsl_sf_lnchoose(n1 + n2, t));
+
+    rand = gsl_rng_uniform(rng) - p_lo;
+    if (rand < 0.0)
+        return mode;
+
+    for (k_lo = k_hi = mode; k_lo > lo || k_hi < hi;) {
+        if (k_hi < hi) {
+            p_hi *= ((double)(n1 - k_hi) * (double)(t - k_hi)) /
+                ((double)(k_hi + 1) * (double)(n2 - t + k_hi + 1));
+            k_hi++;
+            rand -= p_hi;
+            if (rand < 0.0)
+                return k_hi;
+        }
+
+        if (k_lo > lo) {
+            p_lo *= ((double)k_lo * (double)(n2 - t + k_lo)) /
+                ((double)(n1 - k_lo + 1) * (double)(t - k_lo + 1));
+            k_lo--;
+            rand -= p_lo;
+            if (rand < 0.0)
+                return k_lo;
+        }
+    }
+
+    /* The probabilities sum to less than rand due to rounding. */
+    return mode;
+}
+
+/**
+ * Sample individuals with weights from a node
+ *
+ * Sample n individuals without replacement from Wallenius'
+ * noncentral hypergeometric distribution, i.e., the same
+ * distribution as in the biased urn in SimInf_sample_select(), where
+ * an individual is taken with a probability proportional to its
+ * weight. The urn is equivalent to giving each individual an
+ * exponentially distributed time with the weight as rate, and taking
+ * the n individuals with the smallest times. Instead of simulating
+ * the urn one individual at a time, the number of individuals in
+ * each compartment with a time in an interval is sampled from a
+ * binomial distribution. If the interval contains more individuals
+ * than needed, it is halved until the first n individuals are
+ * found. The expected number of intervals grows with the logarithm
+ * of n.
+ *
+ * @param irE Select matrix for events. irE[k] is the row of E[k].
+ * @param jcE Select matrix for events. Index to data of first
+ *        non-zero element in row k.
+ * @param prE Select matrix for events. Value of item E[i, j].
+ * @param Nc Number of compartments in each node.
+ * @param u The state vector in the node.
+ * @param select Column j in the Select matrix that determines the
+ *        states to sample from.
+ * @param n The number of individuals to sample. n > 0.
+ * @param individuals The result of the sampling is stored in the
+ *        first Nc elements of the individuals vector, which must be
+ *        zero on entry. The vector must have length 3 * Nc, where the
+ *        remaining elements are used as work space.
+ * @param rng Random number generator.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_sample_select_weighted(
+    const int *irE,
+    const int *jcE,
+    const double *prE,
+    int Nc,
+    const int *u,
+    int select,
+    int n,
+    int *individuals,
+    gsl_rng *rng)
+{
+    int *candidates = &individuals[Nc];
+    int *left = &individuals[2 * Nc];
+
+    while (n > 0) {
+        double tau, rate = 0.0;
+        int i, k, Ncandidates = 0, Nremaining = 0;
+
+        /* The remaining individuals have exponentially distributed
+         * times after the individuals that have been taken. Use the
+         * time where the expected number of individuals is n, which
+         * is found with Newton's method from below since the
+         * expected number is a concave function of the time. */
+        for (i = jcE[select]; i < jcE[select + 1]; i++) {
+            if (prE[i] > 0.0) {
+                const int r = u[irE[i]] - individuals[irE[i]];
+
+                rate += prE[i] * r;
+                Nremaining += r;
+            }
+        }
+
+        if (n > Nremaining)
+            return SIMINF_ERR_SAMPLE_SELECT;
+
+        if (n == Nremaining) {
+            /* Take all individuals with a positive weight. */
+            for (i = jcE[select]; i < jcE[select + 1]; i++) {
+                if (prE[i] > 0.0)
+                    individuals[irE[i]] = u[irE[i]];
+            }
+            return 0;
+        }
+
+        tau = n / rate;
+        for (k = 0; k < 5; k++) {
+            double f = -n, df = 0.0;
+
+            for (i = jcE[select]; i < jcE[select + 1]; i++) {
+                if (prE[i] > 0.0) {
+                    const int r = u[irE[i]] - individuals[irE[i]];
+
+                    f -= r * expm1(-prE[i] * tau);
+                    df += r * prE[i] * exp(-prE[i] * tau);
+                }
+            }
+
+            if (f >= 0.0 || df <= 0.0)
+                break;
+            tau -= f / df;
+        }
+
+        /* Sample the individuals with a time less than tau. */
+        for (i = jcE[select]; i < jcE[select + 1]; i++) {
+            const int r = u[irE[i]] - individuals[irE[i]];
+
+            candidates[irE[i]] = 0;
+            if (prE[i] > 0.0 && r > 0) {
+                candidates[irE[i]] = gsl_ran_binomial(
+                    rng, -expm1(-prE[i] * tau), r);
+            }
+            Ncandidates += candidates[irE[i]];
+        }
+
+        /* Halve the interval until the individuals in the first half
+         * are at most the number of individuals that are needed. The
+         * probability that an individual with a time in the interval
+         * has a time in the first half is 1 / (1 + exp(-w * h)),
+         * where w is the weight and h the length of the half. */
+        while (Ncandidates > n) {
+            int Nleft = 0;
+
+            tau *= 0.5;
+            for (i = jcE[select]; i < jcE[select + 1]; i++) {
+                left[irE[i]] = 0;
+                if (candidates[irE[i]] > 0) {
+                    left[irE[i]] = gsl_ran_binomial(
+                        rng, 1.0 / (1.0 + exp(-prE[i] * tau)),
+                        candidates[irE[i]]);
+                }
+                Nleft += left[irE[i]];
+            }
+
+            if (Nleft > n) {
+                /* Continue with the first half. */
+                for (i = jcE[select]; i < jcE[select + 1]; i++)
+                    candidates[irE[i]] = left[irE[i]];
+                Ncandidates = Nleft;
+            } else {
+                /* Take the individuals in the first half and
+                 * continue with the second half. */
+                for (i = jcE[select]; i < jcE[select + 1]; i++) {
+                    individuals[irE[i]] += left[irE[i]];
+                    candidates[irE[i]] -= left[irE[i]];
+                }
+                n -= Nleft;
+                Ncandidates -= Nleft;
+                if (n == 0)
+                    return 0;
+            }
+        }
+
+        /* Take the candidates. */
+        for (i = jcE[select]; i < jcE[select + 1]; i++)
+            individuals[irE[i]] += candidates[irE[i]];
+        n -= Ncandidates;
+    }
+
+    return 0;
+}
 
 /**
  * Sample individuals from a node
@@ -43,6 +297,8 @@
  * @param jcE Select matrix for events. Index to data of first
  *        non-zero element in row k.
  * @param prE Select matrix for events. Value of item E[i, j].
+ * @param equal_prE equal_prE[j] is non-zero if all weights in column
+ *        j of E are equal.
  * @param Nc Number of compartments in each node.
  * @param u The state vector with number of individuals in each
  *        compartment at each node. The current state in each node is
@@ -66,6 +322,7 @@ SimInf_sample_select(
     const int *irE,
     const int *jcE,
     const double *prE,
+    const int *equal_prE,
     int Nc,
     const int *u,
     int node,
@@ -130,14 +387,11 @@ SimInf_sample_select(
         return 0;
     }
 
-    /* Determine if all weights are identical in the column in E and
-     * the individuals can be sampled from a hypergeometric
-     * distribution or if they need to be sampled from a biased
-     * urn. */
-    for (i = jcE[select] + 1; i < jcE[select + 1]; i++) {
-        if (prE[i] != prE[i - 1])
-            goto sample_biased_urn;
-    }
+    /* If all weights are identical in the column in E, the
+     * individuals can be sampled from a hypergeometric distribution,
+     * else they need to be sampled from a biased urn. */
+    if (!equal_prE[select])
+        goto sample_biased_urn;
 
     /* All weights are equal. Sample from the hypergeometric
      * distribution. For a multivariate hypergeometric distribution,
@@ -147,7 +401,7 @@ SimInf_sample_select(
         if (n == 0)
             break;
 
-        individuals[irE[i]] = gsl_ran_hypergeometric(
+        individuals[irE[i]] = SimInf_ran_hypergeometric(
             rng, u[node * Nc + irE[i]],
             Nindividuals - u[node * Nc + irE[i]], n);
 
@@ -172,6 +426,13 @@ sample_biased_urn:
      * Distributions'. Communications In statictics, Simulation and
      * Computation, 2008, vol. 37, no. 2, pp. 241-257. */
 
+    /* Sample many individuals without simulating the urn one
+     * individual at a time. */
+    if (n >= SIMINF_SAMPLE_LARGE) {
+        return SimInf_sample_select_weighted(
+            irE, jcE, prE, Nc, &u[node * Nc], select, n, individuals, rng);
+    }
+
     /* Repeat the sampling until all n individuals have been taken. */
     while (n > 0) {
         double rand, cum = 0;
@@ -220,6 +481,7 @@ sample_biased_urn:
  * @param jcE Select matrix for events. Index to data of first
  *        non-zero element in row k.
  * @param prE Select matrix for events. Value of item E[i, j].
+ * @param cum_prE Cumulative sum of the weights in each column of E.
  * @param Nc Number of compartments in each node.
  * @param u The state vector with number of individuals in each
  *        compartment at each node. The current state in each node is
@@ -243,6 +505,7 @@ SimInf_sample_select_enter(
     const int *irE,
     const int *jcE,
     const double *prE,
+    const double *cum_prE,
     int Nc,
     const int *u,
     int node,
@@ -253,7 +516,7 @@ SimInf_sample_select_enter(
     gsl_rng *rng)
 {
     int i, Nstates = jcE[select + 1] - jcE[select];
-    double w_cum = 0;
+    double w_cum;
 
     /* Clear vector with number of individuals to enter */
     memset(individuals, 0, Nc * sizeof(int));
@@ -287,23 +550,31 @@ SimInf_sample_select_enter(
         return 0;
     }
 
-    /* Determine the total weight. */
-    for (i = jcE[select]; i < jcE[select + 1]; i++)
-        w_cum += prE[i];
+    /* The total weight. */
+    w_cum = cum_prE[jcE[select + 1] - 1];
 
     /* Repeat the sampling until all n individuals have been entered. */
     while (n > 0) {
-        double cum, rand = gsl_rng_uniform_pos(rng) * w_cum;
+        const double rand = gsl_rng_uniform_pos(rng) * w_cum;
+        int hi = jcE[select + 1] - 1;
 
         /* Use inversion to determine the compartment that was
-         * sampled. */
-        for (i = jcE[select], cum = prE[i];
-             i < jcE[select + 1] && rand > cum;
-             i++, cum += prE[i]);
+         * sampled, i.e., the first compartment where the cumulative
+         * weight is greater than or equal to rand. The cumulative
+         * weights are non-decreasing, so use a binary search. If
+         * rand is greater than every cumulative weight, due to
+         * rounding, the last compartment is selected. */
+        i = jcE[select];
+        while (i < hi) {
+            const int mid = i + (hi - i) / 2;
+
+            if (rand > cum_prE[mid])
+                i = mid + 1;
+            else
+                hi = mid;
+        }
 
         /* Elaborate floating point fix: */
-        if (i >= jcE[select + 1])
-            i = jcE[select + 1] - 1;
         if (prE[i] == 0.0) {
             /* Go backwards and try to find the first nonzero
              * weight. */
@@ -322,6 +593,44 @@ SimInf_sample_select_enter(
     return 0;
 }
 
+/**
+ * Get the first node in a partition. The nodes are split into
+ * Nthread partitions of consecutive nodes, where the sizes differ by
+ * at most one node, so that the leftover nodes are spread evenly
+ * over the partitions.
+ *
+ * @param i the partition, or Nthread to get the number of nodes.
+ * @param Nn total number of nodes.
+ * @param Nthread number of partitions.
+ * @return the index of the first node in partition i.
+ */
+static int
+SimInf_partition_first(
+    int i,
+    int Nn,
+    int Nthread)
+{
+    return (int)((int64_t)i * Nn / Nthread);
+}
+
+/**
+ * Get the partition of a node, the inverse of
+ * SimInf_partition_first.
+ *
+ * @param node the index of the node.
+ * @param Nn total number of nodes.
+ * @param Nthread number of partitions.
+ * @return the partition with the node.
+ */
+static int
+SimInf_partition_of_node(
+    int node,
+    int Nn,
+    int Nthread)
+{
+    return (int)((((int64_t)node + 1) * Nthread - 1) / Nn);
+}
+
 /**
  * Split scheduled events to E1 and E2 events by number of threads
  * used during simulation
@@ -348,6 +657,9 @@ SimInf_sample_select_enter(
  *        transfer event.
  * @param Nn Total number of nodes.
  * @param Nthread Number of threads to use during simulation.
+ * @param E2_parallel If non-zero, the E2 events are assigned to the
+ *        vector of E2 events in thread id 0 to be processed in
+ *        parallel.
  */
 static void
 SimInf_split_events(
@@ -362,27 +674,189 @@ SimInf_split_events(
     const int *select,
     const int *shift,
     int Nn,
-    int Nthread)
+    int Nthread,
+    int E2_parallel)
 {
     int i;
-    const int chunk_size = Nn / Nthread;
 
     for (i = 0; i < len; i++) {
         const SimInf_scheduled_event e = {event[i], time[i], node[i] - 1,
                                           dest[i] - 1, n[i], proportion[i],
                                           select[i] - 1, shift[i] - 1};
 
-        if (event[i] == EXTERNAL_TRANSFER_EVENT) {
+        if (event[i] == EXTERNAL_TRANSFER_EVENT && E2_parallel) {
+            kv_push(SimInf_scheduled_event, out[0].E2_events, e);
+        } else if (event[i] == EXTERNAL_TRANSFER_EVENT) {
             kv_push(SimInf_scheduled_event, out[0].events, e);
         } else {
-            int j = (node[i] - 1) / chunk_size;
-            if (j >= Nthread)
-                j = Nthread - 1;
+            const int j = SimInf_partition_of_node(node[i] - 1, Nn, Nthread);
             kv_push(SimInf_scheduled_event, out[j].events, e);
         }
     }
 }
 
+/**
+ * Split the E2 events into conflict-free batches
+ *
+ * The E2 events for each time are reordered into batches that can
+ * be processed in parallel, but give the same result as processing
+ * the events one by one in the original order. An event samples
+ * individuals from its source node and adds them to its destination
+ * node. Since adding individuals to a node commutes with other
+ * additions, an event must only be placed in a later batch than the
+ * previous events that had the source node as source or destination,
+ * and the previous events that had the destination node as source.
+ *
+ * @param e The scheduled events with the E2 events to split. The
+ *        E2 events must be sorted by time.
+ * @param Nn Total number of nodes.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_batch_E2_events(
+    SimInf_scheduled_events *e,
+    int Nn)
+{
+    int error = SIMINF_ERR_ALLOC_MEMORY_BUFFER;
+    const size_t len = kv_size(e->E2_events);
+    SimInf_scheduled_event *tmp = NULL;
+    int *batch = NULL, *last_src = NULL, *last_dest = NULL;
+    size_t *count = NULL;
+    size_t first = 0;
+
+    if (len == 0)
+        return 0;
+
+    tmp = malloc(len * sizeof(SimInf_scheduled_event));
+    batch = malloc(len * sizeof(int));
+    count = calloc(len + 1, sizeof(size_t));
+    last_src = calloc(Nn, sizeof(int));
+    last_dest = calloc(Nn, sizeof(int));
+    if (!tmp || !batch || !count || !last_src || !last_dest)
+        goto cleanup; /* #nocov */
+
+    memcpy(tmp, e->E2_events.a, len * sizeof(SimInf_scheduled_event));
+
+    while (first < len) {
+        size_t end, k, n_batches = 0, start = first;
+
+        /* Determine the range of events with the same time. */
+        for (end = first + 1;
+             end < len && tmp[end].time == tmp[first].time;
+             end++);
+
+        /* Determine the batch (one-based) for each event. Events with
+         * a node out of bounds are placed in the first batch and
+         * raise an error when processed. */
+        for (k = first; k < end; k++) {
+            const int node = tmp[k].node, dest = tmp[k].dest;
+            int b = 1;
+
+            if (node >= 0 && node < Nn && dest >= 0 && dest < Nn) {
+                if (last_src[node] >= b)
+                    b = last_src[node] + 1;
+                if (last_dest[node] >= b)
+                    b = last_dest[node] + 1;
+                if (last_src[dest] >= b)
+                    b = last_src[dest] + 1;
+                last_src[node] = b;
+                if (last_dest[dest] < b)
+                    last_dest[dest] = b;
+            }
+
+            batch[k] = b;
+            count[b]++;
+            if ((size_t)b > n_batches)
+                n_batches = b;
+        }
+
+        /* Counting sort of the events by batch. Save the index to
+         * the first event in each batch. */
+        for (k = 1; k <= n_batches; k++) {
+            const size_t n = count[k];
+            kv_push(size_t, e->E2_batch, start);
+            count[k] = start;
+            start += n;
+        }
+        for (k = first; k < end; k++)
+            kv_A(e->E2_events, count[batch[k]]++) = tmp[k];
+
+        /* Reset the counts and the batch information for the nodes
+         * before continuing with the events at the next time. */
+        for (k = 1; k <= n_batches; k++)
+            count[k] = 0;
+        for (k = first; k < end; k++) {
+            if (tmp[k].node >= 0 && tmp[k].node < Nn)
+                last_src[tmp[k].node] = last_dest[tmp[k].node] = 0;
+            if (tmp[k].dest >= 0 && tmp[k].dest < Nn)
+                last_src[tmp[k].dest] = last_dest[tmp[k].dest] = 0;
+        }
+
+        first = end;
+    }
+
+    /* Terminate the batches with the total number of events. */
+    kv_push(size_t, e->E2_batch, len);
+    error = 0;
+
+cleanup:
+    free(tmp);
+    free(batch);
+    free(count);
+    free(last_src);
+    free(last_dest);
+
+    return error;
+}
+
+/**
+ * Compute the data for each column in the select matrix that is used
+ * when sampling individuals in the scheduled events: if all weights
+ * in the column are equal, and the cumulative sum of the weights.
+ *
+ * @param events the scheduled events of each thread.
+ * @param args structure with data for the solver.
+ * @return 0 or SIMINF_ERR_ALLOC_MEMORY_BUFFER
+ */
+static int
+SimInf_select_matrix_data(
+    SimInf_scheduled_events *events,
+    SimInf_solver_args *args)
+{
+    int i, j;
+    int *equal_prE = NULL;
+    double *cum_prE = NULL;
+
+    /* Allocate one extra element, since the select matrix can be
+     * empty. */
+    equal_prE = malloc((args->Nselect + 1) * sizeof(int));
+    cum_prE = malloc((args->jcE[args->Nselect] + 1) * sizeof(double));
+    if (!equal_prE || !cum_prE) {
+        free(equal_prE); /* #nocov */
+        free(cum_prE);   /* #nocov */
+        return SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
+    }
+
+    for (j = 0; j < args->Nselect; j++) {
+        double cum = 0.0;
+
+        equal_prE[j] = 1;
+        for (i = args->jcE[j]; i < args->jcE[j + 1]; i++) {
+            if (i > args->jcE[j] && args->prE[i] != args->prE[i - 1])
+                equal_prE[j] = 0;
+            cum += args->prE[i];
+            cum_prE[i] = cum;
+        }
+    }
+
+    for (i = 0; i < args->Nthread; i++) {
+        events[i].equal_prE = equal_prE;
+        events[i].cum_prE = cum_prE;
+    }
+
+    return 0;
+}
+
 /**
  * Create and initialize data to process scheduled events. The
  * generated data structure must be freed by the user.
@@ -418,7 +892,9 @@ SimInf_scheduled_events_create(
         /* Scheduled events */
 	kv_init(events[i].events);
 
-        events[i].individuals = calloc(args->Nc, sizeof(int));
+        /* The vector to store the result of the sampling, followed
+         * by work space for the sampling. */
+        events[i].individuals = calloc(3 * args->Nc, sizeof(int));
         if (!events[i].individuals)
             goto on_error; /* #nocov */
 
@@ -426,14 +902,57 @@ SimInf_scheduled_events_create(
         events[i].rng = gsl_rng_alloc(gsl_rng_mt19937);
         if (!events[i].rng)
             goto on_error; /* #nocov */
-        gsl_rng_set(events[i].rng, gsl_rng_uniform_int(rng, gsl_rng_max(rng)));
+
+        /* External transfer events processed in parallel. The
+         * random number generator is reseeded before each E2 event,
+         * hence, use a generator that is cheap to seed. */
+        events[i].E2_parallel = args->E2_parallel;
+        kv_init(events[i].E2_events);
+        kv_init(events[i].E2_batch);
+        if (args->E2_parallel) {
+            events[i].E2_rng = gsl_rng_alloc(gsl_rng_taus2);
+            if (!events[i].E2_rng)
+                goto on_error; /* #nocov */
+        }
+    }
+
+    /* Counter-based random number stream for each node. The vector
+     * is NULL terminated to facilitate freeing it. */
+    if (args->philox) {
+        gsl_rng **node_rng = calloc(args->Nn + 1, sizeof(gsl_rng*));
+        if (!node_rng)
+            goto on_error; /* #nocov */
+        events[0].node_rng = node_rng;
+
+        for (i = 0; i < args->Nn; i++) {
+            node_rng[i] = gsl_rng_alloc(SimInf_rng_philox);
+            if (!node_rng[i])
+                goto on_error; /* #nocov */
+        }
+
+        for (i = 1; i < args->Nthread; i++)
+            events[i].node_rng = node_rng;
     }
 
+    if (SimInf_select_matrix_data(events, args))
+        goto on_error; /* #nocov */
+
+    /* The events are read from the file during the simulation. */
+    events[0].file = args->events_file;
+    events[0].Nn = args->Nn;
+    events[0].Nselect = args->Nselect;
+    events[0].Nshift = args->Nshift;
+
     /* Split scheduled events into E1 and E2 events. */
     SimInf_split_events(
         events, args->len, args->event, args->time, args->node,
         args->dest, args->n, args->proportion, args->select,
-        args->shift, args->Nn, args->Nthread);
+        args->shift, args->Nn, args->Nthread, args->E2_parallel);
+
+    if (args->E2_parallel && SimInf_batch_E2_events(&events[0], args->Nn))
+        goto on_error; /* #nocov */
+
+    SimInf_scheduled_events_reset(events, args, rng);
 
     *out = events;
     return 0;
@@ -443,6 +962,51 @@ on_error:                                  /* #nocov */
     return SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
 }
 
+/**
+ * Reset the data to process scheduled events to simulate a new
+ * trajectory. The random number generators are seeded from rng and
+ * the seed in args.
+ *
+ * @param events the data structure to reset.
+ * @param args structure with data for the solver.
+ * @param rng random number generator
+ */
+void attribute_hidden
+SimInf_scheduled_events_reset(
+    SimInf_scheduled_events *events,
+    SimInf_solver_args *args,
+    gsl_rng *rng)
+{
+    int i;
+
+    for (i = 0; i < args->Nthread; i++) {
+        events[i].events_index = 0;
+        events[i].E2_batch_index = 0;
+        events[i].E2_offset = 0;
+        events[i].seed = args->seed;
+        gsl_rng_set(events[i].rng, gsl_rng_uniform_int(rng, gsl_rng_max(rng)));
+    }
+
+    /* Discard the events that have been read from the file and
+     * start from the first block of events. An error to reposition
+     * the file is raised when the next block is read. */
+    if (events[0].file) {
+        for (i = 0; i < args->Nthread; i++)
+            kv_size(events[i].events) = 0;
+        kv_size(events[0].E2_events) = 0;
+        kv_size(events[0].E2_batch) = 0;
+        events[0].file_time = INT_MIN;
+        events[0].file_eof = 0;
+        if (fseek(events[0].file, sizeof(SimInf_events_magic), SEEK_SET))
+            events[0].file_eof = -1; /* #nocov */
+    }
+
+    if (events[0].node_rng) {
+        for (i = 0; i < args->Nn; i++)
+            SimInf_philox_set(events[0].node_rng[i], args->seed, i);
+    }
+}
+
 /**
  * Free allocated memory to process events
  *
@@ -465,74 +1029,461 @@ SimInf_scheduled_events_free(
                 e->individuals = NULL;
                 gsl_rng_free(e->rng);
                 e->rng = NULL;
+                kv_destroy(e->E2_events);
+                kv_destroy(e->E2_batch);
+                gsl_rng_free(e->E2_rng);
+                e->E2_rng = NULL;
             }
         }
 
+        if (events[0].node_rng) {
+            for (i = 0; events[0].node_rng[i]; i++)
+                gsl_rng_free(events[0].node_rng[i]);
+            free(events[0].node_rng);
+        }
+
+        free(events[0].equal_prE);
+        free(events[0].cum_prE);
+
         free(events);
     }
 }
 
 /**
- * Print event information to facilitate debugging.
+ * Check the header of a file with scheduled events.
  *
- * @param e The SimInf_scheduled_events object to print.
- * @param irE Select matrix for events. irE[k] is the row of E[k].
- * @param jcE Select matrix for events. Index to data of first
- *        non-zero element in row k.
- * @param Nc Number of compartments in each node.
- * @param u The state vector with number of individuals in each
- *        compartment at each node. The current state in each node is
- *        offset by node * Nc.
- * @param node The node in u.
+ * @param file the file with events. The position of the file is
+ *        after the header when the function returns.
+ * @return 0 if Ok, else SIMINF_ERR_READ_EVENTS.
  */
-static void
-SimInf_print_event(
-    const SimInf_scheduled_event *e,
-    const int *irE,
-    const int *jcE,
-    const int Nc,
-    const int *u,
-    const int node,
-    const int dest)
+int attribute_hidden
+SimInf_events_file_header(
+    FILE *file)
 {
-    #ifdef _OPENMP
-    #  pragma omp critical
-    #endif
-    {
-        int i;
+    char magic[sizeof(SimInf_events_magic)];
 
-        if (irE && jcE && u) {
-            int Nindividuals = 0;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, SimInf_events_magic, sizeof(magic)) != 0)
+        return SIMINF_ERR_READ_EVENTS;
+    return 0;
+}
 
-            /* Count total number of individuals */
-            for (i = jcE[e->select]; i < jcE[e->select + 1]; i++)
-                Nindividuals += u[node * Nc + irE[i]];
+/**
+ * Read one block of events from the file and split them among the
+ * threads.
+ *
+ * The events in the block are checked before they are added, since
+ * the events in the file are not validated by the model.
+ *
+ * @param events the scheduled events of each thread.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_read_events_block(
+    SimInf_scheduled_events *events)
+{
+    SimInf_scheduled_events *e = &events[0];
+    int error = SIMINF_ERR_READ_EVENTS;
+    int len, *buf = NULL;
+    double *proportion = NULL;
+
+    if (fread(&len, sizeof(int), 1, e->file) != 1) {
+        if (!feof(e->file))
+            return SIMINF_ERR_READ_EVENTS;
+        e->file_eof = 1;
+        return 0;
+    }
 
-            /* Number of states */
-            if ((jcE[e->select + 1] - jcE[e->select]) <= 0)
-                Rprintf("No states to sample from.\n");
+    if (len < 0)
+        return SIMINF_ERR_READ_EVENTS;
+    if (len == 0)
+        return 0;
 
-            if (e->n > Nindividuals)
-                REprintf("Cannot sample %i for event from %i individuals.\n",
-                         e->n, Nindividuals);
+    buf = malloc(7 * (size_t)len * sizeof(int));
+    proportion = malloc((size_t)len * sizeof(double));
+    if (!buf || !proportion) {
+        error = SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
+        goto cleanup;                           /* #nocov */
+    }
 
-            if (e->n < 0)
-                REprintf("Cannot sample %i individuals for event.\n", e->n);
+    if (fread(buf, sizeof(int), 5 * (size_t)len, e->file) != 5 * (size_t)len ||
+        fread(proportion, sizeof(double), len, e->file) != (size_t)len ||
+        fread(&buf[5 * (size_t)len], sizeof(int), 2 * (size_t)len,
+              e->file) != 2 * (size_t)len)
+        goto cleanup;
 
-            REprintf("\n");
-        }
+    {
+        const int *event = buf, *time = &buf[len], *node = &buf[2 * (size_t)len];
+        const int *dest = &buf[3 * (size_t)len], *n = &buf[4 * (size_t)len];
+        const int *select = &buf[5 * (size_t)len];
+        const int *shift = &buf[6 * (size_t)len];
+
+        for (int i = 0; i < len; i++) {
+            if (event[i] < EXIT_EVENT || event[i] > EXTERNAL_TRANSFER_EVENT ||
+                time[i] < e->file_time || n[i] < 0 ||
+                select[i] < 1 || select[i] > e->Nselect)
+                goto cleanup;
+
+            if (node[i] < 1 || node[i] > e->Nn) {
+                error = SIMINF_ERR_NODE_OUT_OF_BOUNDS;
+                goto cleanup;
+            }
 
-        if (u && (node >= 0)) {
-            REprintf("Current state in node\n");
-            REprintf("---------------------\n");
+            if (event[i] == EXTERNAL_TRANSFER_EVENT &&
+                (dest[i] < 1 || dest[i] > e->Nn)) {
+                error = SIMINF_ERR_DEST_OUT_OF_BOUNDS;
+                goto cleanup;
+            }
 
-            REprintf("{");
-            for (i = 0; i < Nc; i++) {
-                REprintf("%i", u[node * Nc + i]);
-                if (i < (Nc - 1))
-                    REprintf(", ");
+            if (!R_FINITE(proportion[i]) ||
+                proportion[i] < 0.0 || proportion[i] > 1.0) {
+                error = SIMINF_ERR_INVALID_PROPORTION;
+                goto cleanup;
             }
-            REprintf("}\n\n");
+
+            if (e->N && shift[i] > e->Nshift) {
+                error = SIMINF_ERR_SHIFT_OUT_OF_BOUNDS;
+                goto cleanup;
+            }
+
+            e->file_time = time[i];
+        }
+
+        SimInf_split_events(
+            events, len, event, time, node, dest, n, proportion,
+            select, shift, e->Nn, e->Nthread, e->E2_parallel);
+    }
+
+    error = 0;
+
+cleanup:
+    free(buf);
+    free(proportion);
+
+    return error;
+}
+
+/**
+ * Read the scheduled events up to the global time from the file
+ *
+ * The blocks of events in the file are read until an event after
+ * the global time has been read, or the end of the file is reached.
+ * Before the first block is read, the events that have been
+ * processed are removed, such that only the events in the blocks
+ * that cover the remaining time are kept in memory. This function
+ * must be called by one thread, before the events at the global
+ * time are processed.
+ *
+ * @param events the scheduled events of each thread.
+ * @param tt the global time.
+ * @return 0 if Ok, else error code.
+ */
+int attribute_hidden
+SimInf_scheduled_events_read(
+    SimInf_scheduled_events *events,
+    double tt)
+{
+    SimInf_scheduled_events *e = &events[0];
+    int error = 0, compacted = 0;
+
+    if (!e->file || e->file_eof > 0)
+        return 0;
+    if (e->file_eof < 0)
+        return SIMINF_ERR_READ_EVENTS; /* #nocov */
+
+    while (!e->file_eof && e->file_time <= tt) {
+        if (!compacted) {
+            size_t k;
+
+            for (int i = 0; i < e->Nthread; i++) {
+                SimInf_scheduled_events *ei = &events[i];
+
+                k = ei->events_index;
+                if (k > 0) {
+                    memmove(ei->events.a, ei->events.a + k,
+                            (kv_size(ei->events) - k) *
+                            sizeof(SimInf_scheduled_event));
+                    kv_size(ei->events) -= k;
+                    ei->events_index = 0;
+                }
+            }
+
+            /* The E2 events before the next batch have been
+             * processed. */
+            k = 0;
+            if (e->E2_batch_index < kv_size(e->E2_batch))
+                k = kv_A(e->E2_batch, e->E2_batch_index);
+            if (k > 0) {
+                memmove(e->E2_events.a, e->E2_events.a + k,
+                        (kv_size(e->E2_events) - k) *
+                        sizeof(SimInf_scheduled_event));
+                kv_size(e->E2_events) -= k;
+                e->E2_offset += k;
+            }
+
+            compacted = 1;
+        }
+
+        error = SimInf_read_events_block(events);
+        if (error)
+            return error;
+    }
+
+    /* Split the remaining E2 events into batches. Since every event
+     * at the global time has been read, the batches at a time are
+     * complete. */
+    if (compacted && e->E2_parallel) {
+        kv_size(e->E2_batch) = 0;
+        e->E2_batch_index = 0;
+        error = SimInf_batch_E2_events(e, e->Nn);
+    }
+
+    return error;
+}
+
+/**
+ * Get the number of partitions of the nodes and the random number
+ * generator from the header of a checkpoint, which must be used to
+ * resume the simulation.
+ *
+ * @param cp the checkpoint.
+ * @param Nthread the number of partitions.
+ * @param philox non-zero if the Philox generator is used.
+ * @return 0 if Ok, else SIMINF_ERR_INVALID_CHECKPOINT.
+ */
+int attribute_hidden
+SimInf_checkpoint_partitions(
+    const SimInf_checkpoint *cp,
+    int *Nthread,
+    int *philox)
+{
+    int dim[6];
+    const size_t offset = 2 * sizeof(SimInf_checkpoint_magic);
+
+    if (cp->size < offset + sizeof(dim) ||
+        memcmp(cp->data, SimInf_checkpoint_magic,
+               sizeof(SimInf_checkpoint_magic)) != 0)
+        return SIMINF_ERR_INVALID_CHECKPOINT;
+
+    /* There must be at least one node in each partition. */
+    memcpy(dim, &cp->data[offset], sizeof(dim));
+    if (dim[4] < 1 || dim[4] > dim[0])
+        return SIMINF_ERR_INVALID_CHECKPOINT;
+    *Nthread = dim[4];
+    *philox = dim[5];
+
+    return 0;
+}
+
+/**
+ * Skip the scheduled events before a time
+ *
+ * The events before the time of a checkpoint have been processed
+ * when the simulation is resumed from the checkpoint.
+ *
+ * @param events the scheduled events of each thread.
+ * @param tt the global time.
+ */
+static void
+SimInf_scheduled_events_skip(
+    SimInf_scheduled_events *events,
+    double tt)
+{
+    SimInf_scheduled_events *e = &events[0];
+
+    for (int i = 0; i < e->Nthread; i++) {
+        SimInf_scheduled_events *ei = &events[i];
+
+        while (ei->events_index < kv_size(ei->events) &&
+               kv_A(ei->events, ei->events_index).time < tt)
+            ei->events_index++;
+    }
+
+    while (e->E2_batch_index + 1 < kv_size(e->E2_batch) &&
+           kv_A(e->E2_events,
+                kv_A(e->E2_batch, e->E2_batch_index)).time < tt)
+        e->E2_batch_index++;
+}
+
+/**
+ * Save or restore the state of the compartment model and the
+ * scheduled events in a checkpoint
+ *
+ * The state is the compartment state and the continuous state of
+ * every node, the transition rates and their sum in every node, the
+ * time, and the state of the random number generators. The
+ * transition rates are restored instead of recomputed, hence, the
+ * resumed simulation continues exactly as if it had not been
+ * interrupted. When the state is restored, the scheduled events
+ * before the time of the checkpoint are skipped, and the first time
+ * in tspan must not be before the time of the checkpoint.
+ *
+ * @param cp the checkpoint.
+ * @param solver the name of the solver.
+ * @param model the compartment model of each thread.
+ * @param events the scheduled events of each thread.
+ * @param args structure with data for the solver.
+ * @return 0 if Ok, else error code.
+ */
+int attribute_hidden
+SimInf_solver_checkpoint(
+    SimInf_checkpoint *cp,
+    const char *solver,
+    SimInf_compartment_model *model,
+    SimInf_scheduled_events *events,
+    SimInf_solver_args *args)
+{
+    char magic[sizeof(SimInf_checkpoint_magic)];
+    char name[sizeof(SimInf_checkpoint_magic)] = {0};
+    char name_expected[sizeof(SimInf_checkpoint_magic)] = {0};
+    const int dim_expected[6] = {args->Nn, args->Nc, args->Nd, args->Nt,
+                                 args->Nthread, args->philox};
+    int dim[6];
+    double time[2] = {model[0].tt, model[0].next_unit_of_time};
+    uint64_t seed = events[0].seed;
+    int error;
+
+    memcpy(magic, SimInf_checkpoint_magic, sizeof(magic));
+    strncpy(name_expected, solver, sizeof(name_expected) - 1);
+    memcpy(name, name_expected, sizeof(name));
+    memcpy(dim, dim_expected, sizeof(dim));
+
+    /* Header */
+    error = SimInf_checkpoint_data(cp, magic, sizeof(magic));
+    if (!error)
+        error = SimInf_checkpoint_data(cp, name, sizeof(name));
+    if (!error)
+        error = SimInf_checkpoint_data(cp, dim, sizeof(dim));
+    if (!error)
+        error = SimInf_checkpoint_data(cp, time, sizeof(time));
+    if (!error)
+        error = SimInf_checkpoint_data(cp, &seed, sizeof(seed));
+    if (error)
+        return error;
+
+    if (cp->restore &&
+        (memcmp(magic, SimInf_checkpoint_magic, sizeof(magic)) != 0 ||
+         memcmp(name, name_expected, sizeof(name)) != 0 ||
+         memcmp(dim, dim_expected, sizeof(dim)) != 0 ||
+         !R_FINITE(time[0]) || args->tspan[0] < time[0]))
+        return SIMINF_ERR_INVALID_CHECKPOINT;
+
+    /* The state of every node. */
+    error = SimInf_checkpoint_data(
+        cp, model[0].u, (size_t)args->Nn * args->Nc * sizeof(int));
+    if (!error)
+        error = SimInf_checkpoint_data(
+            cp, model[0].v, (size_t)args->Nn * args->Nd * sizeof(double));
+    if (!error)
+        error = SimInf_checkpoint_data(
+            cp, model[0].v_new, (size_t)args->Nn * args->Nd * sizeof(double));
+    if (!error)
+        error = SimInf_checkpoint_data(
+            cp, model[0].update_node, (size_t)args->Nn * sizeof(int));
+
+    /* The restored compartment state must be non-negative. */
+    for (size_t i = 0; cp->restore && !error &&
+             i < (size_t)args->Nn * args->Nc; i++) {
+        if (model[0].u[i] < 0)
+            error = SIMINF_ERR_INVALID_CHECKPOINT;
+    }
+
+    /* The transition rates and the random number generator of each
+     * partition. */
+    for (int i = 0; i < args->Nthread && !error; i++) {
+        SimInf_compartment_model *m = &model[i];
+
+        error = SimInf_checkpoint_data(
+            cp, m->t_rate, (size_t)m->Nn * m->Nt * sizeof(double));
+        if (!error)
+            error = SimInf_checkpoint_data(
+                cp, m->sum_t_rate, (size_t)m->Nn * sizeof(double));
+        if (!error)
+            error = SimInf_checkpoint_data(
+                cp, m->t_time, (size_t)m->Nn * sizeof(double));
+        if (!error)
+            error = SimInf_checkpoint_rng(cp, events[i].rng);
+    }
+
+    /* The random number stream of each node. */
+    for (int i = 0; events[0].node_rng && i < args->Nn && !error; i++)
+        error = SimInf_checkpoint_rng(cp, events[0].node_rng[i]);
+
+    if (error || !cp->restore)
+        return error;
+
+    for (int i = 0; i < args->Nthread; i++) {
+        model[i].tt = time[0];
+        model[i].next_unit_of_time = time[1];
+        events[i].seed = seed;
+    }
+
+    SimInf_scheduled_events_skip(events, time[0]);
+
+    return 0;
+}
+
+/**
+ * Print event information to facilitate debugging.
+ *
+ * @param e The SimInf_scheduled_events object to print.
+ * @param irE Select matrix for events. irE[k] is the row of E[k].
+ * @param jcE Select matrix for events. Index to data of first
+ *        non-zero element in row k.
+ * @param Nc Number of compartments in each node.
+ * @param u The state vector with number of individuals in each
+ *        compartment at each node. The current state in each node is
+ *        offset by node * Nc.
+ * @param node The node in u.
+ */
+static void
+SimInf_print_event(
+    const SimInf_scheduled_event *e,
+    const int *irE,
+    const int *jcE,
+    const int Nc,
+    const int *u,
+    const int node,
+    const int dest)
+{
+    #ifdef _OPENMP
+    #  pragma omp critical
+    #endif
+    {
+        int i;
+
+        if (irE && jcE && u) {
+            int Nindividuals = 0;
+
+            /* Count total number of individuals */
+            for (i = jcE[e->select]; i < jcE[e->select + 1]; i++)
+                Nindividuals += u[node * Nc + irE[i]];
+
+            /* Number of states */
+            if ((jcE[e->select + 1] - jcE[e->select]) <= 0)
+                Rprintf("No states to sample from.\n");
+
+            if (e->n > Nindividuals)
+                REprintf("Cannot sample %i for event from %i individuals.\n",
+                         e->n, Nindividuals);
+
+            if (e->n < 0)
+                REprintf("Cannot sample %i individuals for event.\n", e->n);
+
+            REprintf("\n");
+        }
+
+        if (u && (node >= 0)) {
+            REprintf("Current state in node\n");
+            REprintf("---------------------\n");
+
+            REprintf("{");
+            for (i = 0; i < Nc; i++) {
+                REprintf("%i", u[node * Nc + i]);
+                if (i < (Nc - 1))
+                    REprintf(", ");
+            }
+            REprintf("}\n\n");
         }
 
         if (u && (dest >= 0)) {
@@ -581,6 +1532,103 @@ SimInf_print_event(
     }
 }
 
+/**
+ * Process an external transfer event
+ *
+ * Sample individuals from the source node and add them to the dest
+ * node. The individuals are added to the dest node with atomic
+ * operations, since events in the same batch can have a common dest
+ * node when the E2 events are processed in parallel.
+ *
+ * @param ee The external transfer event to process.
+ * @param m The compartment model with the state in every node,
+ *        i.e., the compartment model for thread id 0.
+ * @param e The scheduled events with the select and shift matrices.
+ * @param individuals Vector to store the result of the sampling.
+ * @param rng Random number generator for the sampling.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_process_external_transfer(
+    const SimInf_scheduled_event *ee,
+    const SimInf_compartment_model *m,
+    const SimInf_scheduled_events *e,
+    int *individuals,
+    gsl_rng *rng)
+{
+    int error;
+
+    if (ee->dest < 0 || ee->dest >= m->Ntot) {
+        SimInf_print_event(ee, NULL, NULL, 0, NULL, -1, -1);
+        return SIMINF_ERR_DEST_OUT_OF_BOUNDS;
+    }
+
+    error = SimInf_sample_select(
+        e->irE, e->jcE, e->prE, e->equal_prE, m->Nc, m->u, ee->node, ee->select, ee->n,
+        ee->proportion, individuals, rng);
+
+    if (error) {
+        SimInf_print_event(ee, e->irE, e->jcE, m->Nc,
+                           m->u, ee->node, ee->dest);
+        return error;
+    }
+
+    for (int i = e->jcE[ee->select]; i < e->jcE[ee->select + 1]; i++) {
+        const int jj = e->irE[i];
+        const int kn = ee->node * m->Nc + jj;
+        int kd = ee->dest * m->Nc + jj, ud;
+
+        if (ee->shift >= 0) {
+            /* Process a movement event that also involves a shift
+             * between compartments. */
+            int ll;
+
+            if (!e->N) {
+                /* Not possible to shift when N is not defined. */
+                SimInf_print_event(ee, NULL, NULL, 0, NULL, -1, -1);
+                return SIMINF_ERR_EVENTS_N;
+            }
+
+            /* Check that the index to the new compartment is not out
+             * of bounds. */
+            ll = e->N[ee->shift * m->Nc + jj];
+            if (jj + ll < 0 || jj + ll >= m->Nc) {
+                SimInf_print_event(ee, NULL, NULL, 0, NULL, -1, -1);
+                return SIMINF_ERR_SHIFT_OUT_OF_BOUNDS;
+            }
+
+            kd += ll;
+        }
+
+        /* Add individuals to dest */
+        #ifdef _OPENMP
+        #  pragma omp atomic capture
+        #endif
+        ud = m->u[kd] += individuals[jj];
+        if (ud < 0) {
+            SimInf_print_event(ee, NULL, NULL, m->Nc,
+                               m->u, ee->node, ee->dest);
+            return SIMINF_ERR_NEGATIVE_STATE;
+        }
+
+        /* Remove individuals from node */
+        m->u[kn] -= individuals[jj];
+        if (m->u[kn] < 0) {
+            SimInf_print_event(ee, NULL, NULL, m->Nc,
+                               m->u, ee->node, ee->dest);
+            return SIMINF_ERR_NEGATIVE_STATE;
+        }
+    }
+
+    /* Indicate dest for update */
+    #ifdef _OPENMP
+    #  pragma omp atomic write
+    #endif
+    m->update_node[ee->dest] = 1;
+
+    return 0;
+}
+
 /**
  * Process all scheduled E1 and E2 events where time is less or equal
  * to the global time in the simulation.
@@ -604,6 +1652,7 @@ SimInf_process_events(
     /* Process events */
     while (e.events_index < kv_size(e.events) && !m.error) {
         const SimInf_scheduled_event ee = kv_A(e.events, e.events_index);
+        gsl_rng *rng;
 
         if (ee.time > m.tt)
             goto done;
@@ -614,11 +1663,14 @@ SimInf_process_events(
             goto done;
         }
 
+        /* Use the random number stream of the node if available. */
+        rng = e.node_rng ? e.node_rng[ee.node] : e.rng;
+
         switch (ee.event) {
         case EXIT_EVENT:
             m.error = SimInf_sample_select(
-                e.irE, e.jcE, e.prE, m.Nc, m.u, ee.node - m.Ni, ee.select,
-                ee.n, ee.proportion, e.individuals, e.rng);
+                e.irE, e.jcE, e.prE, e.equal_prE, m.Nc, m.u, ee.node - m.Ni,
+                ee.select, ee.n, ee.proportion, e.individuals, rng);
 
             if (m.error) {
                 SimInf_print_event(&ee, e.irE, e.jcE, m.Nc,
@@ -643,8 +1695,8 @@ SimInf_process_events(
 
         case ENTER_EVENT:
             m.error = SimInf_sample_select_enter(
-                e.irE, e.jcE, e.prE, m.Nc, m.u, ee.node - m.Ni, ee.select,
-                ee.n, ee.proportion, e.individuals, e.rng);
+                e.irE, e.jcE, e.prE, e.cum_prE, m.Nc, m.u, ee.node - m.Ni,
+                ee.select, ee.n, ee.proportion, e.individuals, rng);
 
             if (m.error) {
                 SimInf_print_event(&ee, e.irE, e.jcE, m.Nc,
@@ -712,8 +1764,8 @@ SimInf_process_events(
             }
 
             m.error = SimInf_sample_select(
-                e.irE, e.jcE, e.prE, m.Nc, m.u, ee.node - m.Ni, ee.select,
-                ee.n, ee.proportion, e.individuals, e.rng);
+                e.irE, e.jcE, e.prE, e.equal_prE, m.Nc, m.u, ee.node - m.Ni,
+                ee.select, ee.n, ee.proportion, e.individuals, rng);
 
             if (m.error) {
                 SimInf_print_event(&ee, e.irE, e.jcE, m.Nc,
@@ -761,77 +1813,10 @@ SimInf_process_events(
             if (!process_E2)
                 goto done;
 
-            if (ee.dest < 0 || ee.dest >= m.Ntot) {
-                SimInf_print_event(&ee, NULL, NULL, 0, NULL, -1, -1);
-                m.error = SIMINF_ERR_DEST_OUT_OF_BOUNDS;
-                goto done;
-            }
-
-            m.error = SimInf_sample_select(
-                e.irE, e.jcE, e.prE, m.Nc, m.u, ee.node, ee.select, ee.n,
-                ee.proportion, e.individuals, e.rng);
-
-            if (m.error) {
-                SimInf_print_event(&ee, e.irE, e.jcE, m.Nc,
-                                   m.u, ee.node, ee.dest);
+            m.error = SimInf_process_external_transfer(
+                &ee, &m, &e, e.individuals, rng);
+            if (m.error)
                 goto done;
-            }
-
-            for (int i = e.jcE[ee.select]; i < e.jcE[ee.select + 1]; i++) {
-                const int jj = e.irE[i];
-                const int kd = ee.dest * m.Nc + jj;
-                const int kn = ee.node * m.Nc + jj;
-
-                if (ee.shift < 0) {
-                    /* Add individuals to dest without shifting
-                     * compartments */
-                    m.u[kd] += e.individuals[jj];
-                    if (m.u[kd] < 0) {
-                        SimInf_print_event(&ee, NULL, NULL, m.Nc,
-                                           m.u, ee.node, ee.dest);
-                        m.error = SIMINF_ERR_NEGATIVE_STATE;
-                        goto done;
-                    }
-                } else if (!e.N) {
-                    /* Not possible to shift when N is not defined. */
-                    SimInf_print_event(&ee, NULL, NULL, 0, NULL, -1, -1);
-                    m.error = SIMINF_ERR_EVENTS_N;
-                    goto done;
-                } else {
-                    /* Process a movement event that also involves a
-                     * shift between compartments. */
-                    const int ll = e.N[ee.shift * m.Nc + jj];
-
-                    /* Check that the index to the new compartment is
-                     * not out of bounds. */
-                    if (jj + ll < 0 || jj + ll >= m.Nc) {
-                        SimInf_print_event(&ee, NULL, NULL, 0, NULL, -1, -1);
-                        m.error = SIMINF_ERR_SHIFT_OUT_OF_BOUNDS;
-                        goto done;
-                    }
-
-                    /* Add individuals to dest */
-                    m.u[kd + ll] += e.individuals[jj];
-                    if (m.u[kd + ll] < 0) {
-                        SimInf_print_event(&ee, NULL, NULL, m.Nc,
-                                           m.u, ee.node, ee.dest);
-                        m.error = SIMINF_ERR_NEGATIVE_STATE;
-                        goto done;
-                    }
-                }
-
-                /* Remove individuals from node */
-                m.u[kn] -= e.individuals[jj];
-                if (m.u[kn] < 0) {
-                    SimInf_print_event(&ee, NULL, NULL, m.Nc,
-                                       m.u, ee.node, ee.dest);
-                    m.error = SIMINF_ERR_NEGATIVE_STATE;
-                    goto done;
-                }
-            }
-
-            /* Indicate dest for update */
-            m.update_node[ee.dest] = 1;
             break;
 
         default:
@@ -843,6 +1828,10 @@ SimInf_process_events(
         /* Indicate node for update */
         m.update_node[ee.node - m.Ni] = 1;
 
+        if (ee.event == EXTERNAL_TRANSFER_EVENT)
+            m.n_events_E2++;
+        else
+            m.n_events_E1++;
         e.events_index++;
     }
 
@@ -852,56 +1841,422 @@ done:
 }
 
 /**
- * Handle the case where the solution is stored in a sparse matrix
+ * Derive the seed of the random number stream for an E2 event
  *
- * Store solution if tt has passed the next time in tspan. Report
- * solution up to, but not including tt.
+ * Mix the seed of the simulation with the index to the event using
+ * the finalizer of the SplitMix64 generator, such that the stream
+ * for each event is independent of the thread that processes it.
  *
- * @param SimInf_compartment_model *model data to store.
+ * @param seed The random number seed of the simulation.
+ * @param k The index to the event.
+ * @return The seed for the event.
  */
-void attribute_hidden
-SimInf_store_solution_sparse(
-    SimInf_compartment_model *model)
+static unsigned long int
+SimInf_E2_seed(
+    unsigned long int seed,
+    size_t k)
 {
-    while (!model[0].U && model[0].U_it < model[0].tlen &&
-           model[0].tt > model[0].tspan[model[0].U_it]) {
-        int j;
+    uint64_t z = (uint64_t)seed + ((uint64_t)k + 1) * 0x9e3779b97f4a7c15ULL;
 
-        /* Copy compartment state to U_sparse */
-        for (j = model[0].jcU[model[0].U_it];
-             j < model[0].jcU[model[0].U_it + 1]; j++)
-            model[0].prU[j] = model[0].u[model[0].irU[j]];
-        model[0].U_it++;
-    }
-
-    while (!model[0].V && model[0].V_it < model[0].tlen &&
-           model[0].tt > model[0].tspan[model[0].V_it]) {
-        int j;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
 
-        /* Copy continuous state to V_sparse */
-        for (j = model[0].jcV[model[0].V_it];
-             j < model[0].jcV[model[0].V_it + 1]; j++)
-            model[0].prV[j] = model[0].v_new[model[0].irV[j]];
-        model[0].V_it++;
-    }
+    return (unsigned long int)(z & 0xffffffffUL);
 }
 
 /**
- * Free allocated memory for an epidemiological compartment
- * model.
+ * Process the batches of E2 events in parallel
  *
- * @param model the data structure to free.
- * @param Nthread number of threads that was used during simulation.
+ * The E2 events in a batch are independent and are distributed among
+ * the threads. Each event uses its own random number stream, hence,
+ * the result is the same for a given seed regardless of the number
+ * of threads.
+ *
+ * @param model The compartment model with information for each node
+ * and the global time.
+ * @param events Data with events to process.
  */
-void attribute_hidden
-SimInf_compartment_model_free(
-    SimInf_compartment_model *model)
+static void
+SimInf_process_E2_events_parallel(
+    SimInf_compartment_model *model,
+    SimInf_scheduled_events *events)
 {
-    if (model) {
-        int i;
+    SimInf_scheduled_events *e = &events[0];
 
-        for (i = 0; i < model->Nthread; i++) {
-            SimInf_compartment_model *m = &model[i];
+    for (;;) {
+        R_xlen_t begin, end;
+
+        /* Stop if an error has occurred. */
+        for (int i = 0; i < model[0].Nthread; i++) {
+            if (model[i].error)
+                return;
+        }
+
+        /* Check if there is a batch to process. */
+        if (e->E2_batch_index + 1 >= kv_size(e->E2_batch))
+            return;
+        begin = kv_A(e->E2_batch, e->E2_batch_index);
+        end = kv_A(e->E2_batch, e->E2_batch_index + 1);
+        if (kv_A(e->E2_events, begin).time > model[0].tt)
+            return;
+
+        #ifdef _OPENMP
+        #  pragma omp for schedule(dynamic, 64)
+        #endif
+        for (R_xlen_t k = begin; k < end; k++) {
+            const SimInf_scheduled_event *ee = &kv_A(e->E2_events, k);
+            int error = 0, tid = 0;
+
+            #ifdef _OPENMP
+            tid = omp_get_thread_num();
+            #endif
+
+            if (ee->node < 0 || ee->node >= model[0].Ntot) {
+                SimInf_print_event(ee, NULL, NULL, 0, NULL, -1, -1);
+                error = SIMINF_ERR_NODE_OUT_OF_BOUNDS;
+            } else {
+                gsl_rng_set(events[tid].E2_rng,
+                            SimInf_E2_seed(e->seed, e->E2_offset + k));
+                error = SimInf_process_external_transfer(
+                    ee, &model[0], e, events[tid].individuals,
+                    events[tid].E2_rng);
+
+                /* Indicate node for update */
+                model[0].update_node[ee->node] = 1;
+                model[tid].n_events_E2++;
+            }
+
+            if (error)
+                model[tid].error = error;
+        }
+
+        #ifdef _OPENMP
+        #  pragma omp single
+        #endif
+        e->E2_batch_index++;
+    }
+}
+
+/**
+ * Process all scheduled E2 events where time is less or equal to the
+ * global time in the simulation.
+ *
+ * This function must be called by every thread in the parallel
+ * region. The E2 events are either processed by the master thread,
+ * or in parallel by all threads if the E2 events have been split
+ * into batches.
+ *
+ * @param model The compartment model with information for each node
+ * and the global time.
+ * @param events Data with events to process.
+ */
+void attribute_hidden
+SimInf_process_E2_events(
+    SimInf_compartment_model *model,
+    SimInf_scheduled_events *events)
+{
+    if (events[0].E2_parallel) {
+        SimInf_process_E2_events_parallel(model, events);
+    } else {
+        #ifdef _OPENMP
+        #  pragma omp master
+        #endif
+        {
+            SimInf_process_events(model, events, 1);
+        }
+    }
+}
+
+/**
+ * Reduce the compartment state at time index U_it with the reducers
+ * of the solution.
+ *
+ * @param m data with the compartment state and the reducers.
+ */
+static void
+SimInf_reduce_U(
+    SimInf_compartment_model *m)
+{
+    int node;
+
+    if (m->sum_U) {
+        double *sum_U = &m->sum_U[(size_t)m->Ngroup * m->Nc * m->U_it];
+
+        for (node = 0; node < m->Ntot; node++) {
+            const int *u = &m->u[node * m->Nc];
+            double *sum = &sum_U[m->group[node] * m->Nc];
+
+            for (int j = 0; j < m->Nc; j++)
+                sum[j] += u[j];
+        }
+    }
+
+    if (m->first) {
+        for (node = 0; node < m->Ntot; node++) {
+            if (ISNA(m->first[node])) {
+                for (int j = 0; j < m->Nfirst; j++) {
+                    if (m->u[node * m->Nc + m->first_select[j]] > 0) {
+                        m->first[node] = m->tspan[m->U_it];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    if (m->prevalence) {
+        double level_1[2] = {0, 0}, level_2[2] = {0, 0};
+
+        for (node = 0; node < m->Ntot; node++) {
+            const int *u = &m->u[node * m->Nc];
+            double cases = 0, population = 0;
+
+            for (int j = 0; j < m->Ncases; j++)
+                cases += u[m->cases[j]];
+            for (int j = 0; j < m->Npopulation; j++)
+                population += u[m->population[j]];
+
+            SimInf_prevalence_node(1, cases, population, level_1, NULL);
+            SimInf_prevalence_node(2, cases, population, level_2, NULL);
+        }
+
+        m->prevalence[2 * m->U_it] = level_1[0] / level_1[1];
+        m->prevalence[2 * m->U_it + 1] = level_2[0] / level_2[1];
+    }
+}
+
+/**
+ * Reduce the continuous state at time index V_it with the reducers
+ * of the solution.
+ *
+ * @param m data with the continuous state and the reducers.
+ */
+static void
+SimInf_reduce_V(
+    SimInf_compartment_model *m)
+{
+    if (m->sum_V) {
+        double *sum_V = &m->sum_V[(size_t)m->Ngroup * m->Nd * m->V_it];
+
+        for (int node = 0; node < m->Ntot; node++) {
+            const double *v = &m->v_new[node * m->Nd];
+            double *sum = &sum_V[m->group[node] * m->Nd];
+
+            for (int j = 0; j < m->Nd; j++)
+                sum[j] += v[j];
+        }
+    }
+}
+
+/**
+ * Write the compartment state and the continuous state at the next
+ * time in tspan to the output file, one column of U followed by one
+ * column of V.
+ *
+ * @param m data with the state of all nodes and the output file.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_store_solution_file(
+    SimInf_compartment_model *m)
+{
+    const size_t n_u = (size_t)m->Ntot * m->Nc;
+    const size_t n_v = (size_t)m->Ntot * m->Nd;
+
+    if (fwrite(m->u, sizeof(int), n_u, m->file) != n_u)
+        return SIMINF_ERR_WRITE_FILE;
+    if (fwrite(m->v_new, sizeof(double), n_v, m->file) != n_v)
+        return SIMINF_ERR_WRITE_FILE;
+    return 0;
+}
+
+/**
+ * Find the first non-zero entry in column j of a sparse matrix with
+ * a row index >= row.
+ *
+ * @param ir the row indices of the non-zero entries.
+ * @param jc the index to the first non-zero entry of each column.
+ * @param j the column.
+ * @param row the row.
+ * @return the index to the first non-zero entry in column j with row
+ *         index >= row, or jc[j + 1] if there is no such entry.
+ */
+static int
+SimInf_sparse_lower_bound(
+    const int *ir,
+    const int *jc,
+    int j,
+    int row)
+{
+    int lo = jc[j], hi = jc[j + 1];
+
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+
+        if (ir[mid] < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Copy the state of the nodes in the partition to the dense matrices
+ * U and V, or to the compact dense matrices U16 and V32, if tt has
+ * passed the next time in tspan. Report solution up to, but not
+ * including tt.
+ *
+ * @param m data for the partition to store.
+ * @return 0 if Ok, else error code.
+ */
+int attribute_hidden
+SimInf_store_solution_dense_partition(
+    SimInf_compartment_model *m)
+{
+    /* Copy compartment state to U */
+    while (m->U && m->U_it < m->tlen && m->tt > m->tspan[m->U_it])
+        memcpy(&m->U[m->Nc * ((m->Ntot * m->U_it++) + m->Ni)],
+               m->u, m->Nn * m->Nc * sizeof(int));
+
+    /* Convert compartment state to U16 */
+    while (m->U16 && m->U_it < m->tlen && m->tt > m->tspan[m->U_it]) {
+        uint16_t *U16 = &m->U16[m->Nc * ((m->Ntot * m->U_it++) + m->Ni)];
+
+        for (int j = 0; j < m->Nn * m->Nc; j++) {
+            if (m->u[j] > UINT16_MAX)
+                return SIMINF_ERR_COMPACT_OVERFLOW;
+            U16[j] = (uint16_t)m->u[j];
+        }
+    }
+
+    /* Copy continuous state to V */
+    while (m->V && m->V_it < m->tlen && m->tt > m->tspan[m->V_it])
+        memcpy(&m->V[m->Nd * ((m->Ntot * m->V_it++) + m->Ni)],
+               m->v_new, m->Nn * m->Nd * sizeof(double));
+
+    /* Convert continuous state to V32 */
+    while (m->V32 && m->V_it < m->tlen && m->tt > m->tspan[m->V_it]) {
+        float *V32 = &m->V32[m->Nd * ((m->Ntot * m->V_it++) + m->Ni)];
+
+        for (int j = 0; j < m->Nn * m->Nd; j++)
+            V32[j] = (float)m->v_new[j];
+    }
+
+    return 0;
+}
+
+/**
+ * Copy the state of the nodes in the partition to U_sparse and
+ * V_sparse, if tt has passed the next time in tspan. Report solution
+ * up to, but not including tt. Each partition copies the rows of its
+ * nodes Ni..Ni+Nn-1 in parallel with the other partitions, while
+ * U_it and V_it are advanced after the parallel region in
+ * SimInf_store_solution_sparse().
+ *
+ * @param m data for the partition to store.
+ */
+void attribute_hidden
+SimInf_store_solution_sparse_partition(
+    SimInf_compartment_model *m)
+{
+    int it, j;
+
+    /* Copy compartment state to U_sparse */
+    if (!m->U && !m->U16 && m->prU) {
+        const int first = m->Ni * m->Nc;
+        const int last = (m->Ni + m->Nn) * m->Nc;
+
+        for (it = m->U_it; it < m->tlen && m->tt > m->tspan[it]; it++) {
+            for (j = SimInf_sparse_lower_bound(m->irU, m->jcU, it, first);
+                 j < m->jcU[it + 1] && m->irU[j] < last; j++)
+                m->prU[j] = m->u[m->irU[j] - first];
+        }
+    }
+
+    /* Copy continuous state to V_sparse */
+    if (!m->V && !m->V32 && m->prV) {
+        const int first = m->Ni * m->Nd;
+        const int last = (m->Ni + m->Nn) * m->Nd;
+
+        for (it = m->V_it; it < m->tlen && m->tt > m->tspan[it]; it++) {
+            for (j = SimInf_sparse_lower_bound(m->irV, m->jcV, it, first);
+                 j < m->jcV[it + 1] && m->irV[j] < last; j++)
+                m->prV[j] = m->v_new[m->irV[j] - first];
+        }
+    }
+}
+
+/**
+ * Handle the case where the solution is stored in a sparse matrix,
+ * written to a file, or reduced with the reducers of the solution.
+ * The sparse matrices have already been filled by each partition in
+ * SimInf_store_solution_sparse_partition().
+ *
+ * Store solution if tt has passed the next time in tspan. Report
+ * solution up to, but not including tt.
+ *
+ * @param SimInf_compartment_model *model data to store.
+ */
+void attribute_hidden
+SimInf_store_solution_sparse(
+    SimInf_compartment_model *model)
+{
+    int i;
+
+    /* The columns of U and V are written together to the file, so
+     * U_it and V_it are advanced together. */
+    while (model[0].file && model[0].U_it < model[0].tlen &&
+           model[0].tt > model[0].tspan[model[0].U_it]) {
+        if (!model[0].error)
+            model[0].error = SimInf_store_solution_file(&model[0]);
+
+        SimInf_reduce_U(&model[0]);
+        SimInf_reduce_V(&model[0]);
+        model[0].U_it++;
+        model[0].V_it++;
+    }
+
+    while (!model[0].U && !model[0].U16 && model[0].U_it < model[0].tlen &&
+           model[0].tt > model[0].tspan[model[0].U_it]) {
+        SimInf_reduce_U(&model[0]);
+        model[0].U_it++;
+    }
+
+    while (!model[0].V && !model[0].V32 && model[0].V_it < model[0].tlen &&
+           model[0].tt > model[0].tspan[model[0].V_it]) {
+        SimInf_reduce_V(&model[0]);
+        model[0].V_it++;
+    }
+
+    /* Keep the time index of the sparse solution in every partition
+     * in step with the first partition. */
+    for (i = 1; i < model[0].Nthread; i++) {
+        if (!model[i].U && !model[i].U16)
+            model[i].U_it = model[0].U_it;
+        if (!model[i].V && !model[i].V32)
+            model[i].V_it = model[0].V_it;
+    }
+}
+
+/**
+ * Free allocated memory for an epidemiological compartment
+ * model.
+ *
+ * @param model the data structure to free.
+ * @param Nthread number of threads that was used during simulation.
+ */
+void attribute_hidden
+SimInf_compartment_model_free(
+    SimInf_compartment_model *model)
+{
+    if (model) {
+        int i;
+
+        for (i = 0; i < model->Nthread; i++) {
+            SimInf_compartment_model *m = &model[i];
 
             if (m) {
                 free(m->t_rate);
@@ -910,6 +2265,14 @@ SimInf_compartment_model_free(
                 m->sum_t_rate = NULL;
                 free(m->t_time);
                 m->t_time = NULL;
+                free(m->active);
+                m->active = NULL;
+                free(m->t_rate_new);
+                m->t_rate_new = NULL;
+                free(m->t_tree);
+                m->t_tree = NULL;
+                free(m->sum_t_rate_c);
+                m->sum_t_rate_c = NULL;
             }
         }
 
@@ -921,10 +2284,218 @@ SimInf_compartment_model_free(
         model[0].v_new = NULL;
         free(model[0].update_node);
         model[0].update_node = NULL;
+        free(model[0].N);
+        model[0].N = NULL;
         free(model);
     }
 }
 
+/**
+ * Count the number of individuals in each node of a partition.
+ *
+ * @param model data for the partition.
+ */
+void attribute_hidden
+SimInf_compartment_model_population(
+    SimInf_compartment_model *model)
+{
+    int node;
+
+    for (node = 0; node < model->Nn; node++) {
+        const int *u = &model->u[node * model->Nc];
+        double N = 0.0;
+        int k;
+
+        for (k = 0; k < model->Nc; k++)
+            N += u[k];
+        model->N[node] = N;
+    }
+}
+
+/**
+ * Add the work of the solver in every partition to the profile of
+ * the simulation.
+ *
+ * @param model the compartment model.
+ * @param profile the profile, or NULL if the simulation is not
+ *        profiled.
+ */
+void attribute_hidden
+SimInf_compartment_model_profile(
+    const SimInf_compartment_model *model,
+    SimInf_profile *profile)
+{
+    if (!profile)
+        return;
+
+    for (int i = 0; i < model[0].Nthread; i++) {
+        profile->transitions += model[i].n_transitions;
+        profile->rates += model[i].n_rates;
+        profile->events_E1 += model[i].n_events_E1;
+        profile->events_E2 += model[i].n_events_E2;
+    }
+}
+
+/**
+ * Compute the rates of several transitions in a node, with one call
+ * to rates_fun if the model has it, else with the transition rate
+ * function of each transition.
+ *
+ * @param model data for the partition.
+ * @param rate the resulting rates, rate[k] is the rate of transition
+ *        tr[k].
+ * @param tr the zero-based transitions, or NULL for all transitions,
+ *        in which case n must be the number of transitions.
+ * @param n the number of transitions to compute.
+ * @param node the node in the partition.
+ * @param v the continuous state of the nodes in the partition.
+ * @param t the time.
+ */
+void attribute_hidden
+SimInf_compartment_model_rates(
+    const SimInf_compartment_model *model,
+    double *rate,
+    const int *tr,
+    int n,
+    int node,
+    const double *v,
+    double t)
+{
+    const int *u = &model->u[node * model->Nc];
+    const double *ldata = &model->ldata[node * model->Nld];
+    int k;
+
+    v = &v[node * model->Nd];
+
+    if (model->rates_fun) {
+        model->rates_fun(rate, tr, n, u, v, ldata, model->gdata, t);
+        return;
+    }
+
+    for (k = 0; k < n; k++)
+        rate[k] = (*model->tr_fun[tr ? tr[k] : k])(u, v, ldata, model->gdata, t);
+}
+
+/**
+ * Calculate the rates of all transitions in n consecutive nodes of a
+ * partition, with one call to nodes_fun if the model has it, else
+ * node by node.
+ *
+ * @param model data for the partition.
+ * @param rate the resulting rates, rate[k * Nt + j] is the rate of
+ *        transition j in node 'node + k'.
+ * @param node the first node in the partition.
+ * @param n the number of nodes.
+ * @param v the continuous state of the nodes in the partition.
+ * @param t the time.
+ */
+void attribute_hidden
+SimInf_compartment_model_rates_nodes(
+    const SimInf_compartment_model *model,
+    double *rate,
+    int node,
+    int n,
+    const double *v,
+    double t)
+{
+    int k;
+
+    if (model->nodes_fun) {
+        model->nodes_fun(rate, n, model->Nt,
+                         &model->u[node * model->Nc], model->Nc,
+                         &v[node * model->Nd], model->Nd,
+                         &model->ldata[node * model->Nld], model->Nld,
+                         model->gdata, t);
+        return;
+    }
+
+    for (k = 0; k < n; k++) {
+        SimInf_compartment_model_rates(
+            model, &rate[k * model->Nt], NULL, model->Nt, node + k, v, t);
+    }
+}
+
+/**
+ * Call the post time step function in the block of
+ * SIMINF_NODES_BLOCK nodes (fewer in the last block of the
+ * partition) that starts at 'node', and flag the nodes that need to
+ * update the transition rates in update_node. If the model has
+ * nodes_fun, the new rates of the flagged nodes are calculated with
+ * one call and stored in t_rate_new, see
+ * SimInf_compartment_model_rates_new().
+ *
+ * @param model data for the partition.
+ * @param node the first node of the block in the partition.
+ * @return 0 if Ok, else the error code from the post time step
+ *         function.
+ */
+int attribute_hidden
+SimInf_compartment_model_post_time_step(
+    SimInf_compartment_model *model,
+    int node)
+{
+    const int n = model->Nn - node < SIMINF_NODES_BLOCK ?
+        model->Nn - node : SIMINF_NODES_BLOCK;
+    int first = n, last = -1, k;
+
+    for (k = 0; k < n; k++) {
+        const int i = node + k;
+        const int rc = model->pts_neighbors_fun ?
+            model->pts_neighbors_fun(
+                &model->v_new[i * model->Nd], &model->u[i * model->Nc],
+                &model->v[i * model->Nd], &model->ldata[i * model->Nld],
+                model->gdata, &model->neighbors, model->Ni + i,
+                model->tt) :
+            model->pts_fun(
+                &model->v_new[i * model->Nd], &model->u[i * model->Nc],
+                &model->v[i * model->Nd], &model->ldata[i * model->Nld],
+                model->gdata, model->Ni + i, model->tt);
+
+        if (rc < 0)
+            return rc;
+        if (rc > 0)
+            model->update_node[i] = 1;
+        if (model->update_node[i]) {
+            if (first == n)
+                first = k;
+            last = k;
+        }
+    }
+
+    if (model->nodes_fun && last >= first) {
+        SimInf_compartment_model_rates_nodes(
+            model, &model->t_rate_new[first * model->Nt], node + first,
+            last - first + 1, model->v_new, model->tt);
+    }
+
+    return 0;
+}
+
+/**
+ * Get the new rates of all transitions in a node that is flagged for
+ * update after SimInf_compartment_model_post_time_step().
+ *
+ * @param model data for the partition.
+ * @param node the node in the partition.
+ * @param block the first node of the block with the node.
+ * @return pointer to the Nt new rates of the node.
+ */
+const double attribute_hidden *
+SimInf_compartment_model_rates_new(
+    SimInf_compartment_model *model,
+    int node,
+    int block)
+{
+    if (model->nodes_fun)
+        return &model->t_rate_new[(node - block) * model->Nt];
+
+    SimInf_compartment_model_rates(
+        model, model->t_rate_new, NULL, model->Nt, node,
+        model->v_new, model->tt);
+
+    return model->t_rate_new;
+}
+
 /**
  * Create and initialize data for an epidemiological compartment
  * model. The generated model must be freed by the user.
@@ -955,31 +2526,30 @@ SimInf_compartment_model_create(
     if (!model[0].v_new)
         goto on_error; /* #nocov */
 
-    /* Set continuous state to the initial state in each node. */
-    memcpy(model[0].v, args->v0, args->Nn * args->Nd * sizeof(double));
-    memcpy(model[0].v_new, args->v0, args->Nn * args->Nd * sizeof(double));
-
     /* Setup vector to keep track of nodes that must be updated due to
      * scheduled events */
     model[0].update_node = calloc(args->Nn, sizeof(int));
     if (!model[0].update_node)
         goto on_error; /* #nocov */
 
-    /* Allocate memory for compartment state and set compartment state
-     * to the initial state. */
+    /* Allocate memory to count the number of individuals in each
+     * node. */
+    model[0].N = malloc(args->Nn * sizeof(double));
+    if (!model[0].N)
+        goto on_error; /* #nocov */
+
+    /* Allocate memory for compartment state. */
     model[0].u = malloc(args->Nn * args->Nc * sizeof(int));
     if (!model[0].u)
         goto on_error; /* #nocov */
-    memcpy(model[0].u, args->u0, args->Nn * args->Nc * sizeof(int));
 
     for (i = 0; i < args->Nthread; i++) {
         /* Constants */
         model[i].Nthread = args->Nthread;
         model[i].Ntot = args->Nn;
-        model[i].Ni = i * (args->Nn / args->Nthread);
-        model[i].Nn = args->Nn / args->Nthread;
-        if (i == (args->Nthread - 1))
-            model[i].Nn += (args->Nn % args->Nthread);
+        model[i].Ni = SimInf_partition_first(i, args->Nn, args->Nthread);
+        model[i].Nn = SimInf_partition_first(i + 1, args->Nn, args->Nthread) -
+            model[i].Ni;
         model[i].Nt = args->Nt;
         model[i].Nc = args->Nc;
         model[i].Nd = args->Nd;
@@ -994,42 +2564,29 @@ SimInf_compartment_model_create(
 
         /* Callbacks */
         model[i].tr_fun = args->tr_fun;
+        model[i].rates_fun = args->rates_fun;
+        model[i].nodes_fun = args->nodes_fun;
         model[i].pts_fun = args->pts_fun;
+        model[i].pts_neighbors_fun = args->pts_neighbors_fun;
 
         /* Keep track of time */
-        model[i].tt = args->tspan[0];
-        model[i].next_unit_of_time = floor(model[i].tt) + 1.0;
         model[i].tspan = args->tspan;
         model[i].tlen = args->tlen;
-        model[i].U_it = 0;
-        model[i].V_it = 0;
-
-        /* Data vectors */
-        if (args->U) {
-            model[i].U = args->U;
-        } else if (i == 0) {
-            model[i].irU = args->irU;
-            model[i].jcU = args->jcU;
-            model[i].prU = args->prU;
-        }
-
-        if (args->V) {
-            model[i].V = args->V;
-        } else if (i == 0) {
-            model[i].irV = args->irV;
-            model[i].jcV = args->jcV;
-            model[i].prV = args->prV;
-        }
 
         if (i > 0) {
             model[i].u = &(model[0].u[model[i].Ni * args->Nc]);
             model[i].v = &(model[0].v[model[i].Ni * args->Nd]);
             model[i].v_new = &(model[0].v_new[model[i].Ni * args->Nd]);
             model[i].update_node = &(model[0].update_node[model[i].Ni]);
+            model[i].N = &(model[0].N[model[i].Ni]);
         }
 
         model[i].ldata = &(args->ldata[model[i].Ni * model[i].Nld]);
-        model[i].gdata = args->gdata;
+        model[i].neighbors.ir = args->irN;
+        model[i].neighbors.jc = args->jcN;
+        model[i].neighbors.pr = args->prN;
+        model[i].neighbors.N = model[0].N;
+        model[i].profile = args->profile;
 
         /* Create transition rate matrix (Nt X Nn) and total rate
          * vector. In t_rate we store all propensities for state
@@ -1044,8 +2601,38 @@ SimInf_compartment_model_create(
         model[i].t_time = malloc(model[i].Nn * sizeof(double));
         if (!model[i].t_time)
             goto on_error; /* #nocov */
+        model[i].active = malloc(model[i].Nn * sizeof(int));
+        if (!model[i].active)
+            goto on_error; /* #nocov */
+        model[i].t_rate_new = malloc(
+            (size_t)args->Nt * SIMINF_NODES_BLOCK * sizeof(double));
+        if (!model[i].t_rate_new)
+            goto on_error; /* #nocov */
+
+        /* The compensation of the compensated summation of the sum
+         * of the transition rates in every node. */
+        if (args->compensated) {
+            model[i].sum_t_rate_c = calloc(model[i].Nn, sizeof(double));
+            if (!model[i].sum_t_rate_c)
+                goto on_error; /* #nocov */
+        }
+
+        /* Create a binary sum tree of the transition rates in every
+         * node. The number of leaves is a power of two, and unused
+         * leaves have rate zero. */
+        if (args->tree_select) {
+            model[i].Ntree = 1;
+            while (model[i].Ntree < args->Nt)
+                model[i].Ntree *= 2;
+            model[i].t_tree = calloc(2 * (size_t)model[i].Ntree * model[i].Nn,
+                                     sizeof(double));
+            if (!model[i].t_tree)
+                goto on_error; /* #nocov */
+        }
     }
 
+    SimInf_compartment_model_reset(model, args);
+
     *out = model;
     return 0;
 
@@ -1054,6 +2641,148 @@ on_error:                                  /* #nocov */
     return SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
 }
 
+/**
+ * Reset the compartment model to the initial state to simulate a new
+ * trajectory, and set the output to the data vectors in args.
+ *
+ * @param model the compartment model to reset.
+ * @param args structure with data for the solver.
+ */
+void attribute_hidden
+SimInf_compartment_model_reset(
+    SimInf_compartment_model *model,
+    SimInf_solver_args *args)
+{
+    int i;
+
+    /* Set compartment state and continuous state to the initial
+     * state in each node. The state of a partition is copied by the
+     * thread that simulates it, so that the memory pages are first
+     * touched by, and local to, that thread if the partitions are
+     * assigned to the threads in a fixed order, see
+     * SimInf_bind_thread(). */
+    #ifdef _OPENMP
+    #  pragma omp parallel num_threads(SimInf_num_threads())
+    #endif
+    {
+        SimInf_set_schedule();
+        SimInf_bind_thread();
+
+        #ifdef _OPENMP
+        #  pragma omp for schedule(runtime)
+        #endif
+        for (i = 0; i < args->Nthread; i++) {
+            SimInf_compartment_model *m = &model[i];
+
+            memcpy(m->u, &args->u0[m->Ni * m->Nc],
+                   m->Nn * m->Nc * sizeof(int));
+            memcpy(m->v, &args->v0[m->Ni * m->Nd],
+                   m->Nn * m->Nd * sizeof(double));
+            memcpy(m->v_new, &args->v0[m->Ni * m->Nd],
+                   m->Nn * m->Nd * sizeof(double));
+            memset(m->update_node, 0, m->Nn * sizeof(int));
+            memset(m->N, 0, m->Nn * sizeof(double));
+        }
+    }
+
+    for (i = 0; i < args->Nthread; i++) {
+        /* Keep track of time */
+        model[i].tt = args->tspan[0];
+        model[i].next_unit_of_time = floor(model[i].tt) + 1.0;
+        model[i].U_it = 0;
+        model[i].V_it = 0;
+        model[i].error = 0;
+
+        /* Count the work of the solver */
+        model[i].n_transitions = 0.0;
+        model[i].n_rates = 0.0;
+        model[i].n_events_E1 = 0.0;
+        model[i].n_events_E2 = 0.0;
+
+        /* The global data can differ between replicates. */
+        model[i].gdata = args->gdata;
+
+        /* Data vectors */
+        if (args->U) {
+            model[i].U = args->U;
+        } else if (args->U16) {
+            model[i].U16 = args->U16;
+        } else {
+            model[i].irU = args->irU;
+            model[i].jcU = args->jcU;
+            model[i].prU = args->prU;
+        }
+
+        if (args->V) {
+            model[i].V = args->V;
+        } else if (args->V32) {
+            model[i].V32 = args->V32;
+        } else {
+            model[i].irV = args->irV;
+            model[i].jcV = args->jcV;
+            model[i].prV = args->prV;
+        }
+    }
+
+    /* Output file and reducers of the solution. */
+    model[0].file = args->file;
+    model[0].Ngroup = args->Ngroup;
+    model[0].group = args->group;
+    model[0].sum_U = args->sum_U;
+    model[0].sum_V = args->sum_V;
+    if (args->sum_U)
+        memset(args->sum_U, 0, (size_t)args->Ngroup * args->Nc *
+               args->tlen * sizeof(double));
+    if (args->sum_V)
+        memset(args->sum_V, 0, (size_t)args->Ngroup * args->Nd *
+               args->tlen * sizeof(double));
+
+    model[0].Nfirst = args->Nfirst;
+    model[0].first_select = args->first_select;
+    model[0].first = args->first;
+    if (args->first) {
+        for (i = 0; i < args->Nn; i++)
+            args->first[i] = NA_REAL;
+    }
+
+    model[0].Ncases = args->Ncases;
+    model[0].cases = args->cases;
+    model[0].Npopulation = args->Npopulation;
+    model[0].population = args->population;
+    model[0].prevalence = args->prevalence;
+}
+
+/**
+ * Setup the seed, the initial state and the output of replicate r to
+ * simulate.
+ *
+ * @param args structure with data for the solver.
+ * @param r the index of the replicate.
+ */
+void attribute_hidden
+SimInf_solver_args_replicate(
+    SimInf_solver_args *args,
+    int r)
+{
+    if (r < args->Nrep) {
+        args->seed = args->seed_rep[r];
+        if (args->u0_rep) {
+            args->u0 = args->u0_rep[r];
+            args->v0 = args->v0_rep[r];
+        }
+        if (args->gdata_rep)
+            args->gdata = args->gdata_rep[r];
+        args->U = args->U_rep[r];
+        args->V = args->V_rep[r];
+        args->prU = args->prU_rep[r];
+        args->prV = args->prV_rep[r];
+        args->sum_U = args->sum_U_rep[r];
+        args->sum_V = args->sum_V_rep[r];
+        args->first = args->first_rep[r];
+        args->prevalence = args->prevalence_rep[r];
+    }
+}
+
 /**
  * Print node status/information to facilitate debugging.
  *
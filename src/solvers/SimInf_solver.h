@@ -24,11 +24,20 @@
 #ifndef INCLUDE_SIMINF_SOLVER_H
 #define INCLUDE_SIMINF_SOLVER_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <gsl/gsl_rng.h>
 
 #include "misc/kvec.h"
+#include "misc/SimInf_checkpoint.h"
+#include "misc/SimInf_profile.h"
 #include "SimInf.h"
 
+/* The number of nodes in a block in step (4) of the solvers, where
+ * the post time step function is called for all nodes in the block
+ * before the transition rates are updated. */
+#define SIMINF_NODES_BLOCK 64
+
 /* Structure to hold data/arguments to a SimInf solver.
  *
  * G is a sparse matrix dependency graph (Nt X Nt) in compressed
@@ -82,6 +91,11 @@ typedef struct SimInf_solver_args
      * contains the state of the system at tspan(j). */
     int *U;
 
+    /* If U16 is non-NULL, the solution is written to a compact dense
+     * matrix, with the same layout as U, where each value is stored
+     * as a 16-bit unsigned integer. */
+    uint16_t *U16;
+
     /* If U is NULL, the solution is written to a sparse matrix
      * U_sparse. irU[k] is the row of U_sparse[k]. */
     const int *irU;
@@ -100,6 +114,11 @@ typedef struct SimInf_solver_args
      * system at tspan(j). */
     double *V;
 
+    /* If V32 is non-NULL, the solution is written to a compact dense
+     * matrix, with the same layout as V, where each value is stored
+     * as a single precision floating point number. */
+    float *V32;
+
     /* If V is NULL, the solution is written to a sparse matrix
      * V_sparse. irV[k] is the row of V_sparse[k]. */
     const int *irV;
@@ -112,10 +131,55 @@ typedef struct SimInf_solver_args
      * V_sparse. Value of item (i, j) in V_sparse. */
     double *prV;
 
+    /* If file is non-NULL, the solution is written to the file
+     * instead of U and V. The state of the system at tspan(j) is
+     * written as the column U(:,j) followed by the column V(:,j). */
+    FILE *file;
+
+    /* If Ngroup > 0, the solution is reduced to the sum over the
+     * nodes in each group at each time in tspan. group[node] is the
+     * zero-based group of the node. The output is the matrices sum_U
+     * ((Ngroup * Nc) X length(tspan)) and sum_V ((Ngroup * Nd) X
+     * length(tspan)). */
+    int Ngroup;
+    const int *group;
+    double *sum_U;
+    double *sum_V;
+
+    /* If Nfirst > 0, the solution is reduced to the first time in
+     * tspan when there are individuals in any of the Nfirst
+     * zero-based compartments in first_select. The output is the
+     * vector first of length Nn, which is NA for a node without
+     * individuals in the compartments. */
+    int Nfirst;
+    const int *first_select;
+    double *first;
+
+    /* If Ncases > 0, the solution is reduced to the prevalence of the
+     * Ncases zero-based compartments in cases among the individuals
+     * in the Npopulation zero-based compartments in population, at
+     * each time in tspan. The output is the matrix prevalence (2 X
+     * length(tspan)) with the proportion of cases in the population
+     * in the first row and the proportion of nodes with cases among
+     * the nodes with individuals in the second row. */
+    int Ncases;
+    const int *cases;
+    int Npopulation;
+    const int *population;
+    double *prevalence;
+
     /* Double matrix (Nld X Nn). Generalized data matrix, data(:,j)
      * gives a local data vector for node #j. */
     const double *ldata;
 
+    /* Sparse matrix (Nn X Nn) with the neighbors of each node, or
+     * NULL if the model has no neighbors. irN[k] is the neighbor of
+     * N[k], jcN[j] is the index to the first neighbor of node j and
+     * prN[k] is the value of N[k]. */
+    const int *irN;
+    const int *jcN;
+    const double *prN;
+
     /* The global data vector. */
     const double *gdata;
 
@@ -146,9 +210,21 @@ typedef struct SimInf_solver_args
     /* Select matrix for events. Value of item (i, j) in E. */
     double *prE;
 
+    /* Number of columns in the select matrix E. */
+    int Nselect;
+
     /* Shift matrix for internal and external transfer events. */
     const int *N;
 
+    /* Number of columns in the shift matrix N. */
+    int Nshift;
+
+    /* If events_file is non-NULL, the scheduled events are read from
+     * the file during the simulation, one block of events at a time,
+     * instead of from the vectors below. The position of the file
+     * must be after the header. */
+    FILE *events_file;
+
     /* Number of events. */
     int len;
 
@@ -181,18 +257,104 @@ typedef struct SimInf_solver_args
      * internal and external transfer event. */
     const int *shift;
 
-    /* Number of threads to use during simulation. */
+    /* Number of threads to use during simulation, i.e., the number
+     * of partitions of the nodes with thread specific data. If there
+     * are more partitions than threads in the parallel region, the
+     * partitions are distributed dynamically among the threads. */
     int Nthread;
 
     /* Random number seed. */
     unsigned long int seed;
 
+    /* If non-zero, the external transfer events are split into
+     * conflict-free batches that are processed in parallel. */
+    int E2_parallel;
+
+    /* If non-zero, use a counter-based random number stream for
+     * each node that is keyed by the seed and the node, such that
+     * the trajectory does not depend on the number of threads. */
+    int philox;
+
+    /* If non-zero, the ssm solver keeps the transition rates of each
+     * node in a binary sum tree, such that a transition is selected,
+     * and a rate is updated, in O(log(Nt)) instead of O(Nt). */
+    int tree_select;
+
+    /* If non-zero, the ssm solver accumulates the updates of the sum
+     * of the transition rates in each node with compensated (Kahan)
+     * summation, and recomputes the sum from the rates after every
+     * unit of time. */
+    int compensated;
+
+    /* The error control parameter of the tau-leaping solver, i.e.,
+     * the largest relative change of the state of a compartment in a
+     * node that is accepted during a leap. */
+    double tleap_epsilon;
+
+    /* If non-NULL, the state of the solver at the end of the
+     * simulation is saved to the checkpoint. */
+    SimInf_checkpoint *checkpoint;
+
+    /* If non-NULL, the simulation is resumed from the state of the
+     * solver in the checkpoint, instead of from u0 and v0 at
+     * tspan[0]. The number of partitions and the random number
+     * generator must be the same as when the state was saved. */
+    SimInf_checkpoint *resume;
+
+    /* If non-NULL, the time of each phase of the time steps and the
+     * work of the solver are recorded in the profile. */
+    SimInf_profile *profile;
+
+    /* Number of replicates to simulate with the same data structures
+     * of the solver, or 0 to simulate a single trajectory. Before
+     * replicate r is simulated, seed_rep[r], the initial state, the
+     * global data and the output of replicate r are copied to seed,
+     * the initial state, the global data and the output, e.g.,
+     * U_rep[r] to U. */
+    int Nrep;
+
+    /* Random number seed of each replicate. */
+    const unsigned long int *seed_rep;
+
+    /* Initial state of each replicate, or NULL to start every
+     * replicate from u0 and v0. */
+    const int **u0_rep;
+    const double **v0_rep;
+
+    /* Global data of each replicate, or NULL to use gdata in every
+     * replicate. */
+    const double **gdata_rep;
+
+    /* Output of each replicate, see U, V, prU, prV, sum_U, sum_V,
+     * first and prevalence. */
+    int **U_rep;
+    double **V_rep;
+    double **prU_rep;
+    double **prV_rep;
+    double **sum_U_rep;
+    double **sum_V_rep;
+    double **first_rep;
+    double **prevalence_rep;
+
     /* Vector of function pointers to transition rate functions. */
     TRFun *tr_fun;
 
+    /* Function pointer to compute the rates of several transitions in
+     * a node with one call, or NULL to use tr_fun. */
+    TRRatesFun rates_fun;
+
+    /* Function pointer to compute the rates of all transitions in
+     * many nodes with one call, or NULL. */
+    TRNodesFun nodes_fun;
+
     /* Function pointer to callback after each time step e.g. to
      * update the infectious pressure. */
     PTSFun pts_fun;
+
+    /* Function pointer to callback after each time step that
+     * receives the neighbors of the nodes, used instead of pts_fun
+     * if non-NULL. */
+    PTSNeighborsFun pts_neighbors_fun;
 } SimInf_solver_args;
 
 /**
@@ -238,18 +400,71 @@ typedef struct SimInf_scheduled_events
                            *   (i, j) in E. */
     const int *N;         /**< Shift matrix for internal and external
                            *   transfer events. */
+    int *equal_prE;       /**< equal_prE[j] is non-zero if all
+                           *   weights in column j of E are equal.
+                           *   Shared by all threads and owned by
+                           *   element 0. */
+    double *cum_prE;       /**< Cumulative sum of the weights in each
+                            *   column of E, i.e., cum_prE[k] is the
+                            *   sum of prE[jcE[j]], ..., prE[k] for
+                            *   k in column j. Shared by all threads
+                            *   and owned by element 0. */
 
     /*** Scheduled events ***/
     SimInf_events_t events; /**< Events to process. */
     size_t events_index;    /**< Index to the next event to
                              *   process. */
 
+    /*** Scheduled events read from a file ***/
+    FILE *file;           /**< If non-NULL, the events are read from
+                           *   the file one block at a time when
+                           *   needed. Only used in element 0. */
+    int file_eof;         /**< Non-zero when all blocks of events
+                           *   have been read from the file. */
+    int file_time;        /**< The time of the last event that was
+                           *   read from the file. */
+    int Nn;               /**< Total number of nodes. */
+    int Nselect;          /**< Number of columns in the select
+                           *   matrix. */
+    int Nshift;           /**< Number of columns in the shift
+                           *   matrix. */
+
     /*** Vectors for sampling individuals ***/
     int *individuals;     /**< Vector to store the result of the
                            *   sampling during scheduled events
                            *   processing. */
     gsl_rng *rng;         /**< The random number generator for
                            *   sampling. */
+    gsl_rng **node_rng;   /**< The random number generator of each
+                           *   node in the global set of nodes, or
+                           *   NULL if rng is used for every node.
+                           *   Shared by all threads and owned by
+                           *   element 0. */
+
+    /*** External transfer events processed in parallel ***/
+    int E2_parallel;        /**< Process E2 events in parallel if
+                             *   non-zero. Only the events in
+                             *   element 0 are used. */
+    SimInf_events_t E2_events; /**< E2 events ordered by time and
+                                *   then by batch. Within a batch,
+                                *   no node is the source of more
+                                *   than one event, and no node is
+                                *   both a source and a destination,
+                                *   so the events can be processed
+                                *   in any order. */
+    kvec_t(size_t) E2_batch; /**< Index to the first event in each
+                              *   batch, followed by the total
+                              *   number of E2 events. */
+    size_t E2_batch_index;  /**< Index to the next batch to
+                             *   process. */
+    size_t E2_offset;       /**< Number of processed E2 events that
+                             *   have been removed from E2_events
+                             *   when reading events from a file. */
+    unsigned long int seed; /**< Seed to derive the random number
+                             *   stream for each E2 event. */
+    gsl_rng *E2_rng;        /**< The random number generator for
+                             *   sampling E2 events processed by
+                             *   the thread. */
 } SimInf_scheduled_events;
 
 /**
@@ -285,7 +500,15 @@ typedef struct SimInf_compartment_model
     /*** Callbacks ***/
     TRFun *tr_fun;  /**< Vector of function pointers to
                      *   transition rate functions */
+    TRRatesFun rates_fun; /**< If non-NULL, computes the rates of
+                           *   several transitions in a node. */
+    TRNodesFun nodes_fun; /**< If non-NULL, computes the rates of
+                           *   all transitions in many nodes. */
     PTSFun pts_fun; /**< Callback after each time step */
+    PTSNeighborsFun pts_neighbors_fun; /**< If non-NULL, callback
+                                        *   after each time step
+                                        *   with the neighbors,
+                                        *   instead of pts_fun. */
 
     /*** Keep track of time ***/
     double tt;           /**< The global time. */
@@ -307,6 +530,9 @@ typedef struct SimInf_compartment_model
                        *   ((Nn * Nc) X length(tspan)). U(:,j)
                        *   contains the state of the system at
                        *   tspan(j). */
+    uint16_t *U16;    /**< If the solution is written to a compact
+                       *   dense matrix, U with each value stored as a
+                       *   16-bit unsigned integer. */
     const int *irU;   /**< If the solution is written to a sparse
                        *   matrix, irU[k] is the row of U[k]. */
     const int *jcU;   /**< If the solution is written to a sparse
@@ -324,6 +550,9 @@ typedef struct SimInf_compartment_model
                        *   ((Nn * Nd) X length(tspan)). V(:,j)
                        *   contains the state of the system at
                        *   tspan(j). */
+    float *V32;       /**< If the solution is written to a compact
+                       *   dense matrix, V with each value stored as a
+                       *   single precision floating point number. */
     const int *irV;   /**< If the solution is written to a sparse
                        *   matrix, irV[k] is the row of V[k]. */
     const int *jcV;   /**< If the solution is written to a sparse
@@ -333,9 +562,47 @@ typedef struct SimInf_compartment_model
                        *   matrix, value of item (i, j) in V. */
     const double *ldata; /**< Matrix (Nld X Nn). ldata(:,j) gives a
                           *   local data vector for node #j. */
+    SimInf_neighbors neighbors; /**< The neighbors of each node
+                                 *   and the number of individuals
+                                 *   in each node. */
     const double *gdata; /**< The global data vector. */
+
+    /*** Output file and reducers of the solution. Only used in
+     *** element 0. ***/
+    FILE *file;          /**< If non-NULL, the solution is written to
+                          *   the file one column of U and V at a
+                          *   time. */
+    int Ngroup;          /**< Number of groups to sum the solution
+                          *   over, or 0. */
+    const int *group;    /**< Zero-based group of each node. */
+    double *sum_U;       /**< Matrix ((Ngroup * Nc) X tlen) with the
+                          *   compartment state summed over the nodes
+                          *   in each group. */
+    double *sum_V;       /**< Matrix ((Ngroup * Nd) X tlen) with the
+                          *   continuous state summed over the nodes
+                          *   in each group. */
+    int Nfirst;          /**< Number of compartments in
+                          *   first_select, or 0. */
+    const int *first_select; /**< Zero-based compartments to detect
+                              *   individuals in. */
+    double *first;       /**< The first time in tspan with individuals
+                          *   in first_select in each node, else
+                          *   NA. */
+    int Ncases;          /**< Number of compartments in cases, or
+                          *   0. */
+    const int *cases;    /**< Zero-based compartments of the cases. */
+    int Npopulation;     /**< Number of compartments in
+                          *   population. */
+    const int *population; /**< Zero-based compartments of the
+                            *   population. */
+    double *prevalence;  /**< Matrix (2 X tlen) with the population
+                          *   and the node prevalence. */
+
     int *update_node; /**< Vector of length Nn used to indicate nodes
                        *   for update. */
+    double *N;        /**< Vector of length Nn with the number of
+                       *   individuals in each node, counted before
+                       *   the post time step function is called. */
 
     double *sum_t_rate; /**< Vector of length Nn with the sum of
                          *   propensities in every node. */
@@ -343,27 +610,110 @@ typedef struct SimInf_compartment_model
                          *   propensities for state transitions. */
     double *t_time;     /**< Time for next event (transition) in each
                          *   node. */
+    double *t_rate_new; /**< Vector of length Nt * SIMINF_NODES_BLOCK
+                         *   with the new rates of the transitions
+                         *   that are recalculated in a node, or in a
+                         *   block of nodes in step (4). */
+    int *active;        /**< Vector of length Nn with the nodes that
+                         *   had a positive sum of propensities at
+                         *   the start of the time step. The first
+                         *   Nactive elements are used. */
+    int Nactive;        /**< Number of nodes in active. */
+    double *sum_t_rate_c; /**< If non-NULL, vector of length Nn with
+                           *   the compensation of the compensated
+                           *   summation of sum_t_rate. */
+    int Ntree;          /**< Number of leaves in the sum tree of each
+                         *   node, i.e., Nt rounded up to a power of
+                         *   two, or 0 if the sum tree is not used. */
+    double *t_tree;     /**< If Ntree > 0, a binary sum tree (2 *
+                         *   Ntree X Nn) of the transition rates in
+                         *   each node. t_tree[1] is the sum of the
+                         *   rates, the children of t_tree[k] are
+                         *   t_tree[2k] and t_tree[2k + 1], and the
+                         *   rate of transition j is t_tree[Ntree +
+                         *   j]. */
+    SimInf_profile *profile; /**< If non-NULL, the time of each
+                              *   phase is recorded in the profile.
+                              *   Shared by all threads. */
+    double n_transitions; /**< Number of transitions that fired in
+                           *   the partition. */
+    double n_rates;     /**< Number of evaluated transition rates in
+                         *   the partition. */
+    double n_events_E1; /**< Number of E1 events processed by the
+                         *   partition. */
+    double n_events_E2; /**< Number of E2 events processed by the
+                         *   partition, or by the thread with the
+                         *   same index if the E2 events are
+                         *   processed in parallel. */
     int error;          /**< The error state of the thread. 0 if
                          *   ok. */
 } SimInf_compartment_model;
 
+void SimInf_solver_args_replicate(SimInf_solver_args *args, int r);
+
 int SimInf_compartment_model_create(
     SimInf_compartment_model **out, SimInf_solver_args *args);
 
+void SimInf_compartment_model_reset(
+    SimInf_compartment_model *model, SimInf_solver_args *args);
+
 void SimInf_compartment_model_free(
     SimInf_compartment_model *model);
 
+void SimInf_compartment_model_profile(
+    const SimInf_compartment_model *model, SimInf_profile *profile);
+
+void SimInf_compartment_model_population(
+    SimInf_compartment_model *model);
+
+void SimInf_compartment_model_rates(
+    const SimInf_compartment_model *model, double *rate,
+    const int *tr, int n, int node, const double *v, double t);
+
+void SimInf_compartment_model_rates_nodes(
+    const SimInf_compartment_model *model, double *rate,
+    int node, int n, const double *v, double t);
+
+int SimInf_compartment_model_post_time_step(
+    SimInf_compartment_model *model, int node);
+
+const double *SimInf_compartment_model_rates_new(
+    SimInf_compartment_model *model, int node, int block);
+
 int SimInf_scheduled_events_create(
     SimInf_scheduled_events **out, SimInf_solver_args *args, gsl_rng *rng);
 
+void SimInf_scheduled_events_reset(
+    SimInf_scheduled_events *events, SimInf_solver_args *args, gsl_rng *rng);
+
 void SimInf_scheduled_events_free(
     SimInf_scheduled_events *events);
 
+int SimInf_scheduled_events_read(
+    SimInf_scheduled_events *events, double tt);
+
+int SimInf_events_file_header(FILE *file);
+
+int SimInf_checkpoint_partitions(
+    const SimInf_checkpoint *cp, int *Nthread, int *philox);
+
+int SimInf_solver_checkpoint(
+    SimInf_checkpoint *cp, const char *solver,
+    SimInf_compartment_model *model,
+    SimInf_scheduled_events *events,
+    SimInf_solver_args *args);
+
 void SimInf_process_events(
     SimInf_compartment_model *model,
     SimInf_scheduled_events *events,
     int process_E2);
 
+void SimInf_process_E2_events(
+    SimInf_compartment_model *model,
+    SimInf_scheduled_events *events);
+
+int SimInf_store_solution_dense_partition(SimInf_compartment_model *m);
+void SimInf_store_solution_sparse_partition(SimInf_compartment_model *m);
 void SimInf_store_solution_sparse(SimInf_compartment_model *model);
 
 void SimInf_print_status(
@@ -30,8 +30,10 @@
 
 #include "SimInf.h"
 #include "misc/SimInf_openmp.h"
+#include "misc/SimInf_local_spread.h"
 #include "SimInf_solver_aem.h"
-#include "misc/binheap.h"
+#include "misc/SimInf_dheap.h"
+#include "misc/SimInf_philox.h"
 
 /**
  * Structure to hold AEM solver specific data/arguments for simulation.
@@ -40,11 +42,12 @@ typedef struct SimInf_aem_arguments
 {
     gsl_rng **rng_vec;   /**< The random number generator. */
 
-    int *reactHeap;      /**< Binary heap storing all reaction events */
-    int *reactNode;
-    double *reactTimes;
+    SimInf_dheap_entry *reactHeap; /**< Heap of the next time of
+                                    *   every transition in each
+                                    *   node. */
+    int *reactPos;       /**< The position of each transition in the
+                          *   heap of the node. */
     double *reactInf;
-    int reactHeapSize;
 
 } SimInf_aem_arguments;
 
@@ -95,8 +98,10 @@ SimInf_solver_aem(
     SimInf_compartment_model *model,
     SimInf_aem_arguments *method,
     SimInf_scheduled_events *events,
-    int Nthread)
+    int Nthread,
+    int resume)
 {
+    SimInf_profile *profile = model->profile;
     int k;
 
     #ifdef _OPENMP
@@ -105,8 +110,10 @@ SimInf_solver_aem(
     {
         int i;
 
+        SimInf_set_schedule();
+
         #ifdef _OPENMP
-        #  pragma omp for
+        #  pragma omp for schedule(runtime)
         #endif
         for (i = 0; i < Nthread; i++) {
             int node;
@@ -114,18 +121,21 @@ SimInf_solver_aem(
             SimInf_aem_arguments ma = *&method[i];
 
             /* Initialize the transition rate for every transition and
-             * every node. */
+             * every node. The transition rates and the heaps are
+             * restored instead if the simulation is resumed from a
+             * checkpoint. */
+            if (resume)
+                continue;
 
 	    /* Calculate the propensity for every reaction*/
+            SimInf_compartment_model_rates_nodes(
+                &sa, sa.t_rate, 0, sa.Nn, sa.v, sa.tt);
+            sa.n_rates += (double)sa.Nn * sa.Nt;
 	    for (node = 0; node < sa.Nn; node++) {
                 int j;
+
                 for (j = 0; j < sa.Nt; j++){
-                    const double rate = (*sa.tr_fun[j])(&sa.u[node * sa.Nc],
-                                                        &sa.v[node * sa.Nd],
-                                                        &sa.ldata[node * sa.Nld],
-                                                        sa.gdata,
-                                                        sa.tt);
-                    sa.t_rate[node * sa.Nt + j] = rate;
+                    const double rate = sa.t_rate[node * sa.Nt + j];
 
                     if (!R_FINITE(rate) || rate < 0.0) {
                         SimInf_print_status(sa.Nc, &sa.u[node * sa.Nc],
@@ -136,16 +146,16 @@ SimInf_solver_aem(
                     }
 
                     /* calculate time until next transition j event */
-                    ma.reactTimes[sa.Nt*node+j] =  -log(gsl_rng_uniform_pos(ma.rng_vec[sa.Nt*node+j]))/rate + sa.tt;
-                    if (ma.reactTimes[sa.Nt*node+j] <= 0.0)
-                        ma.reactTimes[sa.Nt*node+j] = INFINITY;
+                    ma.reactHeap[sa.Nt*node+j].time =  -log(gsl_rng_uniform_pos(ma.rng_vec[sa.Nt*node+j]))/rate + sa.tt;
+                    if (ma.reactHeap[sa.Nt*node+j].time <= 0.0)
+                        ma.reactHeap[sa.Nt*node+j].time = INFINITY;
 
-                    ma.reactHeap[sa.Nt*node+j] = ma.reactNode[sa.Nt*node+j] = j;
+                    ma.reactHeap[sa.Nt*node+j].index = j;
                 }
 
                 /* Initialize reaction heap */
-                initialize_heap(&ma.reactTimes[sa.Nt*node], &ma.reactNode[sa.Nt*node],
-                                &ma.reactHeap[sa.Nt*node], ma.reactHeapSize);
+                SimInf_dheap_init(&ma.reactHeap[sa.Nt*node],
+                                  &ma.reactPos[sa.Nt*node], sa.Nt);
                 sa.t_time[node] = sa.tt;
 	    }
 
@@ -161,29 +171,40 @@ SimInf_solver_aem(
 
     /* Main loop. */
     for (;;) {
+        /* Read the scheduled events up to the global time if the
+         * events are read from a file. */
+        int error = SimInf_scheduled_events_read(events, model[0].tt);
+        if (error)
+            return error;
+
         #ifdef _OPENMP
         #  pragma omp parallel num_threads(SimInf_num_threads())
         #endif
         {
             int i;
+            double t0;
+
+            SimInf_set_schedule();
 
             #ifdef _OPENMP
-            #  pragma omp for
+            #  pragma omp for schedule(runtime)
             #endif
             for (i = 0; i < Nthread; i++) {
                 int node;
                 SimInf_compartment_model sa = *&model[i];
                 SimInf_aem_arguments ma = *&method[i];
 
+                t0 = SimInf_profile_start(profile);
+
                 /* (1) Handle internal epidemiological model,
                  * continuous-time Markov chain. */
                 for (node = 0; node < sa.Nn && !sa.error; node++) {
                     for (;;) {
-                        int ii,j,tr;
-                        double old_t_rate,rate;
+                        int ii,j,tr,tr_in_G = 0;
+                        double old_t_rate,rate,rate_tr = 0.0;
 
                         /* 1a) Step time forward until next event */
-                        sa.t_time[node] = ma.reactTimes[sa.Nt * node];
+                        sa.t_time[node] = ma.reactHeap[sa.Nt * node].time;
 
                         /* Break if time is past next unit of time */
                         if (isinf(sa.t_time[node]) || sa.t_time[node] >= sa.next_unit_of_time) {
@@ -192,9 +213,10 @@ SimInf_solver_aem(
                         }
 
                         /* 1b) Determine which transitions that occur */
-                        tr = ma.reactNode[sa.Nt * node]%sa.Nt;
+                        tr = ma.reactHeap[sa.Nt * node].index;
 
                         /* 1c) Update the state of the node */
+                        sa.n_transitions++;
                         for (j = sa.jcS[tr]; j < sa.jcS[tr + 1]; j++) {
                             sa.u[node * sa.Nc + sa.irS[j]] += sa.prS[j];
                             if (sa.u[node * sa.Nc + sa.irS[j]] < 0) {
@@ -209,15 +231,19 @@ SimInf_solver_aem(
 
 
                         /* 1d) update dependent transitions events. */
+                        SimInf_compartment_model_rates(
+                            &sa, sa.t_rate_new, &sa.irG[sa.jcG[tr]],
+                            sa.jcG[tr + 1] - sa.jcG[tr], node, sa.v,
+                            sa.t_time[node]);
+                        sa.n_rates += sa.jcG[tr + 1] - sa.jcG[tr];
                         for (ii = sa.jcG[tr]; ii < sa.jcG[tr + 1]; ii++){
                             j = sa.irG[ii];
-                            if (j != tr) { /*see code underneath */
+                            if (j == tr) { /*see code underneath */
+                                rate_tr = sa.t_rate_new[ii - sa.jcG[tr]];
+                                tr_in_G = 1;
+                            } else {
                                 old_t_rate = sa.t_rate[node * sa.Nt + j];
-                                /* const double rate */
-                                rate = (*sa.tr_fun[j])(
-                                    &sa.u[node * sa.Nc], &sa.v[node * sa.Nd],
-                                    &sa.ldata[node * sa.Nld], sa.gdata,
-                                    sa.t_time[node]);
+                                rate = sa.t_rate_new[ii - sa.jcG[tr]];
 
                                 sa.t_rate[node * sa.Nt + j] = rate;
 
@@ -231,23 +257,28 @@ SimInf_solver_aem(
                                 }
 
                                 /* update times and reorder the heap */
-                                calcTimes(&ma.reactTimes[sa.Nt * node + ma.reactHeap[sa.Nt * node + j]],
+                                calcTimes(&ma.reactHeap[sa.Nt * node + ma.reactPos[sa.Nt * node + j]].time,
                                           &ma.reactInf[sa.Nt * node + j],
                                           sa.t_time[node],
                                           old_t_rate,
                                           sa.t_rate[node * sa.Nt + j],
                                           ma.rng_vec[sa.Nt * node + j]);
-                                update(ma.reactHeap[sa.Nt * node + j], &ma.reactTimes[sa.Nt * node],
-                                       &ma.reactNode[sa.Nt * node], &ma.reactHeap[sa.Nt * node], ma.reactHeapSize);
+                                SimInf_dheap_update(&ma.reactHeap[sa.Nt * node],
+                                       &ma.reactPos[sa.Nt * node],
+                                       sa.Nt, ma.reactPos[sa.Nt * node + j]);
                             }
                         }
                         /* finish with j = re (the one that just happened), which need
                            not be in the dependency graph but must be updated  nevertheless */
                         j = tr;
                         old_t_rate = sa.t_rate[node * sa.Nt + j];
-                        rate = (*sa.tr_fun[j])(&sa.u[node * sa.Nc], &sa.v[node * sa.Nd],
-                                               &sa.ldata[node * sa.Nld], sa.gdata,
-                                               sa.t_time[node]);
+                        if (!tr_in_G) {
+                            SimInf_compartment_model_rates(
+                                &sa, &rate_tr, &tr, 1, node, sa.v,
+                                sa.t_time[node]);
+                            sa.n_rates++;
+                        }
+                        rate = rate_tr;
                         sa.t_rate[node * sa.Nt + j] = rate;
 
                         if (!R_FINITE(rate) || rate < 0.0) {
@@ -260,70 +291,93 @@ SimInf_solver_aem(
                         }
 
                         /* update times and reorder the heap */
-                        calcTimes(&ma.reactTimes[sa.Nt * node + ma.reactHeap[sa.Nt * node + j]],
+                        calcTimes(&ma.reactHeap[sa.Nt * node + ma.reactPos[sa.Nt * node + j]].time,
                                   &ma.reactInf[sa.Nt * node + j],
                                   sa.t_time[node],
                                   old_t_rate,
                                   sa.t_rate[node * sa.Nt + j],
                                   ma.rng_vec[sa.Nt * node + j]);
-                        update(ma.reactHeap[sa.Nt * node + j], &ma.reactTimes[sa.Nt * node],
-                               &ma.reactNode[sa.Nt * node], &ma.reactHeap[sa.Nt * node], ma.reactHeapSize);
+                        SimInf_dheap_update(&ma.reactHeap[sa.Nt * node],
+                               &ma.reactPos[sa.Nt * node],
+                               sa.Nt, ma.reactPos[sa.Nt * node + j]);
 
                     }
                 }
 
                 *&model[i] = sa;
                 *&method[i] = ma;
+                SimInf_profile_stop(profile, SIMINF_PROFILE_TRANSITIONS, &t0);
 
                 /* (2) Incorporate all scheduled E1 events */
                 SimInf_process_events(&model[i], &events[i], 0);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_E1, &t0);
 	    }
 
             #ifdef _OPENMP
             #  pragma omp barrier
             #endif
 
+            /* (3) Incorporate all scheduled E2 events */
+            t0 = SimInf_profile_start(profile);
+            SimInf_process_E2_events(model, events);
+            SimInf_profile_stop(profile, SIMINF_PROFILE_E2, &t0);
+
             #ifdef _OPENMP
-            #  pragma omp master
+            #  pragma omp barrier
             #endif
-            {
-                /* (3) Incorporate all scheduled E2 events */
-                SimInf_process_events(model, events, 1);
-            }
 
+            /* Count the number of individuals in every node before
+             * the post time step function is called, so that the
+             * local spread does not recount the neighbors. */
             #ifdef _OPENMP
-            #  pragma omp barrier
+            #  pragma omp for schedule(runtime)
             #endif
+            for (i = 0; i < Nthread; i++) {
+                t0 = SimInf_profile_start(profile);
+                SimInf_compartment_model_population(&model[i]);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_POST_TIME_STEP, &t0);
+            }
 
             #ifdef _OPENMP
-            #  pragma omp for
+            #  pragma omp for schedule(runtime)
             #endif
             for (i = 0; i < Nthread; i++) {
                 int node;
                 SimInf_compartment_model sa = *&model[i];
                 SimInf_aem_arguments ma = *&method[i];
 
+                t0 = SimInf_profile_start(profile);
+
                 /* (4) Incorporate model specific actions after each
                  * timestep e.g. update the infectious pressure
                  * variable. Moreover, update transition rates in
-                 * nodes that are indicated for update */
+                 * nodes that are indicated for update. The post time
+                 * step function is called for a block of nodes at a
+                 * time, before the rates in the block are updated. */
+                SimInf_local_spread_context(model[0].u, model[0].N, sa.Nc);
                 for (node = 0; node < sa.Nn; node++) {
-                    const int rc = sa.pts_fun(
-                        &sa.v_new[node * sa.Nd], &sa.u[node * sa.Nc],
-                        &sa.v[node * sa.Nd], &sa.ldata[node * sa.Nld],
-                        sa.gdata, sa.Ni + node, sa.tt);
-
-                    if (rc < 0) {
-                        sa.error = rc;
-                        break;
-                    } else if (rc > 0 || sa.update_node[node]) {
+                    const int block = node - node % SIMINF_NODES_BLOCK;
+
+                    if (node == block) {
+                        const int rc =
+                            SimInf_compartment_model_post_time_step(&sa, node);
+
+                        if (rc < 0) {
+                            sa.error = rc;
+                            break;
+                        }
+                    }
+
+                    if (sa.update_node[node]) {
                         /* Update transition rates */
                         int j = 0;
+                        const double *t_rate_new =
+                            SimInf_compartment_model_rates_new(&sa, node, block);
+
+                        sa.n_rates += sa.Nt;
                         for (; j < sa.Nt; j++) {
                             const double old = sa.t_rate[node * sa.Nt + j];
-                            const double rate = (*sa.tr_fun[j])(
-                                &sa.u[node * sa.Nc], &sa.v_new[node * sa.Nd],
-                                &sa.ldata[node * sa.Nld], sa.gdata, sa.tt);
+                            const double rate = t_rate_new[j];
 
                             sa.t_rate[node * sa.Nt + j] = rate;
 
@@ -336,21 +390,25 @@ SimInf_solver_aem(
                             }
 
 			    /* Update times and reorder heap */
-			    calcTimes(&ma.reactTimes[sa.Nt * node + ma.reactHeap[sa.Nt * node + j]],
+			    calcTimes(&ma.reactHeap[sa.Nt * node + ma.reactPos[sa.Nt * node + j]].time,
 				      &ma.reactInf[sa.Nt * node + j],
 				      sa.t_time[node],
 				      old,
 				      sa.t_rate[node * sa.Nt + j],
 				      ma.rng_vec[sa.Nt * node + j]);
 
-			    update(ma.reactHeap[sa.Nt * node + j], &ma.reactTimes[sa.Nt * node],
-                                   &ma.reactNode[sa.Nt * node], &ma.reactHeap[sa.Nt * node], ma.reactHeapSize);
+			    SimInf_dheap_update(&ma.reactHeap[sa.Nt * node],
+                                   &ma.reactPos[sa.Nt * node],
+                                   sa.Nt, ma.reactPos[sa.Nt * node + j]);
                         }
 
                         sa.update_node[node] = 0;
                     }
                 }
 
+                SimInf_local_spread_context(NULL, NULL, 0);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_POST_TIME_STEP, &t0);
+
                 /* (5) The global time now equals next unit of time. */
                 sa.tt = sa.next_unit_of_time;
                 sa.next_unit_of_time += 1.0;
@@ -358,29 +416,39 @@ SimInf_solver_aem(
                 /* (6) Store solution if tt has passed the next time
                  * in tspan. Report solution up to, but not including
                  * tt. The default is to store the solution in a dense
-                 * matrix (U and/or V non-null pointers) (6a).
+                 * matrix (U and/or V, or their compact versions U16
+                 * and/or V32, non-null pointers) (6a).
                  * However, it is possible to store the solution in a
-                 * sparse matrix. In that case, the solution is stored
-                 * outside the 'pragma omp parallel' statement (6b). */
+                 * sparse matrix (6b). In that case, each partition
+                 * copies the state of its nodes, and the reducers of
+                 * the solution are applied outside the 'pragma omp
+                 * parallel' statement (6c). */
                 /* 6a) Handle the case where the solution is stored in
                  * a dense matrix */
-                /* Copy compartment state to U */
-                while (sa.U && sa.U_it < sa.tlen && sa.tt > sa.tspan[sa.U_it])
-                    memcpy(&sa.U[sa.Nc * ((sa.Ntot * sa.U_it++) + sa.Ni)],
-                           sa.u, sa.Nn * sa.Nc * sizeof(int));
-                /* Copy continuous state to V */
-                while (sa.V && sa.V_it < sa.tlen && sa.tt > sa.tspan[sa.V_it])
-                    memcpy(&sa.V[sa.Nd * ((sa.Ntot * sa.V_it++) + sa.Ni)],
-                           sa.v_new, sa.Nn * sa.Nd * sizeof(double));
+                /* Copy compartment state to U and continuous state
+                 * to V */
+                if (!sa.error)
+                    sa.error = SimInf_store_solution_dense_partition(&sa);
+
+                /* 6b) Handle the case where the solution is stored in
+                 * a sparse matrix */
+                SimInf_store_solution_sparse_partition(&sa);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_STORE, &t0);
 
                 *&model[i] = sa;
                 *&method[i] = ma;
             }
         }
 
-        /* 6b) Handle the case where the solution is stored in a sparse
-         * matrix */
-        SimInf_store_solution_sparse(model);
+        /* 6c) Advance the time index of the sparse solution, and
+         * handle the case where the solution is written to a file or
+         * reduced */
+        {
+            double t0 = SimInf_profile_start(profile);
+            SimInf_store_solution_sparse(model);
+            SimInf_profile_stop(profile, SIMINF_PROFILE_STORE, &t0);
+            SimInf_profile_step(profile);
+        }
 
         /* Swap the pointers to the continuous state variable so that
          * 'v' equals 'v_new'. Moreover, check for error. */
@@ -431,25 +499,124 @@ SimInf_aem_arguments_free(
                 m->rng_vec = NULL;
                 free(m->reactHeap);
                 m->reactHeap = NULL;
+                free(m->reactPos);
+                m->reactPos = NULL;
                 free(m->reactInf);
                 m->reactInf = NULL;
-                free(m->reactNode);
-                m->reactNode = NULL;
-                free(m->reactTimes);
-                m->reactTimes = NULL;
             }
         }
         free(method);
     }
 }
 
+/**
+ * Reset the AEM solver specific data to simulate a new trajectory.
+ * The random number generators are seeded from rng and the seed in
+ * args.
+ *
+ * @param method the data structure to reset
+ * @param model structure with data about the model
+ * @param args structure with data for the solver.
+ * @param rng random number generator.
+ */
+static void
+SimInf_aem_arguments_reset(
+    SimInf_aem_arguments *method,
+    SimInf_compartment_model *model,
+    SimInf_solver_args *args,
+    gsl_rng *rng)
+{
+    int i;
+
+    for (i = 0; i < args->Nthread; i++) {
+        int node;
+        SimInf_compartment_model *m = &model[i];
+
+        memset(method[i].reactInf, 0, m->Nn * m->Nt * sizeof(double));
+
+        for (node = 0; node < m->Nn; node++) {
+            int trans;
+            for (trans = 0; trans < m->Nt; trans++) {
+                if (args->philox) {
+                    /* Use the streams after the streams of the nodes
+                     * that are used to process the scheduled
+                     * events. */
+                    const uint64_t stream = (uint64_t)m->Ntot +
+                        ((uint64_t)(m->Ni + node) * m->Nt + trans);
+
+                    SimInf_philox_set(method[i].rng_vec[m->Nt * node + trans],
+                                      args->seed, stream);
+                } else {
+                    gsl_rng_set(method[i].rng_vec[m->Nt * node + trans],
+                                gsl_rng_uniform_int(rng, gsl_rng_max(rng)));
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Save or restore the state of the AEM solver in a checkpoint
+ *
+ * @param cp the checkpoint.
+ * @param method the AEM data for each partition.
+ * @param model the data for each partition of the model.
+ * @param Nthread number of partitions.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_aem_arguments_checkpoint(
+    SimInf_checkpoint *cp,
+    SimInf_aem_arguments *method,
+    SimInf_compartment_model *model,
+    int Nthread)
+{
+    int i;
+
+    for (i = 0; i < Nthread; i++) {
+        const size_t n = (size_t)model[i].Nn * model[i].Nt;
+        size_t j;
+        int error;
+
+        for (j = 0; j < n; j++) {
+            error = SimInf_checkpoint_rng(cp, method[i].rng_vec[j]);
+            if (error)
+                return error;
+        }
+
+        error = SimInf_checkpoint_data(
+            cp, method[i].reactHeap, n * sizeof(SimInf_dheap_entry));
+        if (!error)
+            error = SimInf_checkpoint_data(
+                cp, method[i].reactPos, n * sizeof(int));
+        if (!error)
+            error = SimInf_checkpoint_data(
+                cp, method[i].reactInf, n * sizeof(double));
+        if (error)
+            return error;
+
+        /* The position of every transition in the heap of a node
+         * must be valid and the inverse of the heap. */
+        for (j = 0; cp->restore && j < n; j++) {
+            const size_t first = j - j % model[i].Nt;
+            const int pos = method[i].reactPos[j];
+
+            if (pos < 0 || pos >= model[i].Nt ||
+                (size_t)method[i].reactHeap[first + pos].index != j - first)
+                return SIMINF_ERR_INVALID_CHECKPOINT;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * Create and initialize data for an epidemiological compartment
  * model. The generated model must be freed by the user.
  *
  * @param out the resulting data structure.
  * @param model structure with data about the model
- * @param Nthread the number of threads available
+ * @param args structure with data for the solver.
  * @param rng random number generator.
  * @return 0 or SIMINF_ERR_ALLOC_MEMORY_BUFFER
  */
@@ -457,9 +624,10 @@ static int
 SimInf_aem_arguments_create(
     SimInf_aem_arguments **out,
     SimInf_compartment_model *model,
-    int Nthread,
+    SimInf_solver_args *args,
     gsl_rng *rng)
 {
+    int Nthread = args->Nthread;
     int i;
     SimInf_aem_arguments *method = NULL;
 
@@ -470,19 +638,15 @@ SimInf_aem_arguments_create(
     for (i = 0; i < Nthread; i++) {
         int node;
         SimInf_compartment_model *m = &model[i];
-        /* Binary heap storing all reaction events */
-        /* we have one for each node. Heap is thus only the size of the # transitions */
-        method[i].reactHeapSize = m->Nt;
-        method[i].reactNode = malloc(m->Nn * m->Nt * sizeof(int));
-        if (!method[i].reactNode)
-            goto on_error; /* #nocov */
-
-        method[i].reactHeap = malloc(m->Nn * m->Nt * sizeof(int));
+        /* Heap storing all reaction events, we have one for each
+         * node. The heap is thus only the size of the number of
+         * transitions. */
+        method[i].reactHeap = malloc(m->Nn * m->Nt * sizeof(SimInf_dheap_entry));
         if (!method[i].reactHeap)
             goto on_error; /* #nocov */
 
-        method[i].reactTimes = malloc(m->Nn * m->Nt * sizeof(double));
-        if (!method[i].reactTimes)
+        method[i].reactPos = malloc(m->Nn * m->Nt * sizeof(int));
+        if (!method[i].reactPos)
             goto on_error; /* #nocov */
 
         method[i].reactInf = calloc(m->Nn * m->Nt, sizeof(double));
@@ -498,16 +662,16 @@ SimInf_aem_arguments_create(
             int trans;
             for (trans = 0; trans < m->Nt; trans++) {
                 /* Random number generator */
-                method[i].rng_vec[m->Nt * node + trans] = gsl_rng_alloc(gsl_rng_mt19937);
+                method[i].rng_vec[m->Nt * node + trans] = gsl_rng_alloc(
+                    args->philox ? SimInf_rng_philox : gsl_rng_mt19937);
                 if (!method[i].rng_vec[m->Nt * node + trans])
                     goto on_error; /* #nocov */
-
-                gsl_rng_set(method[i].rng_vec[m->Nt * node + trans],
-                            gsl_rng_uniform_int(rng, gsl_rng_max(rng)));
             }
         }
     }
 
+    SimInf_aem_arguments_reset(method, model, args, rng);
+
     *out = method;
 
     return 0;
@@ -520,14 +684,16 @@ on_error:                                              /* #nocov */
 /**
  * Initialize and run siminf solver
  *
- * @param args Structure with data for the solver.
+ * @param args Structure with data for the solver. If args->Nrep > 0,
+ *        the data structures of the solver are created once and
+ *        reset for each replicate.
  * @return 0 if Ok, else error code.
  */
 int attribute_hidden
 SimInf_run_solver_aem(
     SimInf_solver_args *args)
 {
-    int error = 0;
+    int error = 0, r = 0;
     gsl_rng *rng = NULL;
     SimInf_scheduled_events *events = NULL;
     SimInf_compartment_model *model = NULL;
@@ -538,6 +704,7 @@ SimInf_run_solver_aem(
         error = SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
         goto cleanup;                           /* #nocov */
     }
+    SimInf_solver_args_replicate(args, r);
     gsl_rng_set(rng, args->seed);
 
     error = SimInf_compartment_model_create(&model, args);
@@ -548,11 +715,50 @@ SimInf_run_solver_aem(
     if (error)
         goto cleanup; /* #nocov */
 
-    error = SimInf_aem_arguments_create(&method, model, args->Nthread, rng);
+    error = SimInf_aem_arguments_create(&method, model, args, rng);
     if (error)
         goto cleanup; /* #nocov */
 
-    error = SimInf_solver_aem(model, method, events, args->Nthread);
+    /* Restore the state of the solver from the checkpoint. */
+    if (args->resume) {
+        error = SimInf_solver_checkpoint(args->resume, "aem", model,
+                                         events, args);
+        if (!error) {
+            error = SimInf_aem_arguments_checkpoint(
+                args->resume, method, model, args->Nthread);
+        }
+        if (!error && args->resume->pos != args->resume->size)
+            error = SIMINF_ERR_INVALID_CHECKPOINT;
+        if (error)
+            goto cleanup;
+    }
+
+    for (;;) {
+        error = SimInf_solver_aem(model, method, events, args->Nthread,
+                                  args->resume != NULL);
+        if (error || ++r >= args->Nrep)
+            break;
+
+        /* Reset the solver to simulate the next replicate. */
+        SimInf_solver_args_replicate(args, r);
+        gsl_rng_set(rng, args->seed);
+        SimInf_compartment_model_reset(model, args);
+        SimInf_scheduled_events_reset(events, args, rng);
+        SimInf_aem_arguments_reset(method, model, args, rng);
+    }
+
+    /* Add the work of the solver to the profile. */
+    SimInf_compartment_model_profile(model, args->profile);
+
+    /* Save the state of the solver at the end of the simulation. */
+    if (!error && args->checkpoint) {
+        error = SimInf_solver_checkpoint(args->checkpoint, "aem", model,
+                                         events, args);
+        if (!error) {
+            error = SimInf_aem_arguments_checkpoint(
+                args->checkpoint, method, model, args->Nthread);
+        }
+    }
 
 cleanup:
     gsl_rng_free(rng);
@@ -29,8 +29,125 @@
 
 #include "SimInf.h"
 #include "misc/SimInf_openmp.h"
+#include "misc/SimInf_local_spread.h"
 #include "SimInf_solver_ssm.h"
 
+/**
+ * Build the binary sum tree of the transition rates in a node.
+ *
+ * @param tree the sum tree (2 * Ntree) of the node.
+ * @param Ntree the number of leaves in the sum tree.
+ * @param rate the transition rates (Nt) of the node.
+ * @param Nt the number of transitions.
+ */
+static void
+SimInf_sum_tree_build(
+    double *tree,
+    int Ntree,
+    const double *rate,
+    int Nt)
+{
+    int k;
+
+    memcpy(&tree[Ntree], rate, Nt * sizeof(double));
+    for (k = Ntree - 1; k > 0; k--)
+        tree[k] = tree[2 * k] + tree[2 * k + 1];
+}
+
+/**
+ * Update the rate of transition j in the binary sum tree of a node.
+ * The sums are recomputed from the children, so the sum of the rates
+ * does not accumulate floating point errors.
+ *
+ * @param tree the sum tree (2 * Ntree) of the node.
+ * @param Ntree the number of leaves in the sum tree.
+ * @param j the transition.
+ * @param rate the new rate of the transition.
+ */
+static void
+SimInf_sum_tree_update(
+    double *tree,
+    int Ntree,
+    int j,
+    double rate)
+{
+    int k = Ntree + j;
+
+    tree[k] = rate;
+    for (k /= 2; k > 0; k /= 2)
+        tree[k] = tree[2 * k] + tree[2 * k + 1];
+}
+
+/**
+ * Select the transition in the binary sum tree of a node where the
+ * cumulative sum of the rates passes 'rand'. A subtree with zero sum
+ * is never selected.
+ *
+ * @param tree the sum tree (2 * Ntree) of the node.
+ * @param Ntree the number of leaves in the sum tree.
+ * @param rand a random number in (0, tree[1]].
+ * @return the selected transition.
+ */
+static int
+SimInf_sum_tree_select(
+    const double *tree,
+    int Ntree,
+    double rand)
+{
+    int k = 1;
+
+    while (k < Ntree) {
+        k *= 2;
+        if (rand > tree[k] && tree[k + 1] > 0.0) {
+            rand -= tree[k];
+            k++;
+        }
+    }
+
+    return k - Ntree;
+}
+
+/**
+ * Add x to the sum of the transition rates in a node with
+ * compensated (Kahan) summation.
+ *
+ * @param sum the sum of the transition rates.
+ * @param c the compensation of the summation.
+ * @param x the value to add.
+ */
+static void
+SimInf_sum_t_rate_add(
+    double *sum,
+    double *c,
+    double x)
+{
+    const double y = x - *c;
+    const double t = *sum + y;
+
+    *c = (t - *sum) - y;
+    *sum = t;
+}
+
+/**
+ * Recompute the sum of the transition rates in a node from the
+ * rates.
+ *
+ * @param rate the transition rates (Nt) of the node.
+ * @param Nt the number of transitions.
+ * @return the sum of the rates.
+ */
+static double
+SimInf_sum_t_rate(
+    const double *rate,
+    int Nt)
+{
+    double sum = 0.0;
+
+    for (int j = 0; j < Nt; j++)
+        sum += rate[j];
+    return sum;
+}
+
 /**
  * Siminf solver
  *
@@ -39,9 +156,11 @@
 static int
 SimInf_solver_ssm(
     SimInf_compartment_model *model,
-    SimInf_scheduled_events *events)
+    SimInf_scheduled_events *events,
+    int resume)
 {
     int Nthread = model->Nthread;
+    SimInf_profile *profile = model->profile;
     int k;
 
     #ifdef _OPENMP
@@ -50,8 +169,10 @@ SimInf_solver_ssm(
     {
         int i;
 
+        SimInf_set_schedule();
+
         #ifdef _OPENMP
-        #  pragma omp for
+        #  pragma omp for schedule(runtime)
         #endif
         for (i = 0; i < Nthread; i++) {
             int node;
@@ -60,30 +181,55 @@ SimInf_solver_ssm(
             /* Initialize the transition rate for every transition and
              * every node. Store the sum of the transition rates in
              * each node in sum_t_rate. Moreover, initialize time in
-             * each node. */
+             * each node. The transition rates and their sum are
+             * restored instead if the simulation is resumed from a
+             * checkpoint. */
+            if (!resume) {
+                SimInf_compartment_model_rates_nodes(
+                    &m, m.t_rate, 0, m.Nn, m.v, m.tt);
+                m.n_rates += (double)m.Nn * m.Nt;
+            }
             for (node = 0; node < m.Nn; node++) {
                 int j;
 
-                m.sum_t_rate[node] = 0.0;
-                for (j = 0; j < m.Nt; j++) {
-                    const double rate = (*m.tr_fun[j])(
-                            &m.u[node * m.Nc], &m.v[node * m.Nd],
-                            &m.ldata[node * m.Nld], m.gdata, m.tt);
-
-                    m.t_rate[node * m.Nt + j] = rate;
-                    m.sum_t_rate[node] += rate;
-                    if (!R_FINITE(rate) || rate < 0.0) {
-                        SimInf_print_status(m.Nc, &m.u[node * m.Nc],
-                                            m.Nd, &m.v[node * m.Nd],
-                                            m.Nld, &m.ldata[node * m.Nld],
-                                            m.Ni + node, m.tt, rate, j);
-                        m.error = SIMINF_ERR_INVALID_RATE;
+                if (!resume) {
+                    m.sum_t_rate[node] = 0.0;
+                    for (j = 0; j < m.Nt; j++) {
+                        const double rate = m.t_rate[node * m.Nt + j];
+
+                        m.sum_t_rate[node] += rate;
+                        if (!R_FINITE(rate) || rate < 0.0) {
+                            SimInf_print_status(m.Nc, &m.u[node * m.Nc],
+                                                m.Nd, &m.v[node * m.Nd],
+                                                m.Nld, &m.ldata[node * m.Nld],
+                                                m.Ni + node, m.tt, rate, j);
+                            m.error = SIMINF_ERR_INVALID_RATE;
+                        }
                     }
                 }
 
+                if (m.Ntree) {
+                    double *tree = &m.t_tree[2 * (size_t)m.Ntree * node];
+
+                    SimInf_sum_tree_build(tree, m.Ntree,
+                                          &m.t_rate[node * m.Nt], m.Nt);
+                    m.sum_t_rate[node] = tree[1];
+                }
+
+                if (m.sum_t_rate_c)
+                    m.sum_t_rate_c[node] = 0.0;
+
                 m.t_time[node] = m.tt;
             }
 
+            /* Initialize the nodes to process in the first time
+             * step. */
+            m.Nactive = 0;
+            for (node = 0; node < m.Nn; node++) {
+                if (m.sum_t_rate[node] > 0.0)
+                    m.active[m.Nactive++] = node;
+            }
+
             *&model[i] = m;
         }
     }
@@ -95,23 +241,44 @@ SimInf_solver_ssm(
 
     /* Main loop. */
     for (;;) {
+        /* Read the scheduled events up to the global time if the
+         * events are read from a file. */
+        int error = SimInf_scheduled_events_read(events, model[0].tt);
+        if (error)
+            return error;
+
         #ifdef _OPENMP
         #  pragma omp parallel num_threads(SimInf_num_threads())
         #endif
         {
             int i;
+            double t0;
+
+            SimInf_set_schedule();
 
             #ifdef _OPENMP
-            #  pragma omp for
+            #  pragma omp for schedule(runtime)
             #endif
             for (i = 0; i < Nthread; i++) {
-                int node;
+                int a;
                 SimInf_scheduled_events e = *&events[i];
                 SimInf_compartment_model m = *&model[i];
 
+                t0 = SimInf_profile_start(profile);
+
                 /* (1) Handle internal epidemiological model,
-                 * continuous-time Markov chain. */
-                for (node = 0; node < m.Nn && !m.error; node++) {
+                 * continuous-time Markov chain. Only the nodes with
+                 * a positive sum of the transition rates can have
+                 * an event, and the sum in a node that is not in the
+                 * active list can only change in step (4), so it is
+                 * sufficient to process the nodes in the list. The
+                 * time of a node is not updated when it is not in
+                 * the list, so start from the global time. */
+                for (a = 0; a < m.Nactive && !m.error; a++) {
+                    const int node = m.active[a];
+                    gsl_rng *rng = e.node_rng ? e.node_rng[m.Ni + node] : e.rng;
+
+                    m.t_time[node] = m.tt;
                     for (;;) {
                         double cum, rand, tau, delta = 0.0;
                         int j, tr;
@@ -122,7 +289,7 @@ SimInf_solver_ssm(
                             m.t_time[node] = m.next_unit_of_time;
                             break;
                         }
-                        tau = -log(gsl_rng_uniform_pos(e.rng)) /
+                        tau = -log(gsl_rng_uniform_pos(rng)) /
                             m.sum_t_rate[node];
                         if ((tau + m.t_time[node]) >= m.next_unit_of_time) {
                             m.t_time[node] = m.next_unit_of_time;
@@ -131,11 +298,18 @@ SimInf_solver_ssm(
                         m.t_time[node] += tau;
 
                         /* 1b) Determine the transition that did occur
-                         * (direct SSA). */
-                        rand = gsl_rng_uniform_pos(e.rng) * m.sum_t_rate[node];
-                        for (tr = 0, cum = m.t_rate[node * m.Nt];
-                             tr < m.Nt && rand > cum;
-                             tr++, cum += m.t_rate[node * m.Nt + tr]);
+                         * (direct SSA). Search the sum tree if it is
+                         * used, else scan the rates. */
+                        rand = gsl_rng_uniform_pos(rng) * m.sum_t_rate[node];
+                        if (m.Ntree) {
+                            tr = SimInf_sum_tree_select(
+                                &m.t_tree[2 * (size_t)m.Ntree * node],
+                                m.Ntree, rand);
+                        } else {
+                            for (tr = 0, cum = m.t_rate[node * m.Nt];
+                                 tr < m.Nt && rand > cum;
+                                 tr++, cum += m.t_rate[node * m.Nt + tr]);
+                        }
 
                         /* Elaborate floating point fix: */
                         if (tr >= m.Nt)
@@ -150,6 +324,18 @@ SimInf_solver_ssm(
                                floating point errors in the iterated
                                recalculated rates. */
                             if (m.t_rate[node * m.Nt + tr] == 0.0) {
+                                /* With compensated summation, first
+                                 * recompute the sum from the rates
+                                 * and sample again if it is
+                                 * positive. */
+                                if (m.sum_t_rate_c) {
+                                    m.sum_t_rate[node] = SimInf_sum_t_rate(
+                                        &m.t_rate[node * m.Nt], m.Nt);
+                                    m.sum_t_rate_c[node] = 0.0;
+                                    if (m.sum_t_rate[node] > 0.0)
+                                        continue;
+                                }
+
                                 /* nil event: zero out and move on */
                                 m.sum_t_rate[node] = 0.0;
                                 break;
@@ -157,6 +343,7 @@ SimInf_solver_ssm(
                         }
 
                         /* 1c) Update the state of the node */
+                        m.n_transitions++;
                         for (j = m.jcS[tr]; j < m.jcS[tr + 1]; j++) {
                             m.u[node * m.Nc + m.irS[j]] += m.prS[j];
                             if (m.u[node * m.Nc + m.irS[j]] < 0) {
@@ -171,15 +358,22 @@ SimInf_solver_ssm(
 
                         /* 1d) Recalculate sum_t_rate[node] using
                          * dependency graph. */
+                        SimInf_compartment_model_rates(
+                            &m, m.t_rate_new, &m.irG[m.jcG[tr]],
+                            m.jcG[tr + 1] - m.jcG[tr], node, m.v,
+                            m.t_time[node]);
+                        m.n_rates += m.jcG[tr + 1] - m.jcG[tr];
                         for (j = m.jcG[tr]; j < m.jcG[tr + 1]; j++) {
                             const double old = m.t_rate[node * m.Nt + m.irG[j]];
-                            const double rate = (*m.tr_fun[m.irG[j]])(
-                                &m.u[node * m.Nc], &m.v[node * m.Nd],
-                                &m.ldata[node * m.Nld], m.gdata,
-                                m.t_time[node]);
+                            const double rate = m.t_rate_new[j - m.jcG[tr]];
 
                             m.t_rate[node * m.Nt + m.irG[j]] = rate;
                             delta += rate - old;
+                            if (m.Ntree) {
+                                SimInf_sum_tree_update(
+                                    &m.t_tree[2 * (size_t)m.Ntree * node],
+                                    m.Ntree, m.irG[j], rate);
+                            }
                             if (!R_FINITE(rate) || rate < 0.0) {
                                 SimInf_print_status(m.Nc, &m.u[node * m.Nc],
                                                     m.Nd, &m.v[node * m.Nd],
@@ -189,63 +383,97 @@ SimInf_solver_ssm(
                                 m.error = SIMINF_ERR_INVALID_RATE;
                             }
                         }
-                        m.sum_t_rate[node] += delta;
+                        if (m.Ntree) {
+                            m.sum_t_rate[node] = m.t_tree[2 * (size_t)m.Ntree * node + 1];
+                        } else if (m.sum_t_rate_c) {
+                            SimInf_sum_t_rate_add(&m.sum_t_rate[node],
+                                                  &m.sum_t_rate_c[node],
+                                                  delta);
+                        } else {
+                            m.sum_t_rate[node] += delta;
+                        }
                     }
                 }
 
                 *&events[i] = e;
                 *&model[i] = m;
+                SimInf_profile_stop(profile, SIMINF_PROFILE_TRANSITIONS, &t0);
 
                 /* (2) Incorporate all scheduled E1 events */
                 SimInf_process_events(&model[i], &events[i], 0);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_E1, &t0);
             }
 
             #ifdef _OPENMP
             #  pragma omp barrier
             #endif
 
+            /* (3) Incorporate all scheduled E2 events */
+            t0 = SimInf_profile_start(profile);
+            SimInf_process_E2_events(model, events);
+            SimInf_profile_stop(profile, SIMINF_PROFILE_E2, &t0);
+
             #ifdef _OPENMP
-            #  pragma omp master
+            #  pragma omp barrier
             #endif
-            {
-                /* (3) Incorporate all scheduled E2 events */
-                SimInf_process_events(model, events, 1);
-            }
 
+            /* Count the number of individuals in every node before
+             * the post time step function is called, so that the
+             * local spread does not recount the neighbors. */
             #ifdef _OPENMP
-            #  pragma omp barrier
+            #  pragma omp for schedule(runtime)
             #endif
+            for (i = 0; i < Nthread; i++) {
+                t0 = SimInf_profile_start(profile);
+                SimInf_compartment_model_population(&model[i]);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_POST_TIME_STEP, &t0);
+            }
 
             #ifdef _OPENMP
-            #  pragma omp for
+            #  pragma omp for schedule(runtime)
             #endif
             for (i = 0; i < Nthread; i++) {
                 int node;
                 SimInf_compartment_model m = *&model[i];
 
+                t0 = SimInf_profile_start(profile);
+
                 /* (4) Incorporate model specific actions after each
                  * timestep e.g. update the infectious pressure
                  * variable. Moreover, update transition rates in
-                 * nodes that are indicated for update */
+                 * nodes that are indicated for update. The post time
+                 * step function is called for a block of nodes at a
+                 * time, before the rates in the block are updated.
+                 * Then add the node to the active list if it has a
+                 * positive sum of the transition rates. Every node is
+                 * visited, since the post time step function can
+                 * change the continuous state of any node. */
+                SimInf_local_spread_context(model[0].u, model[0].N, m.Nc);
+                m.Nactive = 0;
                 for (node = 0; node < m.Nn; node++) {
-                    const int rc = m.pts_fun(
-                        &m.v_new[node * m.Nd], &m.u[node * m.Nc],
-                        &m.v[node * m.Nd], &m.ldata[node * m.Nld],
-                        m.gdata, m.Ni + node, m.tt);
-
-                    if (rc < 0) {
-                        m.error = rc;
-                        break;
-                    } else if (rc > 0 || m.update_node[node]) {
+                    const int block = node - node % SIMINF_NODES_BLOCK;
+
+                    if (node == block) {
+                        const int rc =
+                            SimInf_compartment_model_post_time_step(&m, node);
+
+                        if (rc < 0) {
+                            m.error = rc;
+                            break;
+                        }
+                    }
+
+                    if (m.update_node[node]) {
                         /* Update transition rates */
                         int j = 0;
                         double delta = 0.0;
+                        const double *t_rate_new =
+                            SimInf_compartment_model_rates_new(&m, node, block);
 
+                        m.n_rates += m.Nt;
                         for (; j < m.Nt; j++) {
                             const double old = m.t_rate[node * m.Nt + j];
-                            const double rate = (*m.tr_fun[j])(
-                                &m.u[node * m.Nc], &m.v_new[node * m.Nd],
-                                &m.ldata[node * m.Nld], m.gdata, m.tt);
+                            const double rate = t_rate_new[j];
 
                             m.t_rate[node * m.Nt + j] = rate;
                             delta += rate - old;
@@ -257,12 +485,35 @@ SimInf_solver_ssm(
                                 m.error = SIMINF_ERR_INVALID_RATE;
                             }
                         }
-                        m.sum_t_rate[node] += delta;
+                        if (m.Ntree) {
+                            double *tree = &m.t_tree[2 * (size_t)m.Ntree * node];
+
+                            SimInf_sum_tree_build(tree, m.Ntree,
+                                                  &m.t_rate[node * m.Nt], m.Nt);
+                            m.sum_t_rate[node] = tree[1];
+                        } else {
+                            m.sum_t_rate[node] += delta;
+                        }
 
                         m.update_node[node] = 0;
                     }
+
+                    /* With compensated summation, recompute the sum
+                     * of the rates in every node after each unit of
+                     * time to remove the accumulated error. */
+                    if (m.sum_t_rate_c && !m.Ntree) {
+                        m.sum_t_rate[node] = SimInf_sum_t_rate(
+                            &m.t_rate[node * m.Nt], m.Nt);
+                        m.sum_t_rate_c[node] = 0.0;
+                    }
+
+                    if (m.sum_t_rate[node] > 0.0)
+                        m.active[m.Nactive++] = node;
                 }
 
+                SimInf_local_spread_context(NULL, NULL, 0);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_POST_TIME_STEP, &t0);
+
                 /* (5) The global time now equals next unit of time. */
                 m.tt = m.next_unit_of_time;
                 m.next_unit_of_time += 1.0;
@@ -270,28 +521,38 @@ SimInf_solver_ssm(
                 /* (6) Store solution if tt has passed the next time
                  * in tspan. Report solution up to, but not including
                  * tt. The default is to store the solution in a dense
-                 * matrix (U and/or V non-null pointers) (6a).
+                 * matrix (U and/or V, or their compact versions U16
+                 * and/or V32, non-null pointers) (6a).
                  * However, it is possible to store the solution in a
-                 * sparse matrix. In that case, the solution is stored
-                 * outside the 'pragma omp parallel' statement (6b). */
+                 * sparse matrix (6b). In that case, each partition
+                 * copies the state of its nodes, and the reducers of
+                 * the solution are applied outside the 'pragma omp
+                 * parallel' statement (6c). */
                 /* 6a) Handle the case where the solution is stored in
                  * a dense matrix */
-                /* Copy compartment state to U */
-                while (m.U && m.U_it < m.tlen && m.tt > m.tspan[m.U_it])
-                    memcpy(&m.U[m.Nc * ((m.Ntot * m.U_it++) + m.Ni)],
-                           m.u, m.Nn * m.Nc * sizeof(int));
-                /* Copy continuous state to V */
-                while (m.V && m.V_it < m.tlen && m.tt > m.tspan[m.V_it])
-                    memcpy(&m.V[m.Nd * ((m.Ntot * m.V_it++) + m.Ni)],
-                           m.v_new, m.Nn * m.Nd * sizeof(double));
+                /* Copy compartment state to U and continuous state
+                 * to V */
+                if (!m.error)
+                    m.error = SimInf_store_solution_dense_partition(&m);
+
+                /* 6b) Handle the case where the solution is stored in
+                 * a sparse matrix */
+                SimInf_store_solution_sparse_partition(&m);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_STORE, &t0);
 
                 *&model[i] = m;
             }
         }
 
-        /* 6b) Handle the case where the solution is stored in a sparse
-         * matrix */
-        SimInf_store_solution_sparse(model);
+        /* 6c) Advance the time index of the sparse solution, and
+         * handle the case where the solution is written to a file or
+         * reduced */
+        {
+            double t0 = SimInf_profile_start(profile);
+            SimInf_store_solution_sparse(model);
+            SimInf_profile_stop(profile, SIMINF_PROFILE_STORE, &t0);
+            SimInf_profile_step(profile);
+        }
 
         /* Swap the pointers to the continuous state variable so that
          * 'v' equals 'v_new'. Moreover, check for error. */
@@ -314,14 +575,16 @@ SimInf_solver_ssm(
 /**
  * Initialize and run siminf solver
  *
- * @param args Structure with data for the solver.
+ * @param args Structure with data for the solver. If args->Nrep > 0,
+ *        the data structures of the solver are created once and
+ *        reset for each replicate.
  * @return 0 if Ok, else error code.
  */
 int attribute_hidden
 SimInf_run_solver_ssm(
     SimInf_solver_args *args)
 {
-    int error = 0;
+    int error = 0, r = 0;
     gsl_rng *rng = NULL;
     SimInf_scheduled_events *events = NULL;
     SimInf_compartment_model *model = NULL;
@@ -331,6 +594,7 @@ SimInf_run_solver_ssm(
         error = SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
         goto cleanup;                           /* #nocov */
     }
+    SimInf_solver_args_replicate(args, r);
     gsl_rng_set(rng, args->seed);
 
     error = SimInf_compartment_model_create(&model, args);
@@ -341,7 +605,36 @@ SimInf_run_solver_ssm(
     if (error)
         goto cleanup; /* #nocov */
 
-    error = SimInf_solver_ssm(model, events);
+    /* Restore the state of the solver from the checkpoint. */
+    if (args->resume) {
+        error = SimInf_solver_checkpoint(args->resume, "ssm", model,
+                                         events, args);
+        if (!error && args->resume->pos != args->resume->size)
+            error = SIMINF_ERR_INVALID_CHECKPOINT;
+        if (error)
+            goto cleanup;
+    }
+
+    for (;;) {
+        error = SimInf_solver_ssm(model, events, args->resume != NULL);
+        if (error || ++r >= args->Nrep)
+            break;
+
+        /* Reset the solver to simulate the next replicate. */
+        SimInf_solver_args_replicate(args, r);
+        gsl_rng_set(rng, args->seed);
+        SimInf_compartment_model_reset(model, args);
+        SimInf_scheduled_events_reset(events, args, rng);
+    }
+
+    /* Add the work of the solver to the profile. */
+    SimInf_compartment_model_profile(model, args->profile);
+
+    /* Save the state of the solver at the end of the simulation. */
+    if (!error && args->checkpoint) {
+        error = SimInf_solver_checkpoint(args->checkpoint, "ssm", model,
+                                         events, args);
+    }
 
 cleanup:
     gsl_rng_free(rng);
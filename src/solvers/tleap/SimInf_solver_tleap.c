@@ -0,0 +1,662 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 Pavol Bauer
+ * Copyright (C) 2017 -- 2019 Robin Eriksson
+ * Copyright (C) 2015 -- 2019 Stefan Engblom
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <R_ext/Visibility.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+
+#include "SimInf.h"
+#include "misc/SimInf_openmp.h"
+#include "misc/SimInf_local_spread.h"
+#include "SimInf_solver_tleap.h"
+
+/* Simulate the exact SSA in a node when fewer transitions than this
+ * are expected during a leap. */
+#define SIMINF_TLEAP_EXACT 10.0
+
+/* The number of exact SSA steps to take in a node before trying to
+ * leap again. */
+#define SIMINF_TLEAP_NSSA 100
+
+/**
+ * Sum the transition rates in a node, and check that they are
+ * valid.
+ *
+ * @param m data for the partition of nodes.
+ * @param node the node in the partition.
+ * @param t the time.
+ */
+static void
+SimInf_tleap_sum_rates(
+    SimInf_compartment_model *m,
+    int node,
+    double t)
+{
+    m->sum_t_rate[node] = 0.0;
+    for (int j = 0; j < m->Nt; j++) {
+        const double rate = m->t_rate[node * m->Nt + j];
+
+        m->sum_t_rate[node] += rate;
+        if (!R_FINITE(rate) || rate < 0.0) {
+            SimInf_print_status(m->Nc, &m->u[node * m->Nc],
+                                m->Nd, &m->v[node * m->Nd],
+                                m->Nld, &m->ldata[node * m->Nld],
+                                m->Ni + node, t, rate, j);
+            m->error = SIMINF_ERR_INVALID_RATE;
+        }
+    }
+}
+
+/**
+ * Recalculate all transition rates in a node, and their sum.
+ *
+ * @param m data for the partition of nodes.
+ * @param node the node in the partition.
+ * @param v the continuous state of the nodes in the partition.
+ * @param t the time.
+ */
+static void
+SimInf_tleap_rates(
+    SimInf_compartment_model *m,
+    int node,
+    const double *v,
+    double t)
+{
+    SimInf_compartment_model_rates(
+        m, &m->t_rate[node * m->Nt], NULL, m->Nt, node, v, t);
+    m->n_rates += m->Nt;
+    SimInf_tleap_sum_rates(m, node, t);
+}
+
+/**
+ * Select the leap in a node with the method of Cao, Gillespie and
+ * Petzold (2006), such that the expected change and the standard
+ * deviation of the change of the state of every compartment during
+ * the leap are bounded by a fraction epsilon of the state.
+ *
+ * @param m data for the partition of nodes.
+ * @param node the node in the partition.
+ * @param epsilon the error control parameter.
+ * @param mu buffer of length Nc for the expected change.
+ * @param sigma2 buffer of length Nc for the variance of the change.
+ * @return the leap, INFINITY if no compartment changes.
+ */
+static double
+SimInf_tleap_tau(
+    const SimInf_compartment_model *m,
+    int node,
+    double epsilon,
+    double *mu,
+    double *sigma2)
+{
+    const int *u = &m->u[node * m->Nc];
+    const double *rate = &m->t_rate[node * m->Nt];
+    double tau = INFINITY;
+
+    memset(mu, 0, m->Nc * sizeof(double));
+    memset(sigma2, 0, m->Nc * sizeof(double));
+    for (int j = 0; j < m->Nt; j++) {
+        if (rate[j] > 0.0) {
+            for (int k = m->jcS[j]; k < m->jcS[j + 1]; k++) {
+                mu[m->irS[k]] += m->prS[k] * rate[j];
+                sigma2[m->irS[k]] += (double)m->prS[k] * m->prS[k] * rate[j];
+            }
+        }
+    }
+
+    for (int i = 0; i < m->Nc; i++) {
+        const double bound = fmax(epsilon * u[i], 1.0);
+
+        if (mu[i] != 0.0)
+            tau = fmin(tau, bound / fabs(mu[i]));
+        if (sigma2[i] > 0.0)
+            tau = fmin(tau, bound * bound / sigma2[i]);
+    }
+
+    return tau;
+}
+
+/**
+ * Simulate one transition in a node with the direct SSA, or move the
+ * time of the node to the next unit of time if no transition occurs
+ * before it.
+ *
+ * @param m data for the partition of nodes.
+ * @param node the node in the partition.
+ * @param rng the random number generator of the node.
+ * @return 1 if a transition occurred, else 0.
+ */
+static int
+SimInf_tleap_ssa(
+    SimInf_compartment_model *m,
+    int node,
+    gsl_rng *rng)
+{
+    double cum, rand, tau, delta = 0.0;
+    int j, tr;
+
+    if (m->sum_t_rate[node] <= 0.0) {
+        m->t_time[node] = m->next_unit_of_time;
+        return 0;
+    }
+
+    tau = -log(gsl_rng_uniform_pos(rng)) / m->sum_t_rate[node];
+    if ((tau + m->t_time[node]) >= m->next_unit_of_time) {
+        m->t_time[node] = m->next_unit_of_time;
+        return 0;
+    }
+    m->t_time[node] += tau;
+
+    /* Determine the transition that did occur. */
+    rand = gsl_rng_uniform_pos(rng) * m->sum_t_rate[node];
+    for (tr = 0, cum = m->t_rate[node * m->Nt];
+         tr < m->Nt && rand > cum;
+         tr++, cum += m->t_rate[node * m->Nt + tr]);
+
+    /* Elaborate floating point fix: */
+    if (tr >= m->Nt)
+        tr = m->Nt - 1;
+    if (m->t_rate[node * m->Nt + tr] == 0.0) {
+        for ( ; tr > 0 && m->t_rate[node * m->Nt + tr] == 0.0; tr--);
+
+        if (m->t_rate[node * m->Nt + tr] == 0.0) {
+            /* nil event: zero out and move on */
+            m->sum_t_rate[node] = 0.0;
+            m->t_time[node] = m->next_unit_of_time;
+            return 0;
+        }
+    }
+
+    /* Update the state of the node */
+    m->n_transitions++;
+    for (j = m->jcS[tr]; j < m->jcS[tr + 1]; j++) {
+        m->u[node * m->Nc + m->irS[j]] += m->prS[j];
+        if (m->u[node * m->Nc + m->irS[j]] < 0) {
+            SimInf_print_status(m->Nc, &m->u[node * m->Nc],
+                                m->Nd, &m->v[node * m->Nd],
+                                m->Nld, &m->ldata[node * m->Nld],
+                                m->Ni + node, m->t_time[node], 0, tr);
+            m->error = SIMINF_ERR_NEGATIVE_STATE;
+        }
+    }
+
+    /* Recalculate sum_t_rate[node] using dependency graph. */
+    SimInf_compartment_model_rates(
+        m, m->t_rate_new, &m->irG[m->jcG[tr]], m->jcG[tr + 1] - m->jcG[tr],
+        node, m->v, m->t_time[node]);
+    m->n_rates += m->jcG[tr + 1] - m->jcG[tr];
+    for (j = m->jcG[tr]; j < m->jcG[tr + 1]; j++) {
+        const double old = m->t_rate[node * m->Nt + m->irG[j]];
+        const double rate = m->t_rate_new[j - m->jcG[tr]];
+
+        m->t_rate[node * m->Nt + m->irG[j]] = rate;
+        delta += rate - old;
+        if (!R_FINITE(rate) || rate < 0.0) {
+            SimInf_print_status(m->Nc, &m->u[node * m->Nc],
+                                m->Nd, &m->v[node * m->Nd],
+                                m->Nld, &m->ldata[node * m->Nld],
+                                m->Ni + node, m->t_time[node],
+                                rate, m->irG[j]);
+            m->error = SIMINF_ERR_INVALID_RATE;
+        }
+    }
+    m->sum_t_rate[node] += delta;
+
+    return 1;
+}
+
+/**
+ * Leap the state of a node with tau. The number of times each
+ * transition occurs is Poisson distributed. If the state of any
+ * compartment becomes negative, the leap is undone and 0 is
+ * returned.
+ *
+ * @param m data for the partition of nodes.
+ * @param node the node in the partition.
+ * @param rng the random number generator of the node.
+ * @param tau the leap.
+ * @param n buffer of length Nt for the number of times each
+ *        transition occurs.
+ * @return 1 if the leap was taken, else 0.
+ */
+static int
+SimInf_tleap_leap(
+    SimInf_compartment_model *m,
+    int node,
+    gsl_rng *rng,
+    double tau,
+    int *n)
+{
+    int *u = &m->u[node * m->Nc];
+    const double *rate = &m->t_rate[node * m->Nt];
+    int negative = 0;
+
+    for (int j = 0; j < m->Nt; j++) {
+        n[j] = rate[j] > 0.0 ? (int)gsl_ran_poisson(rng, rate[j] * tau) : 0;
+        for (int k = m->jcS[j]; n[j] && k < m->jcS[j + 1]; k++)
+            u[m->irS[k]] += n[j] * m->prS[k];
+    }
+
+    for (int i = 0; i < m->Nc; i++) {
+        if (u[i] < 0)
+            negative = 1;
+    }
+
+    if (negative) {
+        for (int j = 0; j < m->Nt; j++) {
+            for (int k = m->jcS[j]; n[j] && k < m->jcS[j + 1]; k++)
+                u[m->irS[k]] -= n[j] * m->prS[k];
+        }
+
+        return 0;
+    }
+
+    for (int j = 0; j < m->Nt; j++)
+        m->n_transitions += n[j];
+
+    return 1;
+}
+
+/**
+ * Simulate the continuous-time Markov chain in a node until the next
+ * unit of time. The node leaps when many transitions are expected
+ * during the leap, else it takes exact SSA steps.
+ *
+ * @param m data for the partition of nodes.
+ * @param node the node in the partition.
+ * @param rng the random number generator of the node.
+ * @param epsilon the error control parameter.
+ * @param n buffer of length Nt.
+ * @param mu buffer of length Nc.
+ * @param sigma2 buffer of length Nc.
+ */
+static void
+SimInf_tleap_node(
+    SimInf_compartment_model *m,
+    int node,
+    gsl_rng *rng,
+    double epsilon,
+    int *n,
+    double *mu,
+    double *sigma2)
+{
+    while (!m->error && m->t_time[node] < m->next_unit_of_time) {
+        double tau;
+
+        if (m->sum_t_rate[node] <= 0.0) {
+            m->t_time[node] = m->next_unit_of_time;
+            break;
+        }
+
+        tau = fmin(SimInf_tleap_tau(m, node, epsilon, mu, sigma2),
+                   m->next_unit_of_time - m->t_time[node]);
+
+        /* Halve the leap until the state of no compartment becomes
+         * negative, or until it is too short to leap. */
+        while (tau * m->sum_t_rate[node] >= SIMINF_TLEAP_EXACT &&
+               !SimInf_tleap_leap(m, node, rng, tau, n)) {
+            tau /= 2.0;
+        }
+
+        if (tau * m->sum_t_rate[node] < SIMINF_TLEAP_EXACT) {
+            for (int k = 0; k < SIMINF_TLEAP_NSSA && !m->error; k++) {
+                if (!SimInf_tleap_ssa(m, node, rng))
+                    break;
+            }
+        } else {
+            if (m->t_time[node] + tau >= m->next_unit_of_time)
+                m->t_time[node] = m->next_unit_of_time;
+            else
+                m->t_time[node] += tau;
+            SimInf_tleap_rates(m, node, m->v, m->t_time[node]);
+        }
+    }
+}
+
+/**
+ * SimInf tau-leaping solver
+ *
+ * @param model data for each partition of nodes.
+ * @param events the scheduled events of each partition.
+ * @param epsilon the error control parameter.
+ * @param n buffer (Nt X Nthread) for the number of times each
+ *        transition occurs during a leap.
+ * @param mu buffer (Nc X Nthread) for the expected change of the
+ *        state during a leap.
+ * @param sigma2 buffer (Nc X Nthread) for the variance of the change
+ *        of the state during a leap.
+ * @return 0 if Ok, else error code.
+ */
+static int
+SimInf_solver_tleap(
+    SimInf_compartment_model *model,
+    SimInf_scheduled_events *events,
+    double epsilon,
+    int *n,
+    double *mu,
+    double *sigma2,
+    int resume)
+{
+    int Nthread = model->Nthread;
+    SimInf_profile *profile = model->profile;
+    int k;
+
+    #ifdef _OPENMP
+    #  pragma omp parallel num_threads(SimInf_num_threads())
+    #endif
+    {
+        int i;
+
+        SimInf_set_schedule();
+
+        #ifdef _OPENMP
+        #  pragma omp for schedule(runtime)
+        #endif
+        for (i = 0; i < Nthread; i++) {
+            int node;
+            SimInf_compartment_model m = *&model[i];
+
+            /* Initialize the transition rate for every transition and
+             * every node. Moreover, initialize time in each node. The
+             * transition rates and their sum are restored instead if
+             * the simulation is resumed from a checkpoint. */
+            if (resume)
+                continue;
+
+            SimInf_compartment_model_rates_nodes(
+                &m, m.t_rate, 0, m.Nn, m.v, m.tt);
+            m.n_rates += (double)m.Nn * m.Nt;
+            for (node = 0; node < m.Nn; node++) {
+                SimInf_tleap_sum_rates(&m, node, m.tt);
+                m.t_time[node] = m.tt;
+            }
+
+            *&model[i] = m;
+        }
+    }
+
+    /* Check for error during initialization. */
+    for (k = 0; k < Nthread; k++)
+        if (model[k].error)
+            return model[k].error;
+
+    /* Main loop. */
+    for (;;) {
+        /* Read the scheduled events up to the global time if the
+         * events are read from a file. */
+        int error = SimInf_scheduled_events_read(events, model[0].tt);
+        if (error)
+            return error;
+
+        #ifdef _OPENMP
+        #  pragma omp parallel num_threads(SimInf_num_threads())
+        #endif
+        {
+            int i;
+            double t0;
+
+            SimInf_set_schedule();
+
+            #ifdef _OPENMP
+            #  pragma omp for schedule(runtime)
+            #endif
+            for (i = 0; i < Nthread; i++) {
+                int node;
+                SimInf_scheduled_events e = *&events[i];
+                SimInf_compartment_model m = *&model[i];
+
+                t0 = SimInf_profile_start(profile);
+
+                /* (1) Handle internal epidemiological model,
+                 * continuous-time Markov chain, with tau-leaping. */
+                for (node = 0; node < m.Nn && !m.error; node++) {
+                    gsl_rng *rng = e.node_rng ? e.node_rng[m.Ni + node] : e.rng;
+
+                    SimInf_tleap_node(&m, node, rng, epsilon,
+                                      &n[(size_t)i * m.Nt],
+                                      &mu[(size_t)i * m.Nc],
+                                      &sigma2[(size_t)i * m.Nc]);
+                }
+
+                *&events[i] = e;
+                *&model[i] = m;
+                SimInf_profile_stop(profile, SIMINF_PROFILE_TRANSITIONS, &t0);
+
+                /* (2) Incorporate all scheduled E1 events */
+                SimInf_process_events(&model[i], &events[i], 0);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_E1, &t0);
+            }
+
+            #ifdef _OPENMP
+            #  pragma omp barrier
+            #endif
+
+            /* (3) Incorporate all scheduled E2 events */
+            t0 = SimInf_profile_start(profile);
+            SimInf_process_E2_events(model, events);
+            SimInf_profile_stop(profile, SIMINF_PROFILE_E2, &t0);
+
+            #ifdef _OPENMP
+            #  pragma omp barrier
+            #endif
+
+            /* Count the number of individuals in every node before
+             * the post time step function is called, so that the
+             * local spread does not recount the neighbors. */
+            #ifdef _OPENMP
+            #  pragma omp for schedule(runtime)
+            #endif
+            for (i = 0; i < Nthread; i++) {
+                t0 = SimInf_profile_start(profile);
+                SimInf_compartment_model_population(&model[i]);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_POST_TIME_STEP, &t0);
+            }
+
+            #ifdef _OPENMP
+            #  pragma omp for schedule(runtime)
+            #endif
+            for (i = 0; i < Nthread; i++) {
+                int node;
+                SimInf_compartment_model m = *&model[i];
+
+                t0 = SimInf_profile_start(profile);
+
+                /* (4) Incorporate model specific actions after each
+                 * timestep e.g. update the infectious pressure
+                 * variable. Moreover, update transition rates in
+                 * nodes that are indicated for update. The post time
+                 * step function is called for a block of nodes at a
+                 * time, before the rates in the block are updated. */
+                SimInf_local_spread_context(model[0].u, model[0].N, m.Nc);
+                for (node = 0; node < m.Nn; node++) {
+                    const int block = node - node % SIMINF_NODES_BLOCK;
+
+                    if (node == block) {
+                        const int rc =
+                            SimInf_compartment_model_post_time_step(&m, node);
+
+                        if (rc < 0) {
+                            m.error = rc;
+                            break;
+                        }
+                    }
+
+                    if (m.update_node[node]) {
+                        memcpy(&m.t_rate[node * m.Nt],
+                               SimInf_compartment_model_rates_new(&m, node, block),
+                               m.Nt * sizeof(double));
+                        m.n_rates += m.Nt;
+                        SimInf_tleap_sum_rates(&m, node, m.tt);
+                        m.update_node[node] = 0;
+                    }
+                }
+
+                SimInf_local_spread_context(NULL, NULL, 0);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_POST_TIME_STEP, &t0);
+
+                /* (5) The global time now equals next unit of time. */
+                m.tt = m.next_unit_of_time;
+                m.next_unit_of_time += 1.0;
+
+                /* (6) Store solution if tt has passed the next time
+                 * in tspan. Report solution up to, but not including
+                 * tt. The default is to store the solution in a dense
+                 * matrix (U and/or V, or their compact versions U16
+                 * and/or V32, non-null pointers) (6a).
+                 * However, it is possible to store the solution in a
+                 * sparse matrix (6b). In that case, each partition
+                 * copies the state of its nodes, and the reducers of
+                 * the solution are applied outside the 'pragma omp
+                 * parallel' statement (6c). */
+                /* 6a) Handle the case where the solution is stored in
+                 * a dense matrix */
+                /* Copy compartment state to U and continuous state
+                 * to V */
+                if (!m.error)
+                    m.error = SimInf_store_solution_dense_partition(&m);
+
+                /* 6b) Handle the case where the solution is stored in
+                 * a sparse matrix */
+                SimInf_store_solution_sparse_partition(&m);
+                SimInf_profile_stop(profile, SIMINF_PROFILE_STORE, &t0);
+
+                *&model[i] = m;
+            }
+        }
+
+        /* 6c) Advance the time index of the sparse solution, and
+         * handle the case where the solution is written to a file or
+         * reduced */
+        {
+            double t0 = SimInf_profile_start(profile);
+            SimInf_store_solution_sparse(model);
+            SimInf_profile_stop(profile, SIMINF_PROFILE_STORE, &t0);
+            SimInf_profile_step(profile);
+        }
+
+        /* Swap the pointers to the continuous state variable so that
+         * 'v' equals 'v_new'. Moreover, check for error. */
+        for (k = 0; k < Nthread; k++) {
+            double *v_tmp = model[k].v;
+            model[k].v = model[k].v_new;
+            model[k].v_new = v_tmp;
+            if (model[k].error)
+                return model[k].error;
+        }
+
+        /* If the simulation has reached the final time, exit. */
+        if (model[0].U_it >= model[0].tlen)
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Initialize and run the SimInf tau-leaping solver
+ *
+ * @param args Structure with data for the solver. If args->Nrep > 0,
+ *        the data structures of the solver are created once and
+ *        reset for each replicate.
+ * @return 0 if Ok, else error code.
+ */
+int attribute_hidden
+SimInf_run_solver_tleap(
+    SimInf_solver_args *args)
+{
+    int error = 0, r = 0;
+    int *n = NULL;
+    double *mu = NULL, *sigma2 = NULL;
+    gsl_rng *rng = NULL;
+    SimInf_scheduled_events *events = NULL;
+    SimInf_compartment_model *model = NULL;
+
+    /* Buffers for the leap in each partition of nodes. */
+    n = malloc((size_t)args->Nthread * args->Nt * sizeof(int));
+    mu = malloc((size_t)args->Nthread * args->Nc * sizeof(double));
+    sigma2 = malloc((size_t)args->Nthread * args->Nc * sizeof(double));
+    if (!n || !mu || !sigma2) {
+        error = SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
+        goto cleanup;                           /* #nocov */
+    }
+
+    rng = gsl_rng_alloc(gsl_rng_mt19937);
+    if (!rng) {
+        error = SIMINF_ERR_ALLOC_MEMORY_BUFFER; /* #nocov */
+        goto cleanup;                           /* #nocov */
+    }
+    SimInf_solver_args_replicate(args, r);
+    gsl_rng_set(rng, args->seed);
+
+    error = SimInf_compartment_model_create(&model, args);
+    if (error)
+        goto cleanup; /* #nocov */
+
+    error = SimInf_scheduled_events_create(&events, args, rng);
+    if (error)
+        goto cleanup; /* #nocov */
+
+    /* Restore the state of the solver from the checkpoint. */
+    if (args->resume) {
+        error = SimInf_solver_checkpoint(args->resume, "tleap", model,
+                                         events, args);
+        if (!error && args->resume->pos != args->resume->size)
+            error = SIMINF_ERR_INVALID_CHECKPOINT;
+        if (error)
+            goto cleanup;
+    }
+
+    for (;;) {
+        error = SimInf_solver_tleap(model, events, args->tleap_epsilon,
+                                    n, mu, sigma2, args->resume != NULL);
+        if (error || ++r >= args->Nrep)
+            break;
+
+        /* Reset the solver to simulate the next replicate. */
+        SimInf_solver_args_replicate(args, r);
+        gsl_rng_set(rng, args->seed);
+        SimInf_compartment_model_reset(model, args);
+        SimInf_scheduled_events_reset(events, args, rng);
+    }
+
+    /* Add the work of the solver to the profile. */
+    SimInf_compartment_model_profile(model, args->profile);
+
+    /* Save the state of the solver at the end of the simulation. */
+    if (!error && args->checkpoint) {
+        error = SimInf_solver_checkpoint(args->checkpoint, "tleap", model,
+                                         events, args);
+    }
+
+cleanup:
+    gsl_rng_free(rng);
+    SimInf_scheduled_events_free(events);
+    SimInf_compartment_model_free(model);
+    free(n);
+    free(mu);
+    free(sigma2);
+
+    return error;
+}
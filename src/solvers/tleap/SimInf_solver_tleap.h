@@ -0,0 +1,36 @@
+/*
+ * This file is part of SimInf, a framework for stochastic
+ * disease spread simulations.
+ *
+ * Copyright (C) 2015 Pavol Bauer
+ * Copyright (C) 2017 -- 2019 Robin Eriksson
+ * Copyright (C) 2015 -- 2019 Stefan Engblom
+ * Copyright (C) 2015 -- 2023 Stefan Widgren
+ *
+ * SimInf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimInf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_SIMINF_SOLVER_TLEAP_H
+#define INCLUDE_SIMINF_SOLVER_TLEAP_H
+
+#include "solvers/SimInf_solver.h"
+
+/* The default error control parameter of the tau selection. */
+#define SIMINF_TLEAP_EPSILON 0.03
+
+/* Declaration of the function to initialize and run the SimInf
+ * tau-leaping solver */
+int SimInf_run_solver_tleap(SimInf_solver_args *args);
+
+#endif